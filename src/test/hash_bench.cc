@@ -3,6 +3,7 @@
 #include <condition_variable>  // std::condition_variable
 #include <cstdlib>
 #include <mutex>   // std::mutex
+#include <sstream>
 #include <thread>  // std::thread
 
 /* --------- Different HashTable --------*/
@@ -16,6 +17,7 @@
 #include "util/slice.h"
 #include "util/test_util.h"
 #include "util/typename.h"
+#include "util/zipfian_int_distribution.h"
 using GFLAGS_NAMESPACE::ParseCommandLineFlags;
 using GFLAGS_NAMESPACE::RegisterFlagValidator;
 using GFLAGS_NAMESPACE::SetUsageMessage;
@@ -26,12 +28,28 @@ using namespace util;
 #define unlikely(x) (__builtin_expect (x, 0))
 
 #define IS_PMEM 1
+// Uncomment to benchmark the DRAM hash table without size accounting
+// #define NO_SIZE_COUNTER 1
 
 // For hash table
 DEFINE_bool (use_existing_db, false, "");
 DEFINE_bool (no_rehash, false, "control hash table do not do rehashing during insertion");
+DEFINE_bool (incremental_rehash, false, "rehash full buckets incrementally (DRAM hash table)");
+DEFINE_uint32 (maintenance_threads, 0, "background rehash/gc threads, 0 disables them (DRAM)");
+DEFINE_double (maintenance_grow_lf, 0.85, "bucket load factor the background threads grow at");
+DEFINE_double (maintenance_gc_ratio, 0.2, "deleted slot ratio the background threads compact at");
 DEFINE_uint64 (cell_count, 16, "");
+DEFINE_string (cell_type, "128",
+               "cell size of the DRAM hash table: 128, 256 or 1024. A comma-separated list runs "
+               "the benchmarks once per cell type, scaling cell_count to keep the bucket size");
 DEFINE_uint64 (bucket_count, 64 << 10, "bucket count");
+DEFINE_bool (huge_pages, false, "back cell arrays and bucket directories with 2 MiB pages (DRAM)");
+DEFINE_bool (reserved_cells, false, "reserve address space per bucket to rehash in place (DRAM)");
+DEFINE_string (numa_policy, "none", "none, interleave, partition or replicate (DRAM)");
+DEFINE_string (bucket_lock, "spin", "bucket lock policy: spin, backoff or ticket (DRAM)");
+DEFINE_uint32 (cache_cells, 0, "evict instead of growing buckets past this many cells, 0: off");
+DEFINE_int32 (numa_nodes, 0, "nodes the table and readnuma threads use, 0: all online nodes");
+DEFINE_bool (dtlb, false, "report the dTLB load misses of each benchmark (needs perf_event_open)");
 DEFINE_double (loadfactor, 0.72, "default loadfactor for turbohash.");
 DEFINE_uint32 (batch, 1000, "report batch");
 DEFINE_uint32 (readtime, 0, "if 0, then we read all keys");
@@ -43,6 +61,10 @@ DEFINE_uint64 (num, 120 * 1000000LU, "Number of total record");
 DEFINE_uint64 (read, 0, "Number of read operations");
 DEFINE_uint64 (write, 0, "Number of read operations");
 DEFINE_uint32 (repeat_delete, 0, "");
+DEFINE_uint32 (readbatch_size, 16, "number of keys looked up by each FindBatch in readbatch");
+DEFINE_uint32 (writebatch_size, 64, "number of keys inserted by each PutBatch in loadbatch");
+DEFINE_double (zipf_theta, 0.99, "skew of the keys skewwrite overwrites, in (0, 1)");
+DEFINE_bool (ycsb_zipf, false, "draw the ycsba keys from a zipfian distribution, see zipf_theta");
 
 DEFINE_bool (hist, false, "");
 
@@ -55,8 +77,39 @@ DEFINE_string (benchmarks,
 typedef turbo_pmem::unordered_map<size_t, size_t> Hashtable;
 static bool kIsPmem = true;
 #else
-typedef turbo::unordered_map<size_t, size_t> Hashtable;
+#ifdef NO_SIZE_COUNTER
+typedef turbo::util::NullCounter HashtableSizeCounter;
+#else
+typedef turbo::util::StripedCounter<64> HashtableSizeCounter;
+#endif
+// DRAM hash table with the given cell layout, see --cell_type,
+// cell allocator, see --huge_pages and --reserved_cells, and bucket lock, see --bucket_lock
+template <typename CellLayout, typename CellAllocator = turbo::util::AlignedCellAllocator,
+          typename BucketLock = turbo::util::SpinBitLock>
+using HashtableWithCell =
+    turbo::detail::TurboHashTable<size_t, size_t, turbo::hash<size_t>, std::equal_to<size_t>,
+                                  kTurboCellCountLimit, HashtableSizeCounter,
+                                  turbo::util::MallocRecordAllocator, CellLayout, CellAllocator,
+                                  BucketLock>;
+typedef HashtableWithCell<turbo::Cell128> Hashtable;
 static bool kIsPmem = false;
+
+// NUMA placement of the DRAM hash table, see --numa_policy
+turbo::NumaOptions NumaOptionsFromFlags () {
+    turbo::NumaOptions options;
+    options.node_count = FLAGS_numa_nodes;
+    if (FLAGS_numa_policy == "interleave") {
+        options.policy = turbo::NumaPolicy::kInterleave;
+    } else if (FLAGS_numa_policy == "partition") {
+        options.policy = turbo::NumaPolicy::kPartition;
+    } else if (FLAGS_numa_policy == "replicate") {
+        options.policy = turbo::NumaPolicy::kReplicate;
+    } else if (FLAGS_numa_policy != "none") {
+        fprintf (stderr, "unknown numa_policy: %s\n", FLAGS_numa_policy.c_str ());
+        exit (1);
+    }
+    return options;
+}
 #endif
 
 namespace {
@@ -346,8 +399,13 @@ static std::string TrimSpace (std::string s) {
 #endif
 
 }  // namespace
+template <typename Hashtable>
 class Benchmark {
 public:
+    using key_type = typename Hashtable::key_type;
+    using mapped_type = typename Hashtable::mapped_type;
+    using RecordType = typename Hashtable::RecordType;
+
     uint64_t num_;
     int value_size_;
     size_t reads_;
@@ -355,13 +413,20 @@ public:
     Hashtable* hashtable_ = nullptr;
     RandomKeyTrace* key_trace_;
     size_t trace_size_;
+    // computing zeta is linear in the trace size, so it is done once for all skewwrite runs
+    typedef zipfian_int_distribution<size_t>::param_type ZipfParam;
+    std::unique_ptr<ZipfParam> zipf_param_;
     size_t initial_capacity_;
+    size_t cell_count_;
     Benchmark ()
         : num_ (FLAGS_num),
           value_size_ (FLAGS_value_size),
           reads_ (FLAGS_read),
           writes_ (FLAGS_write),
-          key_trace_ (nullptr) {}
+          key_trace_ (nullptr),
+          // wider cells get proportionally fewer cells per bucket
+          cell_count_ (std::max (1LU, FLAGS_cell_count * ::Hashtable::CellMeta::CellSize () /
+                                          Hashtable::CellMeta::CellSize ())) {}
     ~Benchmark () {
         if (hashtable_ != nullptr) {
             delete hashtable_;
@@ -372,7 +437,7 @@ public:
     }
     void Run () {
         initial_capacity_ =
-            FLAGS_bucket_count * FLAGS_cell_count * (Hashtable::CellMeta::SlotCount () - 1);
+            FLAGS_bucket_count * cell_count_ * (Hashtable::CellMeta::SlotCount () - 1);
         size_t rehash_threshold = initial_capacity_ * FLAGS_loadfactor;
 
         // If do not rehash, we control the distinct key to the minimum between the FLAGS_num and
@@ -412,6 +477,14 @@ public:
             } else if (name == "loadverify") {
                 fresh_db = true;
                 method = &Benchmark::DoWriteRead;
+            } else if (name == "loadbatch") {
+                fresh_db = true;
+                method = &Benchmark::DoWriteBatch;
+            } else if (name == "bulkload") {
+                fresh_db = true;
+                // BulkLoad spawns FLAGS_thread workers itself
+                thread = 1;
+                method = &Benchmark::DoBulkLoad;
             } else if (name == "loadlat") {
                 fresh_db = true;
                 print_hist = true;
@@ -438,6 +511,30 @@ public:
                 fresh_db = false;
                 key_trace_->Randomize ();
                 method = &Benchmark::DoRead;
+            } else if (name == "readnuma") {
+                fresh_db = false;
+                key_trace_->Randomize ();
+                method = &Benchmark::DoReadNuma;
+            } else if (name == "counter") {
+                fresh_db = false;
+                key_trace_->Randomize ();
+                method = &Benchmark::DoCounter;
+            } else if (name == "skewwrite") {
+                fresh_db = false;
+                if (zipf_param_ == nullptr) {
+                    zipf_param_.reset (new ZipfParam (0, trace_size_ - 1, FLAGS_zipf_theta));
+                }
+                method = &Benchmark::DoSkewWrite;
+            } else if (name == "cache") {
+                fresh_db = false;
+                if (zipf_param_ == nullptr) {
+                    zipf_param_.reset (new ZipfParam (0, trace_size_ - 1, FLAGS_zipf_theta));
+                }
+                method = &Benchmark::DoCache;
+            } else if (name == "counterfindput") {
+                fresh_db = false;
+                key_trace_->Randomize ();
+                method = &Benchmark::DoCounterFindPut;
             } else if (name == "readall") {
                 fresh_db = false;
                 key_trace_->Randomize ();
@@ -446,6 +543,10 @@ public:
                 fresh_db = false;
                 key_trace_->Randomize ();
                 method = &Benchmark::DoReadNon;
+            } else if (name == "readbatch") {
+                fresh_db = false;
+                key_trace_->Randomize ();
+                method = &Benchmark::DoReadBatch;
             } else if (name == "readlat") {
                 fresh_db = false;
                 print_hist = true;
@@ -464,6 +565,10 @@ public:
                 fresh_db = false;
                 thread = 1;
                 method = &Benchmark::DoGC;
+            } else if (name == "shrink") {
+                fresh_db = false;
+                thread = 1;
+                method = &Benchmark::DoShrink;
             } else if (name == "rehashlat") {
                 fresh_db = false;
                 thread = 1;
@@ -472,9 +577,20 @@ public:
                 fresh_db = false;
                 thread = 1;
                 method = &Benchmark::DoStats;
+            } else if (name == "lockstats") {
+                fresh_db = false;
+                thread = 1;
+                method = &Benchmark::DoLockStats;
+            } else if (name == "tablestats") {
+                fresh_db = false;
+                thread = 1;
+                method = &Benchmark::DoTableStats;
             } else if (name == "ycsba") {
                 fresh_db = false;
                 key_trace_->Randomize ();
+                if (FLAGS_ycsb_zipf && zipf_param_ == nullptr) {
+                    zipf_param_.reset (new ZipfParam (0, trace_size_ - 1, FLAGS_zipf_theta));
+                }
                 method = &Benchmark::YCSBA;
             } else if (name == "ycsbb") {
                 fresh_db = false;
@@ -504,7 +620,7 @@ public:
                     remove ("/mnt/pmem/turbo_hash_pmem_desc");
                     remove ("/mnt/pmem/turbo_hash_pmem_sb");
                     hashtable_ = new Hashtable ();
-                    hashtable_->Initialize (FLAGS_bucket_count, FLAGS_cell_count);
+                    hashtable_->Initialize (FLAGS_bucket_count, cell_count_);
                 }
             } else {
                 if (hashtable_ == nullptr && FLAGS_use_existing_db) {
@@ -519,7 +635,19 @@ public:
             }
 #else
             if (fresh_db) {
-                hashtable_ = new Hashtable (FLAGS_bucket_count, FLAGS_cell_count);
+                hashtable_ =
+                    new Hashtable (FLAGS_bucket_count, cell_count_, NumaOptionsFromFlags ());
+                hashtable_->SetIncrementalRehash (FLAGS_incremental_rehash);
+                if (FLAGS_cache_cells > 0) {
+                    hashtable_->SetCacheMode (FLAGS_cache_cells);
+                }
+                if (FLAGS_maintenance_threads > 0) {
+                    turbo::MaintenanceOptions options;
+                    options.threads = FLAGS_maintenance_threads;
+                    options.grow_load_factor = FLAGS_maintenance_grow_lf;
+                    options.gc_deleted_ratio = FLAGS_maintenance_gc_ratio;
+                    hashtable_->StartMaintenance (options);
+                }
             } else if (hashtable_ == nullptr) {
                 perror ("Hash table not initialized.");
                 exit (1);
@@ -533,7 +661,7 @@ public:
         }
     }
 
-    static void NothingCallback (Hashtable::RecordType record) { return; }
+    static void NothingCallback (RecordType record) { return; }
 
     void DoRehash (ThreadState* thread) {
         INFO ("DoRehash. Thread %2d", thread->tid);
@@ -549,6 +677,77 @@ public:
         thread->stats.FinishedBatchOp (rehash_count);
     }
 
+    void DoShrink (ThreadState* thread) {
+#ifdef IS_PMEM
+        ERROR ("DoShrink is only supported by the DRAM hash table.");
+        printf ("shrink is only supported by the DRAM hash table.\n");
+#else
+        INFO ("DoShrink. Thread %2d", thread->tid);
+        thread->stats.Start ();
+        size_t old_capacity = hashtable_->Capacity ();
+        size_t released = hashtable_->ShrinkToFit ();
+        thread->stats.FinishedBatchOp (hashtable_->BucketCount ());
+        char buf[100];
+        snprintf (buf, sizeof (buf), "released cells: %lu, capacity: %lu -> %lu", released,
+                  old_capacity, hashtable_->Capacity ());
+        thread->stats.AddMessage (buf);
+#endif
+    }
+
+    // print the LockStats, which need a build with TURBO_HASH_STATS
+    void DoLockStats (ThreadState* thread) {
+#ifdef IS_PMEM
+        ERROR ("DoLockStats is only supported by the DRAM hash table.");
+        printf ("lockstats is only supported by the DRAM hash table.\n");
+#else
+        INFO ("DoLockStats. Thread %2d", thread->tid);
+        thread->stats.Start ();
+        turbo::LockStats stats = hashtable_->GetLockStats ();
+        char buf[200];
+        snprintf (buf, sizeof (buf),
+                  "bucket locks: %lu, contended: %lu, waits: %lu, contended cell locks: %lu",
+                  stats.bucket_locks, stats.bucket_contended, stats.bucket_waits,
+                  stats.cell_contended);
+        thread->stats.AddMessage (buf);
+#endif
+    }
+
+    // print the TableStats, whose operation counters need a build with TURBO_HASH_STATS
+    void DoTableStats (ThreadState* thread) {
+#ifdef IS_PMEM
+        ERROR ("DoTableStats is only supported by the DRAM hash table.");
+        printf ("tablestats is only supported by the DRAM hash table.\n");
+#else
+        INFO ("DoTableStats. Thread %2d", thread->tid);
+        thread->stats.Start ();
+        turbo::TableStats stats = hashtable_->GetTableStats ();
+        using Histogram = std::array<size_t, turbo::kProbeHistogramSize>;
+        auto print_probes = [] (const char* op, const Histogram& probes) {
+            printf ("%-7s probes:", op);
+            for (size_t count : probes) {
+                printf (" %lu", count);
+            }
+            printf ("\n");
+        };
+        print_probes ("find", stats.find_probes);
+        print_probes ("insert", stats.insert_probes);
+        print_probes ("delete", stats.delete_probes);
+        printf ("buckets by log2 cell count:");
+        for (size_t count : stats.bucket_cells) {
+            printf (" %lu", count);
+        }
+        printf ("\n");
+        char buf[300];
+        snprintf (buf, sizeof (buf),
+                  "find retries: %lu, rehashes: %lu (%.2f ms, %.2f MB moved), lock waits: %lu, "
+                  "pending garbage: %lu (%.2f MB of cells)",
+                  stats.find_retries, stats.rehashes, stats.rehash_nanos / 1000000.0,
+                  stats.rehash_bytes / 1048576.0, stats.bucket_lock_waits, stats.garbage_pending,
+                  stats.garbage_pending_bytes / 1048576.0);
+        thread->stats.AddMessage (buf);
+#endif
+    }
+
     void DoRehashLat (ThreadState* thread) {
         auto tinfo = hashtable_->getThreadInfo ();
         INFO ("DoRehashLat. Thread %2d", thread->tid);
@@ -605,6 +804,53 @@ public:
         thread->stats.AddMessage (buf);
     }
 
+    /** DoReadNuma
+     *  @note: readrandom with thread i pinned to node i % node_count. With the partition
+     *         policy a thread only looks up the keys placed on its own node, the way a
+     *         server routing requests to node-local workers would. Run it with growing
+     *         --thread to see how lookups scale across the nodes.
+     */
+    void DoReadNuma (ThreadState* thread) {
+#ifdef IS_PMEM
+        ERROR ("DoReadNuma is only supported by the DRAM hash table.");
+        printf ("readnuma is only supported by the DRAM hash table.\n");
+#else
+        int node_count = hashtable_->GetNumaOptions ().node_count;
+        int node = thread->tid % node_count;
+        bool pinned = turbo::util::PinThreadToNumaNode (node);
+        bool partition = hashtable_->GetNumaOptions ().policy == turbo::NumaPolicy::kPartition;
+        auto tinfo = hashtable_->getThreadInfo ();
+        INFO ("DoReadNuma. Thread %2d on node %d", thread->tid, node);
+        uint64_t batch = FLAGS_batch;
+        size_t start_offset = random () % trace_size_;
+        auto key_iterator = key_trace_->trace_at (start_offset, trace_size_);
+        size_t not_find = 0;
+        size_t skipped = 0;
+        Duration duration (FLAGS_readtime, reads_);
+        thread->stats.Start ();
+
+        while (!duration.Done (batch) && key_iterator.Valid ()) {
+            uint64_t j = 0;
+            while (j < batch && key_iterator.Valid ()) {
+                size_t key = key_iterator.Next ();
+                if (partition && hashtable_->NodeOfKey (key) != node) {
+                    skipped++;
+                    continue;
+                }
+                if (unlikely (!hashtable_->Find (key, tinfo, NothingCallback))) {
+                    not_find++;
+                }
+                j++;
+            }
+            thread->stats.FinishedBatchOp (j);
+        }
+        char buf[100];
+        snprintf (buf, sizeof (buf), "(node: %d%s, not find: %lu, other nodes: %lu)", node,
+                  pinned ? "" : " unpinned", not_find, skipped);
+        thread->stats.AddMessage (buf);
+#endif
+    }
+
     void DoReadAll (ThreadState* thread) {
         auto tinfo = hashtable_->getThreadInfo ();
         INFO ("DoReadAll");
@@ -670,6 +916,45 @@ public:
         thread->stats.AddMessage (buf);
     }
 
+    void DoReadBatch (ThreadState* thread) {
+#ifdef IS_PMEM
+        ERROR ("DoReadBatch is only supported by the DRAM hash table.");
+        printf ("readbatch is only supported by the DRAM hash table.\n");
+#else
+        auto tinfo = hashtable_->getThreadInfo ();
+        INFO ("DoReadBatch");
+        uint64_t batch = FLAGS_batch;
+        if (key_trace_ == nullptr) {
+            ERROR ("DoReadBatch lack key_trace_ initialization.");
+            return;
+        }
+        size_t start_offset = random () % trace_size_;
+        auto key_iterator = key_trace_->trace_at (start_offset, trace_size_);
+        std::vector<size_t> keys (FLAGS_readbatch_size);
+        size_t not_find = 0;
+        Duration duration (FLAGS_readtime, reads_);
+        thread->stats.Start ();
+        while (!duration.Done (batch) && key_iterator.Valid ()) {
+            uint64_t j = 0;
+            while (j < batch && key_iterator.Valid ()) {
+                size_t n = 0;
+                for (; n < keys.size () && j < batch && key_iterator.Valid (); n++, j++) {
+                    keys[n] = key_iterator.Next ();
+                }
+                size_t find = hashtable_->FindBatch (keys.data (), n, tinfo,
+                                                     [] (size_t i, RecordType record) {});
+                not_find += n - find;
+            }
+            thread->stats.FinishedBatchOp (j);
+        }
+        char buf[100];
+        snprintf (buf, sizeof (buf), "(num: %lu, not find: %lu)", reads_, not_find);
+        INFO ("DoReadBatch thread: %2d. Total read num: %lu, not find: %lu)", thread->tid, reads_,
+              not_find);
+        thread->stats.AddMessage (buf);
+#endif
+    }
+
     void DoReadLat (ThreadState* thread) {
         auto tinfo = hashtable_->getThreadInfo ();
         INFO ("DoReadLat");
@@ -760,6 +1045,66 @@ public:
         return;
     }
 
+    void DoWriteBatch (ThreadState* thread) {
+#ifdef IS_PMEM
+        ERROR ("DoWriteBatch is only supported by the DRAM hash table.");
+        printf ("loadbatch is only supported by the DRAM hash table.\n");
+#else
+        auto tinfo = hashtable_->getThreadInfo ();
+        INFO ("DoWriteBatch");
+        uint64_t batch = FLAGS_batch;
+        if (key_trace_ == nullptr) {
+            ERROR ("DoWriteBatch lack key_trace_ initialization.");
+            return;
+        }
+        size_t interval = num_ / FLAGS_thread;
+        size_t start_offset = thread->tid * interval;
+        auto key_iterator = key_trace_->iterate_between (start_offset, start_offset + interval);
+        std::vector<size_t> keys (FLAGS_writebatch_size);
+        std::vector<size_t> values (FLAGS_writebatch_size, 1);
+
+        thread->stats.Start ();
+
+        while (key_iterator.Valid ()) {
+            uint64_t j = 0;
+            while (j < batch && key_iterator.Valid ()) {
+                size_t n = 0;
+                for (; n < keys.size () && j < batch && key_iterator.Valid (); n++, j++) {
+                    keys[n] = key_iterator.Next ();
+                }
+                bool res = hashtable_->PutBatch (keys.data (), values.data (), n, tinfo);
+                if (!res) {
+                    INFO ("Hash Table Full!!!\n");
+                    printf ("Hash Table Full!!!\n");
+                    return;
+                }
+            }
+            thread->stats.FinishedBatchOp (j);
+        }
+#endif
+    }
+
+    void DoBulkLoad (ThreadState* thread) {
+#ifdef IS_PMEM
+        ERROR ("DoBulkLoad is only supported by the DRAM hash table.");
+        printf ("bulkload is only supported by the DRAM hash table.\n");
+#else
+        INFO ("DoBulkLoad");
+        if (key_trace_ == nullptr) {
+            ERROR ("DoBulkLoad lack key_trace_ initialization.");
+            return;
+        }
+        std::vector<std::pair<size_t, size_t>> records (num_);
+        for (size_t i = 0; i < num_; i++) {
+            records[i] = {key_trace_->keys_[i], 1};
+        }
+
+        thread->stats.Start ();
+        size_t n = hashtable_->BulkLoad (records.begin (), records.end (), FLAGS_thread);
+        thread->stats.FinishedBatchOp (n);
+#endif
+    }
+
     void DoWriteRead (ThreadState* thread) {
         auto tinfo = hashtable_->getThreadInfo ();
         INFO ("DoWriteRead");
@@ -864,6 +1209,96 @@ public:
         return;
     }
 
+    // increment the values of random keys with FetchAdd
+    void DoCounter (ThreadState* thread) {
+#ifdef IS_PMEM
+        ERROR ("DoCounter is only supported by the DRAM hash table.");
+        printf ("counter is only supported by the DRAM hash table.\n");
+#else
+        auto tinfo = hashtable_->getThreadInfo ();
+        runCounter (thread, [&] (size_t key) { hashtable_->FetchAdd (key, 1, tinfo); });
+#endif
+    }
+
+    // increment the values of random keys with a Find and a Put, for comparison
+    void DoCounterFindPut (ThreadState* thread) {
+        auto tinfo = hashtable_->getThreadInfo ();
+        runCounter (thread, [&] (size_t key) {
+            size_t value = 0;
+            hashtable_->Find (key, tinfo, [&] (RecordType record) { value = record.value (); });
+            hashtable_->Put (key, value + 1, tinfo);
+        });
+    }
+
+    // overwrite keys of the trace drawn from a zipfian distribution, so most writes go to
+    // the few buckets of the hottest keys
+    void DoSkewWrite (ThreadState* thread) {
+        auto tinfo = hashtable_->getThreadInfo ();
+        uint64_t batch = FLAGS_batch;
+        std::mt19937_64 rng (thread->tid + 1);
+        zipfian_int_distribution<size_t> zipf (*zipf_param_);
+        Duration duration (FLAGS_readtime, writes_);
+        thread->stats.Start ();
+        while (!duration.Done (batch)) {
+            for (uint64_t j = 0; j < batch; j++) {
+                size_t key = key_trace_->keys_[zipf (rng)];
+                hashtable_->Put (key, key + j, tinfo);
+            }
+            thread->stats.FinishedBatchOp (batch);
+        }
+    }
+
+    // look up keys of the trace drawn from a zipfian distribution and insert the misses, as a
+    // read-through cache does. Run on a table in cache mode, see --cache_cells
+    void DoCache (ThreadState* thread) {
+#ifdef IS_PMEM
+        ERROR ("DoCache is only supported by the DRAM hash table.");
+        printf ("cache is only supported by the DRAM hash table.\n");
+#else
+        auto tinfo = hashtable_->getThreadInfo ();
+        uint64_t batch = FLAGS_batch;
+        std::mt19937_64 rng (thread->tid + 1);
+        zipfian_int_distribution<size_t> zipf (*zipf_param_);
+        Duration duration (FLAGS_readtime, reads_);
+        size_t hit = 0;
+        size_t miss = 0;
+        thread->stats.Start ();
+        while (!duration.Done (batch)) {
+            for (uint64_t j = 0; j < batch; j++) {
+                size_t key = key_trace_->keys_[zipf (rng)];
+                if (hashtable_->Find (key, tinfo, NothingCallback)) {
+                    hit++;
+                } else {
+                    hashtable_->Put (key, key, tinfo);
+                    miss++;
+                }
+            }
+            thread->stats.FinishedBatchOp (batch);
+        }
+        char buf[200];
+        snprintf (buf, sizeof (buf), "(hit: %lu, miss: %lu, hit ratio: %.4f, evictions: %lu)", hit,
+                  miss, hit / (double)(hit + miss), hashtable_->Evictions ());
+        INFO ("(hit: %lu, miss: %lu, evictions: %lu)", hit, miss, hashtable_->Evictions ());
+        thread->stats.AddMessage (buf);
+#endif
+    }
+
+    template <typename Fn>
+    void runCounter (ThreadState* thread, Fn&& increment) {
+        uint64_t batch = FLAGS_batch;
+        size_t start_offset = random () % trace_size_;
+        auto key_iterator = key_trace_->trace_at (start_offset, trace_size_);
+        Duration duration (FLAGS_readtime, writes_);
+        thread->stats.Start ();
+        while (!duration.Done (batch) && key_iterator.Valid ()) {
+            uint64_t j = 0;
+            for (; j < batch && key_iterator.Valid (); j++) {
+                increment (key_iterator.Next ());
+            }
+            thread->stats.FinishedBatchOp (j);
+        }
+    }
+
     void DoOverWrite (ThreadState* thread) {
         auto tinfo = hashtable_->getThreadInfo ();
         INFO ("DoOverWrite");
@@ -1041,6 +1476,12 @@ public:
         size_t interval = num_ / FLAGS_thread;
         size_t start_offset = thread->tid * interval;
         auto key_iterator = key_trace_->iterate_between (start_offset, start_offset + interval);
+        // with --ycsb_zipf, the same number of keys is drawn from the whole trace
+        std::mt19937_64 rng (thread->tid + 1);
+        std::unique_ptr<zipfian_int_distribution<size_t>> zipf;
+        if (FLAGS_ycsb_zipf) {
+            zipf.reset (new zipfian_int_distribution<size_t> (*zipf_param_));
+        }
 
         thread->stats.Start ();
 
@@ -1048,6 +1489,9 @@ public:
             uint64_t j = 0;
             for (; j < batch && key_iterator.Valid (); j++) {
                 size_t key = key_iterator.Next ();
+                if (zipf != nullptr) {
+                    key = key_trace_->keys_[(*zipf) (rng)];
+                }
                 if (thread->ycsb_gen.NextA () == kYCSB_Write) {
                     hashtable_->Put (key, key, tinfo);
                     insert++;
@@ -1252,6 +1696,8 @@ private:
     void RunBenchmark (int thread_num, const std::string& name,
                        void (Benchmark::*method) (ThreadState*), bool print_hist) {
         SharedState shared (thread_num);
+        // opened before the threads start so that they inherit it
+        util::PerfCounter dtlb_misses = util::PerfCounter::DTLBLoadMisses ();
         ThreadArg* arg = new ThreadArg[thread_num];
         std::thread server_threads[thread_num];
         for (int i = 0; i < thread_num; i++) {
@@ -1268,16 +1714,29 @@ private:
             shared.cv.wait (lck);
         }
 
+        if (FLAGS_dtlb) dtlb_misses.Start ();
         shared.start = true;
         shared.cv.notify_all ();
         while (shared.num_done < thread_num) {
             shared.cv.wait (lck);
         }
+        uint64_t dtlb_miss_count = FLAGS_dtlb ? dtlb_misses.Stop () : 0;
 
         for (int i = 1; i < thread_num; i++) {
             arg[0].thread->stats.Merge (arg[i].thread->stats);
         }
         arg[0].thread->stats.Report (name, print_hist);
+        if (FLAGS_dtlb) {
+            if (dtlb_misses.Valid ()) {
+                uint64_t ops = std::max (1LU, arg[0].thread->stats.done_);
+                fprintf (stdout, "%-12s : dTLB load misses %lu, %.3f per op\n", name.c_str (),
+                         dtlb_miss_count, (double)dtlb_miss_count / ops);
+                INFO ("%-12s : dTLB load misses %lu, %.3f per op\n", name.c_str (), dtlb_miss_count,
+                      (double)dtlb_miss_count / ops);
+            } else {
+                fprintf (stdout, "%-12s : dTLB load misses unavailable\n", name.c_str ());
+            }
+        }
 
         for (auto& th : server_threads) th.join ();
 
@@ -1325,18 +1784,17 @@ private:
         PrintEnvironment ();
         fprintf (stdout, "Pmem:                  %s\n", kIsPmem ? "true" : "false");
         INFO ("Pmem:                  %s\n", kIsPmem ? "true" : "false");
-        fprintf (stdout, "Key type:              %s\n", type_name<Hashtable::key_type> ().c_str ());
-        INFO ("Key type:              %s\n", type_name<Hashtable::key_type> ().c_str ());
-        fprintf (stdout, "Val type:              %s\n",
-                 type_name<Hashtable::mapped_type> ().c_str ());
-        INFO ("Val type:              %s\n", type_name<Hashtable::mapped_type> ().c_str ());
-        fprintf (stdout, "Keys:                  %lu bytes each\n", sizeof (Hashtable::key_type));
-        INFO ("Keys:                  %lu bytes each\n", sizeof (Hashtable::key_type));
+        fprintf (stdout, "Key type:              %s\n", type_name<key_type> ().c_str ());
+        INFO ("Key type:              %s\n", type_name<key_type> ().c_str ());
+        fprintf (stdout, "Val type:              %s\n", type_name<mapped_type> ().c_str ());
+        INFO ("Val type:              %s\n", type_name<mapped_type> ().c_str ());
+        fprintf (stdout, "Keys:                  %lu bytes each\n", sizeof (key_type));
+        INFO ("Keys:                  %lu bytes each\n", sizeof (key_type));
         fprintf (
             stdout, "Values:                %lu bytes each\n",
-            Hashtable::is_value_flat ? sizeof (Hashtable::mapped_type) : (int)FLAGS_value_size);
+            Hashtable::is_value_flat ? sizeof (mapped_type) : (int)FLAGS_value_size);
         INFO ("Values:                %lu bytes each\n",
-              Hashtable::is_value_flat ? sizeof (Hashtable::mapped_type) : (int)FLAGS_value_size);
+              Hashtable::is_value_flat ? sizeof (mapped_type) : (int)FLAGS_value_size);
         fprintf (stdout, "Entries:               %lu\n", (uint64_t)num_);
         INFO ("Entries:               %lu\n", (uint64_t)num_);
         fprintf (stdout, "Trace size:            %lu\n", (uint64_t)trace_size_);
@@ -1354,22 +1812,39 @@ private:
         INFO ("Hash val flat:         %s \n", Hashtable::is_value_flat ? "true" : "false");
         fprintf (stdout, "Hash Buckets:          %lu \n", (uint64_t)FLAGS_bucket_count);
         INFO ("Hash Buckets:          %lu \n", (uint64_t)FLAGS_bucket_count);
-        fprintf (stdout, "Hash Cell in Bucket:   %lu \n", (uint64_t)FLAGS_cell_count);
-        INFO ("Hash Cell in Bucket:   %lu \n", (uint64_t)FLAGS_cell_count);
+        fprintf (stdout, "Hash Cell in Bucket:   %lu \n", (uint64_t)cell_count_);
+        INFO ("Hash Cell in Bucket:   %lu \n", (uint64_t)cell_count_);
         fprintf (stdout, "Hash Slot in Cell:     %u \n", Hashtable::CellMeta::SlotCount ());
         INFO ("Hash Slot in Cell:     %u \n", Hashtable::CellMeta::SlotCount ());
         fprintf (stdout, "Hash init capacity:    %lu \n", (uint64_t)initial_capacity_);
         INFO ("Hash init capacity:    %lu \n", (uint64_t)initial_capacity_);
         fprintf (
             stdout, "Hash table size:       %lu MB\n",
-            FLAGS_bucket_count * FLAGS_cell_count * Hashtable::CellMeta::CellSize () / 1024 / 1024);
+            FLAGS_bucket_count * cell_count_ * Hashtable::CellMeta::CellSize () / 1024 / 1024);
         INFO (
             "Hash table size:       %lu MB\n",
-            FLAGS_bucket_count * FLAGS_cell_count * Hashtable::CellMeta::CellSize () / 1024 / 1024);
+            FLAGS_bucket_count * cell_count_ * Hashtable::CellMeta::CellSize () / 1024 / 1024);
         fprintf (stdout, "Hash loadfactor:       %.2f \n", FLAGS_loadfactor);
         INFO ("Hash loadfactor:       %.2f \n", FLAGS_loadfactor);
         fprintf (stdout, "Cell Type:             %s \n", Hashtable::CellMeta::Name ().c_str ());
         INFO ("Cell Type:             %s \n", Hashtable::CellMeta::Name ().c_str ());
+#ifndef IS_PMEM
+        fprintf (stdout, "Huge pages:            %s \n", FLAGS_huge_pages ? "true" : "false");
+        INFO ("Huge pages:            %s \n", FLAGS_huge_pages ? "true" : "false");
+        fprintf (stdout, "Reserved cells:        %s \n", FLAGS_reserved_cells ? "true" : "false");
+        INFO ("Reserved cells:        %s \n", FLAGS_reserved_cells ? "true" : "false");
+        fprintf (stdout, "NUMA policy:           %s (%d nodes)\n", FLAGS_numa_policy.c_str (),
+                 turbo::util::NumaNodeCount ());
+        INFO ("NUMA policy:           %s (%d nodes)\n", FLAGS_numa_policy.c_str (),
+              turbo::util::NumaNodeCount ());
+        fprintf (stdout, "Bucket lock:           %s \n", FLAGS_bucket_lock.c_str ());
+        INFO ("Bucket lock:           %s \n", FLAGS_bucket_lock.c_str ());
+        fprintf (stdout, "Cache cells:           %u \n", FLAGS_cache_cells);
+        INFO ("Cache cells:           %u \n", FLAGS_cache_cells);
+#endif
+        const char* simd_level = turbo::util::SimdLevelName (turbo::util::GetSimdLevel ());
+        fprintf (stdout, "Tag matching:          %s \n", simd_level);
+        INFO ("Tag matching:          %s \n", simd_level);
         fprintf (stdout, "Report interval:       %lu s\n", (uint64_t)FLAGS_report_interval);
         INFO ("Report interval:       %lu s\n", (uint64_t)FLAGS_report_interval);
         fprintf (stdout, "Stats interval:        %lu records\n", (uint64_t)FLAGS_stats_interval);
@@ -1381,13 +1856,63 @@ private:
     }
 };
 
+#ifndef IS_PMEM
+template <typename CellLayout, typename BucketLock>
+void RunTable () {
+    if (FLAGS_huge_pages) {
+        Benchmark<HashtableWithCell<CellLayout, turbo::util::HugePageCellAllocator<>, BucketLock>>
+            benchmark;
+        benchmark.Run ();
+    } else if (FLAGS_reserved_cells) {
+        Benchmark<HashtableWithCell<CellLayout, turbo::util::ReservedCellAllocator<>, BucketLock>>
+            benchmark;
+        benchmark.Run ();
+    } else {
+        Benchmark<HashtableWithCell<CellLayout, turbo::util::AlignedCellAllocator, BucketLock>>
+            benchmark;
+        benchmark.Run ();
+    }
+}
+
+template <typename CellLayout>
+void RunCellType () {
+    if (FLAGS_bucket_lock == "spin") {
+        RunTable<CellLayout, turbo::util::SpinBitLock> ();
+    } else if (FLAGS_bucket_lock == "backoff") {
+        RunTable<CellLayout, turbo::util::BackoffBitLock> ();
+    } else if (FLAGS_bucket_lock == "ticket") {
+        RunTable<CellLayout, turbo::util::TicketBitLock> ();
+    } else {
+        fprintf (stderr, "unknown bucket_lock: %s\n", FLAGS_bucket_lock.c_str ());
+        exit (1);
+    }
+}
+#endif
+
 int main (int argc, char* argv[]) {
     // for (int i = 0; i < argc; i++) {
     //     printf ("%s ", argv[i]);
     // }
     // printf ("\n");
     ParseCommandLineFlags (&argc, &argv, true);
-    Benchmark benchmark;
+#ifdef IS_PMEM
+    Benchmark<Hashtable> benchmark;
     benchmark.Run ();
+#else
+    std::stringstream cell_types (FLAGS_cell_type);
+    std::string cell_type;
+    while (std::getline (cell_types, cell_type, ',')) {
+        if (cell_type == "128") {
+            RunCellType<turbo::Cell128> ();
+        } else if (cell_type == "256") {
+            RunCellType<turbo::Cell256> ();
+        } else if (cell_type == "1024") {
+            RunCellType<turbo::Cell1024> ();
+        } else {
+            fprintf (stderr, "unknown cell_type: %s\n", cell_type.c_str ());
+            return 1;
+        }
+    }
+#endif
     return 0;
 }
@@ -13,6 +13,68 @@ using HashTable = turbo_pmem::unordered_map<std::string, std::string>;
 #define hashnamespace turbo_pmem
 #endif
 
+// put, delete and rehash on a table with the given cell layout and cell allocator
+template <typename CellLayout, typename CellAllocator = turbo::util::AlignedCellAllocator>
+void TestCellLayout () {
+    typedef turbo::unordered_map<size_t, size_t, turbo::hash<size_t>, std::equal_to<size_t>,
+                                 CellLayout, CellAllocator>
+        MyHash;
+    MyHash mapi (16, 1);
+    auto thread_info = mapi.getThreadInfo ();
+    for (size_t i = 0; i < 10000; i++) {
+        mapi.Put (i, i * 2, thread_info);
+    }
+    for (size_t i = 0; i < 10000; i += 2) {
+        mapi.Delete (i, thread_info);
+    }
+    mapi.MinorReHashAll ();
+    for (size_t i = 0; i < 10000; i++) {
+        size_t val = 0;
+        bool find = mapi.Find (i, thread_info,
+                               [&] (typename MyHash::RecordType record) { val = record.value (); });
+        if (find != (i % 2 == 1) || (find && val != i * 2)) {
+            printf ("!!! Wrong find %lu in %s\n", i, MyHash::CellMeta::Name ().c_str ());
+        }
+    }
+}
+
+// concurrent writers of shared and own keys, with rehashes taking the given bucket lock
+template <typename BucketLock>
+void TestBucketLock (const char* name) {
+    typedef turbo::unordered_map<size_t, size_t, turbo::hash<size_t>, std::equal_to<size_t>,
+                                 turbo::Cell128, turbo::util::AlignedCellAllocator, BucketLock>
+        MyHash;
+    MyHash mapi (2, 1);
+    const size_t kThreads = 4;
+    const size_t kKeys = 20000;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < kThreads; t++) {
+        workers.emplace_back ([&, t] () {
+            auto thread_info = mapi.getThreadInfo ();
+            for (size_t i = 0; i < kKeys; i++) {
+                mapi.FetchAdd (i % 64, 1, thread_info);
+                mapi.Put ((t + 1) << 32 | i, i, thread_info);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join ();
+    }
+    auto thread_info = mapi.getThreadInfo ();
+    size_t sum = 0;
+    for (size_t i = 0; i < 64; i++) {
+        mapi.Find (i, thread_info, [&] (typename MyHash::RecordType record) {
+            sum += record.value ();
+        });
+    }
+    turbo::LockStats stats = mapi.GetLockStats ();
+    if (sum != kThreads * kKeys || mapi.Size () != 64 + kThreads * kKeys ||
+        (stats.bucket_locks == 0) == kTurboHashStats ||
+        stats.bucket_contended > stats.bucket_locks) {
+        printf ("!!! Wrong concurrent writes with %s bucket lock\n", name);
+    }
+}
+
 int main () {
     const size_t COUNT = 100000;
 
@@ -173,10 +235,29 @@ int main () {
             INFO ("Get int key: %d, int: %d\n", key_buf, val_buf);
         }
 
+        int keys[100];
+        for (int i = 0; i < 100; i++) {
+            keys[i] = i;
+        }
+        size_t batch_find = mapi.FindBatch (keys, 100, thread_info,
+                                            [&] (size_t i, MyHash::RecordType record) {
+                                                if (record.value () != keys[i]) {
+                                                    printf ("FindBatch wrong value\n");
+                                                }
+                                            });
+        if (batch_find != 100) {
+            printf ("FindBatch find %lu of 100 keys\n", batch_find);
+        }
+
         mapi.Delete (20, thread_info);
         if (mapi.Find (20, thread_info, [&] (MyHash::RecordType record) { return; })) {
             printf ("!!! Cannot delete key\n");
         }
+        mapi.Put (21, 210, thread_info);
+        mapi.Delete (20, thread_info);
+        if (mapi.Size () != 99) {
+            printf ("!!! Wrong size: %lu, expect 99\n", mapi.Size ());
+        }
 
         mapi.PrintAllMeta ();
 
@@ -184,5 +265,649 @@ int main () {
         mapi.PrintAllMeta ();
     }
 
+    {
+        // a cell count limit of 4 makes the bucket directory double several times
+        typedef turbo::detail::TurboHashTable<size_t, size_t, turbo::hash<size_t>,
+                                              std::equal_to<size_t>, 4>
+            MyHash;
+        MyHash mapi (1, 1);
+        auto thread_info = mapi.getThreadInfo ();
+        for (size_t i = 0; i < 10000; i++) {
+            mapi.Put (i, i, thread_info);
+        }
+        for (size_t i = 0; i < 10000; i++) {
+            size_t val = 0;
+            if (!mapi.Find (i, thread_info, [&] (MyHash::RecordType record) {
+                    val = record.value ();
+                }) ||
+                val != i) {
+                printf ("!!! Fail get %lu after directory doubling\n", i);
+            }
+        }
+        printf ("directory doubled to %lu buckets\n", mapi.BucketCount ());
+    }
+
+    {
+        // full buckets are rehashed incrementally by the following writes
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (1, 1);
+        mapi.SetIncrementalRehash (true);
+        auto thread_info = mapi.getThreadInfo ();
+        for (size_t i = 0; i < 10000; i++) {
+            mapi.Put (i, i, thread_info);
+            if (i % 2 == 0) {
+                mapi.Delete (i / 2, thread_info);
+            }
+        }
+        for (size_t i = 0; i < 10000; i++) {
+            bool deleted = i < 5000;
+            bool find = mapi.Find (i, thread_info, [&] (MyHash::RecordType record) { return; });
+            if (find == deleted) {
+                printf ("!!! Wrong find %lu during incremental rehash\n", i);
+            }
+        }
+        if (mapi.Size () != 5000) {
+            printf ("!!! Wrong size: %lu, expect 5000\n", mapi.Size ());
+        }
+    }
+
+    {
+        // background threads grow and compact the buckets while keys are written
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (4, 1);
+        turbo::MaintenanceOptions options;
+        options.interval_ms = 1;
+        mapi.StartMaintenance (options);
+        auto thread_info = mapi.getThreadInfo ();
+        for (size_t i = 0; i < 100000; i++) {
+            mapi.Put (i, i, thread_info);
+        }
+        for (size_t i = 0; i < 100000; i += 2) {
+            mapi.Delete (i, thread_info);
+        }
+        std::this_thread::sleep_for (std::chrono::milliseconds (50));
+        mapi.StopMaintenance ();
+        for (size_t i = 0; i < 100000; i++) {
+            bool find = mapi.Find (i, thread_info, [&] (MyHash::RecordType record) { return; });
+            if (find != (i % 2 == 1)) {
+                printf ("!!! Wrong find %lu with background maintenance\n", i);
+            }
+        }
+        turbo::MaintenanceStats stats = mapi.GetMaintenanceStats ();
+        printf ("background maintenance grew %lu buckets, compacted %lu buckets\n", stats.grown,
+                stats.compacted);
+    }
+
+    {
+        // the buckets are halved after most keys are deleted
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (16, 1);
+        auto thread_info = mapi.getThreadInfo ();
+        for (size_t i = 0; i < 100000; i++) {
+            mapi.Put (i, i, thread_info);
+        }
+        size_t capacity = mapi.Capacity ();
+        for (size_t i = 0; i < 100000; i++) {
+            if (i % 10 != 0) {
+                mapi.Delete (i, thread_info);
+            }
+        }
+        mapi.ShrinkToFit ();
+        if (mapi.Capacity () >= capacity / 4) {
+            printf ("!!! Shrink capacity %lu -> %lu\n", capacity, mapi.Capacity ());
+        }
+        for (size_t i = 0; i < 100000; i++) {
+            bool find = mapi.Find (i, thread_info, [&] (MyHash::RecordType record) { return; });
+            if (find != (i % 10 == 0)) {
+                printf ("!!! Wrong find %lu after shrink\n", i);
+            }
+        }
+    }
+
+    {
+        // string records carved from per-thread slabs
+        typedef turbo::detail::TurboHashTable<std::string, std::string, turbo::hash<std::string>,
+                                              std::equal_to<turbo::util::Slice>, 32768,
+                                              turbo::util::StripedCounter<64>,
+                                              turbo::util::SlabRecordAllocator>
+            MyHash;
+        MyHash mapi (16, 4);
+        auto thread_info = mapi.getThreadInfo ();
+        for (int r = 0; r < 3; r++) {
+            for (int i = 0; i < 10000; i++) {
+                mapi.Put (std::to_string (i), std::string (i % 500 + r, 'v'), thread_info);
+            }
+        }
+        for (int i = 0; i < 10000; i++) {
+            std::string val;
+            if (!mapi.Find (std::to_string (i), thread_info,
+                            [&] (MyHash::RecordType record) { val = record.value (); }) ||
+                val != std::string (i % 500 + 2, 'v')) {
+                printf ("!!! Fail get %d from slab records\n", i);
+            }
+        }
+    }
+
+    {
+        // short keys and values are inlined in the slot, longer ones go to the heap
+        typedef turbo::unordered_map<std::string, std::string> MyHash;
+        MyHash mapi (16, 4);
+        auto thread_info = mapi.getThreadInfo ();
+        for (int r = 0; r < 3; r++) {
+            for (int i = 0; i < 10000; i++) {
+                mapi.Put (std::to_string (i), std::string ((i + r) % 8, 'v'), thread_info);
+            }
+        }
+        mapi.MinorReHashAll ();
+        for (int i = 0; i < 10000; i++) {
+            std::string key, val;
+            if (!mapi.Find (std::to_string (i), thread_info,
+                            [&] (MyHash::RecordType record) {
+                                key = record.key ();
+                                val = record.value ();
+                            }) ||
+                key != std::to_string (i) || val != std::string ((i + 2) % 8, 'v')) {
+                printf ("!!! Fail get %d from inline slots\n", i);
+            }
+        }
+    }
+
+    {
+        // force every tag matching kernel the CPU supports
+        using turbo::util::SimdLevel;
+        for (SimdLevel level : {SimdLevel::kSSE2, SimdLevel::kAVX2, SimdLevel::kAVX512}) {
+            if (!turbo::util::SetSimdLevel (level)) {
+                printf ("%s is not supported, skip it\n", turbo::util::SimdLevelName (level));
+                continue;
+            }
+            char tags[64];
+            for (int r = 0; r < 100; r++) {
+                for (int i = 0; i < 64; i++) {
+                    tags[i] = rand () % 4;
+                }
+                uint8_t h2 = rand () % 4;
+                uint64_t expect = 0;
+                for (int i = 0; i < 64; i++) {
+                    expect |= (uint64_t)(tags[i] == h2) << i;
+                }
+                if (turbo::util::simd_kernels.match_tag16 (tags, h2) != (expect & 0xFFFF) ||
+                    turbo::util::simd_kernels.match_tag64 (tags, h2) != expect) {
+                    printf ("!!! Wrong tag match with %s\n", turbo::util::SimdLevelName (level));
+                }
+            }
+            TestCellLayout<turbo::Cell256> ();
+            TestCellLayout<turbo::Cell1024> ();
+        }
+        turbo::util::SetSimdLevel (turbo::util::DetectSimdLevel ());
+    }
+
+    {
+        // cells and directories carved out of huge page regions
+        typedef turbo::util::HugePageCellAllocator<> HugePageAllocator;
+        HugePageAllocator allocator;
+        char* cells = allocator.Allocate (16 * 128, 128);
+        allocator.Release (cells);
+        if (allocator.Allocate (16 * 128, 128) != cells) {
+            printf ("!!! Released cells are not reused\n");
+        }
+        char* region = allocator.Allocate (4LU << 20, 128);
+        if (region == nullptr || ((uintptr_t)region & ((2LU << 20) - 1)) != 0) {
+            printf ("!!! Region is not huge page aligned\n");
+        }
+        TestCellLayout<turbo::Cell128, HugePageAllocator> ();
+        TestCellLayout<turbo::Cell1024, HugePageAllocator> ();
+    }
+
+    {
+        // buckets doubled and compacted within their reserved cell arrays
+        typedef turbo::util::ReservedCellAllocator<> ReservedAllocator;
+        ReservedAllocator allocator;
+        char* cells = allocator.Allocate (16 * 128, 128);
+        if (!allocator.Expand (cells, 4LU << 20) || allocator.Expand (cells, 8LU << 20)) {
+            printf ("!!! Wrong reserved size\n");
+        }
+        allocator.Release (cells);
+        // blocks are sliced from shared ranges, and a released one reads as zero again
+        std::vector<char*> blocks;
+        for (size_t i = 0; i < 1000; i++) {
+            blocks.push_back (allocator.Allocate (128, 128));
+            blocks.back ()[(4LU << 20) - 1] = 1;
+        }
+        if (allocator.MappingCount () > 4) {
+            printf ("!!! %lu mappings for 1000 reserved blocks\n", allocator.MappingCount ());
+        }
+        for (char* block : blocks) {
+            allocator.Release (block);
+        }
+        cells = allocator.Allocate (128, 128);
+        if (cells[(4LU << 20) - 1] != 0) {
+            printf ("!!! A reserved block is not zeroed when handed out again\n");
+        }
+        allocator.Release (cells);
+        TestCellLayout<turbo::Cell128, ReservedAllocator> ();
+        TestCellLayout<turbo::Cell256, ReservedAllocator> ();
+        TestCellLayout<turbo::Cell1024, ReservedAllocator> ();
+
+        // lookups never miss a key while its bucket grows under them
+        typedef turbo::unordered_map<size_t, size_t, turbo::hash<size_t>, std::equal_to<size_t>,
+                                     turbo::Cell128, ReservedAllocator>
+            MyHash;
+        MyHash mapi (2, 1);
+        const size_t kKeys = 100000;
+        std::atomic<size_t> written (0);
+        std::atomic<size_t> missed (0);
+        std::thread reader ([&] () {
+            auto thread_info = mapi.getThreadInfo ();
+            for (size_t r = 0; written.load () < kKeys; r++) {
+                size_t n = written.load ();
+                size_t i = n == 0 ? 0 : (r * 7919) % n;
+                if (n != 0 && !mapi.Find (i, thread_info, [] (MyHash::RecordType record) {})) {
+                    missed++;
+                }
+            }
+        });
+        auto thread_info = mapi.getThreadInfo ();
+        for (size_t i = 0; i < kKeys; i++) {
+            mapi.Put (i, i, thread_info);
+            written.store (i + 1);
+        }
+        reader.join ();
+        if (missed.load () != 0 || mapi.Size () != kKeys) {
+            printf ("!!! %lu lookups missed during a rehash in place\n", missed.load ());
+        }
+    }
+
+    {
+        // read-modify-write of a value under a single probe
+        turbo::unordered_map<size_t, size_t> mapi (16, 1);
+        auto thread_info = mapi.getThreadInfo ();
+        for (size_t r = 0; r < 3; r++) {
+            for (size_t i = 0; i < 10000; i++) {
+                if (mapi.FetchAdd (i, 2, thread_info) != r * 2) {
+                    printf ("!!! Wrong FetchAdd of %lu\n", i);
+                }
+            }
+        }
+        for (size_t i = 0; i < 10000; i++) {
+            bool inserted = mapi.Upsert (
+                i + 10000, [] (size_t& value, bool found) { value = found ? value * 2 : 1; },
+                thread_info);
+            mapi.Upsert (
+                i, [] (size_t& value, bool found) { value = found ? value * 2 : 1; },
+                thread_info);
+            // 3 * 2 doubled
+            size_t expected = 0;
+            if (!inserted || mapi.CompareExchange (i, expected, 1, thread_info) ||
+                expected != 12 || !mapi.CompareExchange (i, expected, 1, thread_info)) {
+                printf ("!!! Wrong Upsert or CompareExchange of %lu\n", i);
+            }
+        }
+        size_t expected = 0;
+        if (mapi.CompareExchange (30000, expected, 1, thread_info) || mapi.Size () != 20000) {
+            printf ("!!! CompareExchange inserted a missing key\n");
+        }
+    }
+
+    {
+        // insert if absent never overwrites an existing record
+        typedef turbo::unordered_map<std::string, std::string> MyHash;
+        MyHash mapi (16, 1);
+        auto thread_info = mapi.getThreadInfo ();
+        for (int i = 0; i < 1000; i++) {
+            mapi.Put ("key" + std::to_string (i), "old" + std::to_string (i), thread_info);
+        }
+        for (int i = 0; i < 2000; i++) {
+            std::string key = "key" + std::to_string (i);
+            std::string old;
+            bool inserted = i % 2 ? mapi.InsertIfAbsent (key, "new", thread_info,
+                                                         [&] (MyHash::RecordType record) {
+                                                             old = record.value ();
+                                                         })
+                                  : mapi.TryEmplace (
+                                        key, thread_info,
+                                        [&] (MyHash::RecordType record) {
+                                            old = record.value ();
+                                        },
+                                        3, 'n');
+            if (inserted != (i >= 1000) || (!inserted && old != "old" + std::to_string (i))) {
+                printf ("!!! Wrong InsertIfAbsent of %s\n", key.c_str ());
+            }
+        }
+        for (int i = 0; i < 2000; i++) {
+            std::string expect = i < 1000 ? "old" + std::to_string (i) : i % 2 ? "new" : "nnn";
+            std::string val;
+            mapi.Find ("key" + std::to_string (i), thread_info,
+                       [&] (MyHash::RecordType record) { val = record.value (); });
+            if (val != expect) {
+                printf ("!!! InsertIfAbsent overwrote key%d\n", i);
+            }
+        }
+    }
+
+    {
+        // every NUMA policy, spread over two nodes whether or not the host has them
+        using turbo::NumaPolicy;
+        typedef turbo::unordered_map<size_t, size_t, turbo::hash<size_t>, std::equal_to<size_t>,
+                                     turbo::Cell128, turbo::util::HugePageCellAllocator<>>
+            MyHash;
+        for (NumaPolicy policy : {NumaPolicy::kInterleave, NumaPolicy::kPartition,
+                                  NumaPolicy::kReplicate}) {
+            turbo::NumaOptions numa_options;
+            numa_options.policy = policy;
+            numa_options.node_count = 2;
+            MyHash mapi (16, 1, numa_options);
+            auto thread_info = mapi.getThreadInfo ();
+            for (size_t i = 0; i < 10000; i++) {
+                mapi.Put (i, i * 2, thread_info);
+            }
+            mapi.GrowDirectory (thread_info);
+            for (size_t i = 0; i < 10000; i += 2) {
+                mapi.Delete (i, thread_info);
+            }
+            mapi.ShrinkToFit ();
+            for (size_t i = 0; i < 10000; i++) {
+                size_t val = 0;
+                bool find = mapi.Find (i, thread_info,
+                                       [&] (MyHash::RecordType record) { val = record.value (); });
+                if (find != (i % 2 == 1) || (find && val != i * 2)) {
+                    printf ("!!! Wrong find %lu with NUMA policy %d\n", i, (int)policy);
+                }
+                int node = mapi.NodeOfKey (i);
+                if (policy == NumaPolicy::kPartition ? node < 0 || node > 1 : node != -1) {
+                    printf ("!!! Wrong node %d of key %lu\n", node, i);
+                }
+            }
+        }
+    }
+
+    {
+        // every bucket lock policy
+        TestBucketLock<turbo::util::SpinBitLock> ("spin");
+        TestBucketLock<turbo::util::BackoffBitLock> ("backoff");
+        TestBucketLock<turbo::util::TicketBitLock> ("ticket");
+    }
+
+    {
+        // the buckets get their cells on the first write
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (1 << 16, 32);
+        auto thread_info = mapi.getThreadInfo ();
+        if (mapi.Find (1, thread_info, [&] (MyHash::RecordType record) { return; })) {
+            printf ("!!! Find in an empty table\n");
+        }
+        mapi.Delete (1, thread_info);
+        mapi.MinorRehash (0, thread_info);
+        for (size_t i = 0; i < 1000; i++) {
+            mapi.Put (i, i, thread_info);
+        }
+        mapi.GrowDirectory (thread_info);
+        for (size_t i = 0; i < 1000; i += 2) {
+            mapi.Delete (i, thread_info);
+        }
+        mapi.ShrinkToFit ();
+        for (size_t i = 0; i < 2000; i++) {
+            size_t val = 0;
+            bool find = mapi.Find (i, thread_info,
+                                   [&] (MyHash::RecordType record) { val = record.value (); });
+            if (find != (i < 1000 && i % 2 == 1) || (find && val != i)) {
+                printf ("!!! Wrong find %lu in a lazily allocated table\n", i);
+            }
+        }
+        if (mapi.Size () != 500) {
+            printf ("!!! Wrong size %lu in a lazily allocated table\n", mapi.Size ());
+        }
+    }
+
+    {
+        // expired records are missed, their slots reused and swept in the background
+        typedef turbo::unordered_map<std::string, size_t> MyHash;
+        MyHash mapi (16, 1);
+        auto thread_info = mapi.getThreadInfo ();
+        for (size_t i = 0; i < 20000; i++) {
+            mapi.PutWithTTL ("key" + std::to_string (i), i, i % 2 ? 3600000 : 200, thread_info);
+        }
+        std::this_thread::sleep_for (std::chrono::milliseconds (250));
+        for (size_t i = 0; i < 20000; i++) {
+            size_t val = 0;
+            bool find = mapi.Find ("key" + std::to_string (i), thread_info,
+                                   [&] (MyHash::RecordType record) { val = record.value (); });
+            if (find != (i % 2 == 1) || (find && val != i)) {
+                printf ("!!! Wrong find %lu with a TTL\n", i);
+            }
+        }
+        if (!mapi.InsertIfAbsent ("key0", 1, thread_info) || mapi.Delete ("key2", thread_info) ||
+            !mapi.Delete ("key1", thread_info)) {
+            printf ("!!! Expired record is not missing\n");
+        }
+        size_t capacity = mapi.Capacity ();
+        for (size_t i = 0; i < 5000; i++) {
+            mapi.Put ("new" + std::to_string (i), i, thread_info);
+        }
+        if (mapi.Capacity () != capacity) {
+            printf ("!!! Expired slots are not reused: %lu -> %lu\n", capacity, mapi.Capacity ());
+        }
+
+        turbo::MaintenanceOptions options;
+        options.interval_ms = 1;
+        mapi.StartMaintenance (options);
+        std::this_thread::sleep_for (std::chrono::milliseconds (100));
+        mapi.StopMaintenance ();
+        // key0, the odd keys but key1, and the new keys stay
+        if (mapi.Size () != 15000 || mapi.GetMaintenanceStats ().expired == 0) {
+            printf ("!!! Expired records are not swept: size %lu\n", mapi.Size ());
+        }
+        // a TTL too long for the clock never expires
+        mapi.PutWithTTL ("forever", 1, std::numeric_limits<uint64_t>::max (), thread_info);
+        if (!mapi.Find ("forever", thread_info, [&] (MyHash::RecordType record) {})) {
+            printf ("!!! Record with the longest TTL expired\n");
+        }
+    }
+
+    {
+        // copies of a ThreadInfo share its slot, which is claimed again once they are all gone
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (16, 1);
+        size_t slot = 0;
+        {
+            auto thread_info = mapi.getThreadInfo ();
+            {
+                auto copy = thread_info;
+                mapi.Put (1, 1, copy);
+                if (copy.slot () != thread_info.slot ()) {
+                    printf ("!!! A copied ThreadInfo has slot %lu instead of %lu\n", copy.slot (),
+                            thread_info.slot ());
+                }
+            }
+            auto other = mapi.getThreadInfo ();
+            if (other.slot () == thread_info.slot ()) {
+                printf ("!!! Slot %lu is claimed while it is used\n", other.slot ());
+            }
+            slot = other.slot ();
+        }
+        auto thread_info = mapi.getThreadInfo ();
+        if (thread_info.slot () != slot) {
+            printf ("!!! Released slot %lu is not claimed again\n", slot);
+        }
+        // far more ThreadInfos than TURBO_EPOCHE_MAX_THREADS, each copied
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < 8; t++) {
+            threads.emplace_back ([&, t] {
+                for (size_t i = 0; i < 10000; i++) {
+                    auto ti = mapi.getThreadInfo ();
+                    auto copy = ti;
+                    mapi.Put (t * 10000 + i, i, i % 2 ? ti : copy);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join ();
+        }
+        if (mapi.Size () != 80000) {
+            printf ("!!! Wrong size %lu after claiming slots again\n", mapi.Size ());
+        }
+    }
+
+    {
+        // a bucket shrunk to fewer cells, or left as is when its slots need all of them,
+        // keeps the capacity in line with its cells
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (1, 1);
+        auto thread_info = mapi.getThreadInfo ();
+        auto cells = [&] () {
+            size_t count = 0;
+            std::vector<size_t> bucket_cells = mapi.GetTableStats ().bucket_cells;
+            for (size_t i = 0; i < bucket_cells.size (); i++) {
+                count += bucket_cells[i] << i;
+            }
+            return count;
+        };
+        for (size_t i = 0; i < 1000; i++) {
+            mapi.Put (i, i, thread_info);
+        }
+        size_t slots_per_cell = mapi.Capacity () / cells ();
+        if (mapi.ShrinkBucket (0, thread_info, 100.0) != 0 ||
+            mapi.Capacity () != cells () * slots_per_cell) {
+            printf ("!!! Wrong capacity %lu of %lu cells after a shrink that does not fit\n",
+                    mapi.Capacity (), cells ());
+        }
+        for (size_t i = 0; i < 900; i++) {
+            mapi.Delete (i, thread_info);
+        }
+        size_t released = mapi.ShrinkBucket (0, thread_info, 100.0);
+        if (released == 0 || mapi.Capacity () != cells () * slots_per_cell) {
+            printf ("!!! Wrong capacity %lu of %lu cells after a shrink\n", mapi.Capacity (),
+                    cells ());
+        }
+        for (size_t i = 0; i < 1000; i++) {
+            bool find = mapi.Find (i, thread_info, [&] (MyHash::RecordType record) {});
+            if (find != (i >= 900)) {
+                printf ("!!! Wrong find %lu after a shrink\n", i);
+            }
+        }
+    }
+
+    {
+        // bulk loads into an empty table and into one that has keys already
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (16, 1);
+        auto thread_info = mapi.getThreadInfo ();
+        std::vector<std::pair<size_t, size_t>> records;
+        for (size_t i = 0; i < 10000; i++) {
+            records.push_back ({i, i * 2});
+        }
+        if (mapi.BulkLoad (records.begin (), records.end (), 2) != 10000) {
+            printf ("!!! BulkLoad into an empty table\n");
+        }
+        for (size_t i = 0; i < 10000; i++) {
+            records[i] = {i + 10000, i};
+        }
+        if (mapi.BulkLoad (records.begin (), records.end (), 4) != 10000) {
+            printf ("!!! BulkLoad into a loaded table\n");
+        }
+        mapi.Put (5, 1, thread_info);
+        mapi.Put (15000, 1, thread_info);
+        for (size_t i = 0; i < 20000; i++) {
+            size_t val = 0;
+            bool find = mapi.Find (i, thread_info,
+                                   [&] (MyHash::RecordType record) { val = record.value (); });
+            size_t expect = i == 5 || i == 15000 ? 1 : i < 10000 ? i * 2 : i - 10000;
+            if (!find || val != expect) {
+                printf ("!!! Wrong find %lu after BulkLoad: %lu\n", i, val);
+            }
+        }
+        if (mapi.Size () != 20000) {
+            printf ("!!! Wrong size %lu after BulkLoad\n", mapi.Size ());
+        }
+    }
+
+    {
+        // a batch with duplicate keys keeps the last value, and grows each bucket at most once
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (16, 1);
+        auto thread_info = mapi.getThreadInfo ();
+        size_t capacity = mapi.Capacity ();
+        std::vector<size_t> keys, values;
+        for (size_t i = 0; i < 4000; i++) {
+            keys.push_back (i % 2000);
+            values.push_back (i);
+        }
+        if (!mapi.PutBatch (keys.data (), values.data (), keys.size (), thread_info)) {
+            printf ("!!! PutBatch failed\n");
+        }
+        for (size_t i = 0; i < 2000; i++) {
+            size_t val = 0;
+            bool find = mapi.Find (i, thread_info,
+                                   [&] (MyHash::RecordType record) { val = record.value (); });
+            if (!find || val != i + 2000) {
+                printf ("!!! Wrong find %lu after PutBatch: %lu\n", i, val);
+            }
+        }
+        size_t rehashes = mapi.GetTableStats ().rehashes;
+        if (mapi.Size () != 2000 || mapi.Capacity () <= capacity ||
+            rehashes > mapi.BucketCount ()) {
+            printf ("!!! Wrong PutBatch size %lu, capacity %lu, %lu rehashes\n", mapi.Size (),
+                    mapi.Capacity (), rehashes);
+        }
+    }
+
+    {
+        // a cache evicts instead of growing, and keeps the keys that are looked up
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (16, 1);
+        mapi.SetCacheMode (4);
+        auto thread_info = mapi.getThreadInfo ();
+        size_t hot_found = 0;
+        for (size_t i = 0; i < 100000; i++) {
+            mapi.Put (i + 100, i, thread_info);
+            // a cache of the 100 keys below 100, each read every 100 inserts
+            if (mapi.Find (i % 100, thread_info, [&] (MyHash::RecordType record) {})) {
+                hot_found++;
+            } else {
+                mapi.Put (i % 100, i, thread_info);
+            }
+        }
+        if (mapi.Capacity () > 16 * 4 * 7 ||
+            mapi.Size () + mapi.Evictions () != 100000 + (100000 - hot_found)) {
+            printf ("!!! Cache grew to %lu slots, size %lu, evictions %lu\n", mapi.Capacity (),
+                    mapi.Size (), mapi.Evictions ());
+        }
+        if (hot_found < 98000) {
+            printf ("!!! Cache kept only %lu of 100000 hot lookups\n", hot_found);
+        }
+    }
+
+    {
+        // the table stats, whose operation counters are only kept with TURBO_HASH_STATS
+        typedef turbo::unordered_map<size_t, size_t> MyHash;
+        MyHash mapi (16, 1);
+        auto thread_info = mapi.getThreadInfo ();
+        for (size_t i = 0; i < 10000; i++) {
+            mapi.Put (i, i, thread_info);
+        }
+        for (size_t i = 0; i < 20000; i++) {
+            mapi.Find (i, thread_info, [&] (MyHash::RecordType record) {});
+        }
+        for (size_t i = 0; i < 5000; i++) {
+            mapi.Delete (i, thread_info);
+        }
+        turbo::TableStats stats = mapi.GetTableStats ();
+        size_t buckets = 0, finds = 0, inserts = 0, deletes = 0;
+        for (size_t count : stats.bucket_cells) {
+            buckets += count;
+        }
+        for (int i = 0; i < turbo::kProbeHistogramSize; i++) {
+            finds += stats.find_probes[i];
+            inserts += stats.insert_probes[i];
+            deletes += stats.delete_probes[i];
+        }
+        bool counted = finds == 20000 && inserts == 10000 && deletes == 5000 &&
+                       stats.rehashes > 0 && stats.rehash_bytes > 0 &&
+                       stats.garbage_pending_bytes > 0;
+        if (buckets != mapi.BucketCount () || counted != kTurboHashStats) {
+            printf ("!!! Wrong table stats: %lu buckets, %lu finds, %lu inserts, %lu deletes\n",
+                    buckets, finds, inserts, deletes);
+        }
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -5,13 +5,22 @@
 #include <atomic>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <functional>
+#include <limits>
 
-#include "tbb/combinable.h"
-#include "tbb/enumerable_thread_specific.h"
+// the most threads (ThreadInfo objects) that can use one Epoche at the same time
+#ifndef TURBO_EPOCHE_MAX_THREADS
+#define TURBO_EPOCHE_MAX_THREADS 256
+#endif
+
+// with TURBO_EPOCHE_STATS, the retired pointers and bytes waiting to be freed are counted,
+// see Epoche::pending
 
 namespace epoche {
 
+static constexpr std::size_t kCacheLineSize = 64;
+
 struct LabelDelete {
     std::array<std::function<void ()>, 32> nodes;
     uint64_t epoche;
@@ -19,13 +28,126 @@ struct LabelDelete {
     LabelDelete* next;
 };
 
-class DeletionList {
-    LabelDelete* headDeletionList = nullptr;
+// free 'count' retired pointers of one kind. context is given when the kind is registered.
+using RetireDeleter = void (*) (void* context, void* const* ptrs, std::size_t count);
+
+static constexpr int kMaxRetireKinds = 4;
+static constexpr std::size_t kRetireRingSize = 1024;
+
+/** RetireRing
+ *  @note: per-thread FIFO of retired pointers of one kind and the epoche they were retired
+ *         in. The epoches only grow from tail to head, so the pointers safe to free are
+ *         always a prefix and are handed to the deleter in (at most two) contiguous batches.
+ *         The ring is allocated on first use and only grows when readers hold it back.
+ */
+class RetireRing {
+    void** ptrs = nullptr;
+    uint64_t* epoches = nullptr;
+#ifdef TURBO_EPOCHE_STATS
+    std::size_t* sizes = nullptr;  // the bytes given to retire
+#endif
+    std::size_t capacity = 0;  // power of two
+    std::size_t headPos = 0;   // oldest entry
+    std::size_t tailPos = 0;   // next free entry
+
+public:
+    ~RetireRing () {
+        assert (headPos == tailPos);
+        std::free (ptrs);
+        std::free (epoches);
+#ifdef TURBO_EPOCHE_STATS
+        std::free (sizes);
+#endif
+    }
+
+    std::size_t size () const { return tailPos - headPos; }
+
+    bool full () const { return size () == capacity; }
+
+    void add (void* ptr, uint64_t globalEpoch, std::size_t bytes) {
+        if (full ()) {
+            grow ();
+        }
+        std::size_t pos = tailPos++ & (capacity - 1);
+        ptrs[pos] = ptr;
+        epoches[pos] = globalEpoch;
+#ifdef TURBO_EPOCHE_STATS
+        sizes[pos] = bytes;
+#endif
+    }
+
+    // free the entries retired before oldestEpoche, return their count. Their bytes are
+    // added to freedBytes with TURBO_EPOCHE_STATS
+    std::size_t reclaim (uint64_t oldestEpoche, RetireDeleter deleter, void* context,
+                         std::size_t& freedBytes) {
+        std::size_t count = 0;
+        while (headPos + count < tailPos &&
+               epoches[(headPos + count) & (capacity - 1)] < oldestEpoche) {
+#ifdef TURBO_EPOCHE_STATS
+            freedBytes += sizes[(headPos + count) & (capacity - 1)];
+#endif
+            count++;
+        }
+        std::size_t start = headPos & (capacity - 1);
+        std::size_t first = std::min (count, capacity - start);
+        if (first > 0) {
+            deleter (context, ptrs + start, first);
+        }
+        if (count > first) {
+            deleter (context, ptrs, count - first);
+        }
+        headPos += count;
+        return count;
+    }
+
+private:
+    void grow () {
+        std::size_t new_capacity = capacity == 0 ? kRetireRingSize : capacity << 1;
+        void** new_ptrs = static_cast<void**> (std::malloc (new_capacity * sizeof (void*)));
+        uint64_t* new_epoches =
+            static_cast<uint64_t*> (std::malloc (new_capacity * sizeof (uint64_t)));
+        std::size_t n = size ();
+        for (std::size_t i = 0; i < n; i++) {
+            new_ptrs[i] = ptrs[(headPos + i) & (capacity - 1)];
+            new_epoches[i] = epoches[(headPos + i) & (capacity - 1)];
+        }
+        std::free (ptrs);
+        std::free (epoches);
+        ptrs = new_ptrs;
+        epoches = new_epoches;
+#ifdef TURBO_EPOCHE_STATS
+        std::size_t* new_sizes =
+            static_cast<std::size_t*> (std::malloc (new_capacity * sizeof (std::size_t)));
+        for (std::size_t i = 0; i < n; i++) {
+            new_sizes[i] = sizes[(headPos + i) & (capacity - 1)];
+        }
+        std::free (sizes);
+        sizes = new_sizes;
+#endif
+        capacity = new_capacity;
+        headPos = 0;
+        tailPos = n;
+    }
+};
+
+/** DeletionList
+ *  @note: one slot of the thread registry of an Epoche. localEpoche, read by every thread
+ *         that computes the oldest epoche, has a cache line of its own.
+ */
+class alignas (kCacheLineSize) DeletionList {
+public:
+    // max when no thread is in an epoche with this slot
+    std::atomic<uint64_t> localEpoche{std::numeric_limits<uint64_t>::max ()};
+
+private:
+    alignas (kCacheLineSize) LabelDelete* headDeletionList = nullptr;
     LabelDelete* freeLabelDeletes = nullptr;
     std::size_t deletitionListCount = 0;
 
 public:
-    std::atomic<uint64_t> localEpoche;
+    // ThreadInfo objects sharing this slot, 0: free, kReleasing: its last one is leaving
+    std::atomic<uint32_t> users{0};
+    static constexpr uint32_t kReleasing = std::numeric_limits<uint32_t>::max ();
     size_t thresholdCounter{0};
 
     ~DeletionList ();
@@ -37,8 +159,18 @@ public:
 
     std::size_t size ();
 
+    std::array<RetireRing, kMaxRetireKinds> retireRings;
+
     std::uint64_t deleted = 0;
     std::uint64_t added = 0;
+
+#ifdef TURBO_EPOCHE_STATS
+    // retired pointers and their bytes, written by the owner of the slot only
+    std::atomic<std::size_t> retiredCount{0};
+    std::atomic<std::size_t> retiredBytes{0};
+    std::atomic<std::size_t> freedCount{0};
+    std::atomic<std::size_t> freedBytes{0};
+#endif
 };
 
 class Epoche;
@@ -54,21 +186,46 @@ class ThreadInfo {
 public:
     ThreadInfo (Epoche& epoche);
 
-    ThreadInfo (const ThreadInfo& ti) : epoche (ti.epoche), deletionList (ti.deletionList) {}
+    ThreadInfo (const ThreadInfo& ti) : epoche (ti.epoche), deletionList (ti.deletionList) {
+        deletionList.users.fetch_add (1);
+    }
 
     ~ThreadInfo ();
 
     Epoche& getEpoche () const;
+
+    // index of the registry slot, below TURBO_EPOCHE_MAX_THREADS. Copies share it
+    std::size_t slot () const;
 };
 
+/** Epoche
+ *  @note: epoche based reclamation over a fixed registry of maxThreads slots. Every
+ *         ThreadInfo claims a free slot and releases it when its last copy is destroyed.
+ *         The oldest epoche of all the slots is cached, so a cleanup only scans the
+ *         registry (up to the highest slot ever used) when the cached value cannot free
+ *         enough. The global epoche is advanced once per cleanup, not per deletion.
+ */
 class Epoche {
     friend class ThreadInfo;
-    std::atomic<uint64_t> currentEpoche{0};
-    tbb::enumerable_thread_specific<DeletionList> deletionLists;
+    alignas (kCacheLineSize) std::atomic<uint64_t> currentEpoche{0};
+    // no slot is in an epoche older than this, it only grows
+    alignas (kCacheLineSize) std::atomic<uint64_t> cachedOldestEpoche{0};
+    alignas (kCacheLineSize) std::atomic<std::size_t> usedSlots{0};
+    DeletionList* deletionLists;
+    std::size_t maxThreads;
     size_t startGCThreshhold;
+    std::array<std::pair<RetireDeleter, void*>, kMaxRetireKinds> retireDeleters;
+    int retireKindCount = 0;
+
+    DeletionList& acquireDeletionList ();
+    uint64_t oldestLocalEpoche ();
+    std::size_t reclaim (DeletionList& deletionList, uint64_t oldestEpoche);
 
 public:
-    Epoche (size_t startGCThreshhold) : startGCThreshhold (startGCThreshhold) {}
+    Epoche (size_t startGCThreshhold, std::size_t maxThreads = TURBO_EPOCHE_MAX_THREADS)
+        : deletionLists (new DeletionList[maxThreads]),
+          maxThreads (maxThreads),
+          startGCThreshhold (startGCThreshhold) {}
 
     ~Epoche ();
 
@@ -76,6 +233,25 @@ public:
 
     void markNodeForDeletion (const std::function<void ()>& callback, ThreadInfo& epocheInfo);
 
+    /** registerRetireKind
+     *  @note: register a batch deleter for pointers passed to retire, return its kind.
+     *         Must be called before any thread retires a pointer.
+     */
+    int registerRetireKind (RetireDeleter deleter, void* context);
+
+    /** retire
+     *  @note: free ptr with the deleter of 'kind' once no thread can read it. Unlike
+     *         markNodeForDeletion, this does not build a std::function. bytes is only
+     *         counted, see pending.
+     */
+    void retire (void* ptr, int kind, ThreadInfo& epocheInfo, std::size_t bytes = 0);
+
+    /** pending
+     *  @note: the retired pointers not freed yet and the bytes given for them, summed over
+     *         all the slots. Both stay 0 without TURBO_EPOCHE_STATS.
+     */
+    void pending (std::size_t& count, std::size_t& bytes);
+
     void exitEpocheAndCleanup (ThreadInfo& info);
 };
 
@@ -102,7 +278,16 @@ public:
 };
 
 inline ThreadInfo::~ThreadInfo () {
-    deletionList.localEpoche.store (std::numeric_limits<uint64_t>::max ());
+    // the last copy takes the slot from 1 to kReleasing, which acquireDeletionList does not
+    // claim, so the slot is only freed once it has left the epoche
+    uint32_t users = deletionList.users.load ();
+    while (!deletionList.users.compare_exchange_weak (
+        users, users == 1 ? DeletionList::kReleasing : users - 1)) {
+    }
+    if (users == 1) {
+        deletionList.localEpoche.store (std::numeric_limits<uint64_t>::max ());
+        deletionList.users.store (0);
+    }
 }
 
 inline DeletionList::~DeletionList () {
@@ -116,7 +301,14 @@ inline DeletionList::~DeletionList () {
     freeLabelDeletes = nullptr;
 }
 
-inline std::size_t DeletionList::size () { return deletitionListCount; }
+// callbacks and retired pointers waiting to be freed
+inline std::size_t DeletionList::size () {
+    std::size_t count = deletitionListCount;
+    for (auto& ring : retireRings) {
+        count += ring.size ();
+    }
+    return count;
+}
 
 inline void DeletionList::remove (LabelDelete* label, LabelDelete* prev) {
     if (prev == nullptr) {
@@ -168,75 +360,161 @@ inline void Epoche::markNodeForDeletion (const std::function<void ()>& callback,
     epocheInfo.getDeletionList ().thresholdCounter++;
 }
 
-inline void Epoche::exitEpocheAndCleanup (ThreadInfo& epocheInfo) {
+inline int Epoche::registerRetireKind (RetireDeleter deleter, void* context) {
+    assert (retireKindCount < kMaxRetireKinds);
+    retireDeleters[retireKindCount] = {deleter, context};
+    return retireKindCount++;
+}
+
+inline void Epoche::retire (void* ptr, int kind, ThreadInfo& epocheInfo, std::size_t bytes) {
     DeletionList& deletionList = epocheInfo.getDeletionList ();
-    if ((deletionList.thresholdCounter & (64 - 1)) == 1) {
-        currentEpoche++;
+    RetireRing& ring = deletionList.retireRings[kind];
+    if (ring.full ()) {
+        // try to make room before the ring grows
+        reclaim (deletionList, oldestLocalEpoche ());
     }
-    if (deletionList.thresholdCounter > startGCThreshhold) {
-        if (deletionList.size () == 0) {
-            deletionList.thresholdCounter = 0;
-            return;
-        }
-        deletionList.localEpoche.store (std::numeric_limits<uint64_t>::max ());
+    ring.add (ptr, currentEpoche.load (), bytes);
+    deletionList.thresholdCounter++;
+    deletionList.added++;
+#ifdef TURBO_EPOCHE_STATS
+    auto relaxed = std::memory_order_relaxed;
+    deletionList.retiredCount.store (deletionList.retiredCount.load (relaxed) + 1, relaxed);
+    deletionList.retiredBytes.store (deletionList.retiredBytes.load (relaxed) + bytes, relaxed);
+#endif
+}
 
-        uint64_t oldestEpoche = std::numeric_limits<uint64_t>::max ();
-        for (auto& epoche : deletionLists) {
-            auto e = epoche.localEpoche.load ();
-            if (e < oldestEpoche) {
-                oldestEpoche = e;
-            }
-        }
+inline void Epoche::pending (std::size_t& count, std::size_t& bytes) {
+    count = 0;
+    bytes = 0;
+#ifdef TURBO_EPOCHE_STATS
+    std::size_t used = usedSlots.load ();
+    for (std::size_t i = 0; i < used; i++) {
+        DeletionList& deletionList = deletionLists[i];
+        // freed first, so a free racing with the scan never makes the difference negative
+        std::size_t freedCount = deletionList.freedCount.load (std::memory_order_acquire);
+        std::size_t freedBytes = deletionList.freedBytes.load (std::memory_order_acquire);
+        count += deletionList.retiredCount.load (std::memory_order_relaxed) - freedCount;
+        bytes += deletionList.retiredBytes.load (std::memory_order_relaxed) - freedBytes;
+    }
+#endif
+}
 
-        LabelDelete *cur = deletionList.head (), *next, *prev = nullptr;
-        while (cur != nullptr) {
-            next = cur->next;
-
-            if (cur->epoche < oldestEpoche) {
-                for (std::size_t i = 0; i < cur->nodesCount; ++i) {
-                    cur->nodes[i]();
-                }
-                deletionList.remove (cur, prev);
-            } else {
-                prev = cur;
+// claim a free slot of the registry, starting from the slot this thread used last
+inline DeletionList& Epoche::acquireDeletionList () {
+    static thread_local std::size_t hint = 0;
+    for (std::size_t n = 0; n < maxThreads; n++) {
+        std::size_t i = (hint + n) % maxThreads;
+        DeletionList& deletionList = deletionLists[i];
+        uint32_t expected = 0;
+        if (deletionList.users.load (std::memory_order_relaxed) == 0 &&
+            deletionList.users.compare_exchange_strong (expected, 1)) {
+            hint = i;
+            // make the scans of oldestLocalEpoche cover this slot
+            std::size_t used = usedSlots.load ();
+            while (used <= i && !usedSlots.compare_exchange_weak (used, i + 1)) {
             }
-            cur = next;
+            return deletionList;
         }
-        deletionList.thresholdCounter = 0;
     }
+    printf ("Epoche: more than %lu threads, raise TURBO_EPOCHE_MAX_THREADS\n", maxThreads);
+    exit (1);
 }
 
-inline Epoche::~Epoche () {
-    uint64_t oldestEpoche = std::numeric_limits<uint64_t>::max ();
-    for (auto& epoche : deletionLists) {
-        auto e = epoche.localEpoche.load ();
+// scan the registry and raise cachedOldestEpoche
+inline uint64_t Epoche::oldestLocalEpoche () {
+    // a thread that enters later reads at least the current epoche
+    uint64_t oldestEpoche = currentEpoche.load ();
+    std::size_t used = usedSlots.load ();
+    for (std::size_t i = 0; i < used; i++) {
+        auto e = deletionLists[i].localEpoche.load ();
         if (e < oldestEpoche) {
             oldestEpoche = e;
         }
     }
+    uint64_t cached = cachedOldestEpoche.load ();
+    while (cached < oldestEpoche &&
+           !cachedOldestEpoche.compare_exchange_weak (cached, oldestEpoche)) {
+    }
+    return oldestEpoche;
+}
 
-    for (auto& d : deletionLists) {
-        LabelDelete *cur = d.head (), *next, *prev = nullptr;
-        while (cur != nullptr) {
-            next = cur->next;
+// free everything in deletionList retired before oldestEpoche, return the freed count
+inline std::size_t Epoche::reclaim (DeletionList& deletionList, uint64_t oldestEpoche) {
+    std::size_t freed = 0;
+    LabelDelete *cur = deletionList.head (), *next, *prev = nullptr;
+    while (cur != nullptr) {
+        next = cur->next;
 
-            assert (cur->epoche < oldestEpoche);
+        if (cur->epoche < oldestEpoche) {
             for (std::size_t i = 0; i < cur->nodesCount; ++i) {
                 cur->nodes[i]();
             }
-            d.remove (cur, prev);
-            cur = next;
+            freed += cur->nodesCount;
+            deletionList.remove (cur, prev);
+        } else {
+            prev = cur;
+        }
+        cur = next;
+    }
+
+    std::size_t freedRetired = 0;
+    std::size_t freedBytes = 0;
+    for (int kind = 0; kind < retireKindCount; kind++) {
+        std::size_t count = deletionList.retireRings[kind].reclaim (
+            oldestEpoche, retireDeleters[kind].first, retireDeleters[kind].second, freedBytes);
+        deletionList.deleted += count;
+        freedRetired += count;
+    }
+#ifdef TURBO_EPOCHE_STATS
+    auto relaxed = std::memory_order_relaxed;
+    // released, a scan that reads the freed counts reads the retired counts they follow
+    auto release = std::memory_order_release;
+    deletionList.freedCount.store (deletionList.freedCount.load (relaxed) + freedRetired, release);
+    deletionList.freedBytes.store (deletionList.freedBytes.load (relaxed) + freedBytes, release);
+#endif
+    return freed + freedRetired;
+}
+
+inline void Epoche::exitEpocheAndCleanup (ThreadInfo& epocheInfo) {
+    DeletionList& deletionList = epocheInfo.getDeletionList ();
+    if (deletionList.thresholdCounter > startGCThreshhold) {
+        std::size_t pending = deletionList.size ();
+        if (pending == 0) {
+            deletionList.thresholdCounter = 0;
+            return;
         }
+        // one advance per cleanup, a failed exchange means another thread advanced it
+        uint64_t cur = currentEpoche.load ();
+        currentEpoche.compare_exchange_strong (cur, cur + 1);
+        deletionList.localEpoche.store (std::numeric_limits<uint64_t>::max ());
+
+        std::size_t freed = reclaim (deletionList, cachedOldestEpoche.load ());
+        if (freed * 2 < pending) {
+            reclaim (deletionList, oldestLocalEpoche ());
+        }
+        deletionList.thresholdCounter = 0;
     }
 }
 
+inline Epoche::~Epoche () {
+    // no thread may be in an epoche any more, free everything
+    std::size_t used = usedSlots.load ();
+    for (std::size_t i = 0; i < used; i++) {
+        reclaim (deletionLists[i], std::numeric_limits<uint64_t>::max ());
+        assert (deletionLists[i].size () == 0);
+    }
+    delete[] deletionLists;
+}
+
 inline ThreadInfo::ThreadInfo (Epoche& epoche)
-    : epoche (epoche), deletionList (epoche.deletionLists.local ()) {}
+    : epoche (epoche), deletionList (epoche.acquireDeletionList ()) {}
 
 inline DeletionList& ThreadInfo::getDeletionList () const { return deletionList; }
 
 inline Epoche& ThreadInfo::getEpoche () const { return epoche; }
 
+inline std::size_t ThreadInfo::slot () const { return &deletionList - epoche.deletionLists; }
+
 }  // namespace epoche
 
 #endif
@@ -37,13 +37,20 @@
 #include <jemalloc/jemalloc.h>
 #include <mmintrin.h>
 #include <pthread.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -51,15 +58,25 @@
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+// count the operations of every thread for GetTableStats
+// #define TURBO_HASH_STATS
+#ifdef TURBO_HASH_STATS
+#define TURBO_EPOCHE_STATS
+#endif
+
 #include "turbo_epoche.h"
 // #define PIN_KEY_TO_THREAD
 
@@ -68,6 +85,12 @@ static constexpr int kTurboCellCountLimit = 32768;
 static constexpr int kTurboMaxProbeLen = 15;
 static constexpr int kTurboProbeStep = 1;
 
+#ifdef TURBO_HASH_STATS
+static constexpr bool kTurboHashStats = true;
+#else
+static constexpr bool kTurboHashStats = false;
+#endif
+
 #define TURBO_LIKELY(x) (__builtin_expect (!!(x), 1))
 #define TURBO_UNLIKELY(x) (__builtin_expect (!!(x), 0))
 
@@ -123,11 +146,11 @@ class BitSet {
 public:
     BitSet () : bits_ (0) {}
 
-    explicit BitSet (uint32_t bits) : bits_ (bits) {}
+    explicit BitSet (uint64_t bits) : bits_ (bits) {}
 
     BitSet (const BitSet& b) = default;
 
-    inline int validCount (void) { return __builtin_popcount (bits_); }
+    inline int validCount (void) { return __builtin_popcountll (bits_); }
 
     inline BitSet& operator++ () {
         // remove the lowest 1-bit
@@ -139,21 +162,127 @@ public:
 
     inline int operator* () const {
         // count the tailing zero bit
-        return __builtin_ctz (bits_);
+        return __builtin_ctzll (bits_);
     }
 
     inline BitSet begin () const { return *this; }
 
     inline BitSet end () const { return BitSet (0); }
 
-    inline uint32_t bit () { return bits_; }
+    inline uint64_t bit () { return bits_; }
 
 private:
     friend bool operator== (const BitSet& a, const BitSet& b) { return a.bits_ == b.bits_; }
     friend bool operator!= (const BitSet& a, const BitSet& b) { return a.bits_ != b.bits_; }
-    uint32_t bits_;
+    uint64_t bits_;
 };  // end of class BitSet
 
+/** SimdLevel
+ *  @note: instruction set of the hash tag matching kernels. The best level the CPU
+ *         supports is selected once at startup, so one binary runs on hosts with and
+ *         without AVX-512. SetSimdLevel can lower it, e.g. to test every path.
+ */
+enum class SimdLevel { kSSE2 = 0, kAVX2 = 1, kAVX512 = 2 };
+
+inline const char* SimdLevelName (SimdLevel level) {
+    static const char* names[] = {"SSE2", "AVX2", "AVX512"};
+    return names[static_cast<int> (level)];
+}
+
+// Match the 16 one-byte tags at 'tags' against h2. Bit i of the result is set if tag i
+// equals h2.
+inline uint64_t MatchTag16SSE2 (const char* tags, uint8_t h2) {
+    __m128i t = _mm_loadu_si128 (reinterpret_cast<const __m128i*> (tags));
+    return static_cast<uint16_t> (_mm_movemask_epi8 (_mm_cmpeq_epi8 (t, _mm_set1_epi8 (h2))));
+}
+
+__attribute__ ((target ("avx2"))) inline uint64_t MatchTag16AVX2 (const char* tags, uint8_t h2) {
+    // the VEX encoded compare, which avoids SSE/AVX transitions in AVX code
+    __m128i t = _mm_loadu_si128 (reinterpret_cast<const __m128i*> (tags));
+    return static_cast<uint16_t> (_mm_movemask_epi8 (_mm_cmpeq_epi8 (t, _mm_set1_epi8 (h2))));
+}
+
+__attribute__ ((target ("avx512bw,avx512vl"))) inline uint64_t MatchTag16AVX512 (const char* tags,
+                                                                                 uint8_t h2) {
+    __m128i t = _mm_loadu_si128 (reinterpret_cast<const __m128i*> (tags));
+    return _mm_cmpeq_epi8_mask (t, _mm_set1_epi8 (h2));
+}
+
+// Match the 64 one-byte tags at 'tags' against h2.
+inline uint64_t MatchTag64SSE2 (const char* tags, uint8_t h2) {
+    __m128i h = _mm_set1_epi8 (h2);
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i t = _mm_loadu_si128 (reinterpret_cast<const __m128i*> (tags) + i);
+        uint64_t m = static_cast<uint16_t> (_mm_movemask_epi8 (_mm_cmpeq_epi8 (t, h)));
+        mask |= m << (i * 16);
+    }
+    return mask;
+}
+
+__attribute__ ((target ("avx2"))) inline uint64_t MatchTag64AVX2 (const char* tags, uint8_t h2) {
+    __m256i h = _mm256_set1_epi8 (h2);
+    __m256i t0 = _mm256_loadu_si256 (reinterpret_cast<const __m256i*> (tags));
+    __m256i t1 = _mm256_loadu_si256 (reinterpret_cast<const __m256i*> (tags) + 1);
+    uint64_t m0 = static_cast<uint32_t> (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (t0, h)));
+    uint64_t m1 = static_cast<uint32_t> (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (t1, h)));
+    return m0 | (m1 << 32);
+}
+
+__attribute__ ((target ("avx512bw"))) inline uint64_t MatchTag64AVX512 (const char* tags,
+                                                                       uint8_t h2) {
+    return _mm512_cmpeq_epi8_mask (_mm512_loadu_si512 (tags), _mm512_set1_epi8 (h2));
+}
+
+struct SimdKernels {
+    SimdLevel level;
+    uint64_t (*match_tag16) (const char* tags, uint8_t h2);
+    uint64_t (*match_tag64) (const char* tags, uint8_t h2);
+};
+
+// Constant initialized to the SSE2 kernels, so tables used by static initializers work
+// before the dispatch below runs.
+inline SimdKernels simd_kernels = {SimdLevel::kSSE2, MatchTag16SSE2, MatchTag64SSE2};
+
+inline SimdLevel DetectSimdLevel () {
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx512bw") && __builtin_cpu_supports ("avx512vl")) {
+        return SimdLevel::kAVX512;
+    }
+    if (__builtin_cpu_supports ("avx2")) {
+        return SimdLevel::kAVX2;
+    }
+    return SimdLevel::kSSE2;
+}
+
+/** SetSimdLevel
+ *  @note: switch the tag matching kernels. Returns false, and keeps the current kernels,
+ *         if the CPU does not support the level. Not thread safe: call it before using
+ *         any hash table.
+ */
+inline bool SetSimdLevel (SimdLevel level) {
+    if (level > DetectSimdLevel ()) {
+        return false;
+    }
+    switch (level) {
+        case SimdLevel::kAVX512:
+            simd_kernels = {level, MatchTag16AVX512, MatchTag64AVX512};
+            break;
+        case SimdLevel::kAVX2:
+            simd_kernels = {level, MatchTag16AVX2, MatchTag64AVX2};
+            break;
+        default:
+            simd_kernels = {level, MatchTag16SSE2, MatchTag64SSE2};
+            break;
+    }
+    return true;
+}
+
+inline SimdLevel GetSimdLevel () { return simd_kernels.level; }
+
+// select the best kernels at startup
+inline const bool simd_kernels_selected = SetSimdLevel (DetectSimdLevel ());
+
 /** Slice
  *  @note: Derived from LevelDB. the data is stored in the *data_
  */
@@ -388,6 +517,103 @@ private:
     uint32_t* lock_;
 };  // end of class SpinLockScope
 
+/** Bucket lock policies
+ *  @note: how a writer takes the lock bit of a bucket, in the word that also holds the
+ *         cell address every lookup loads. Select one through the BucketLock parameter of
+ *         the hash table. A policy keeps a Queue per bucket outside the directory.
+ *         SpinBitLock: test and set the bit, spinning on loads of the word (default).
+ *         BackoffBitLock: the same, pausing twice as long after each failed attempt, so
+ *         contending writers take the cache line of the word from lookups less often.
+ *         TicketBitLock: writers draw a ticket from the Queue and spin on the Queue until
+ *         served, in FIFO order. Only the owner writes the word, once per acquisition.
+ *  Lock returns the rounds the caller waited, 0 if the lock was free.
+ */
+class SpinBitLock {
+public:
+    struct Queue {};
+
+    static inline uint32_t Lock (uint32_t* lock, int bit_pos, Queue* queue) {
+        uint32_t rounds = 0;
+        uint32_t old_value = __atomic_load_n (lock, __ATOMIC_ACQUIRE);
+        while (true) {
+            if (!(old_value & (1 << bit_pos))) {
+                if (CAS (lock, &old_value, old_value | (1 << bit_pos))) {
+                    return rounds;
+                }
+            } else {
+                TURBO_CPU_RELAX ();
+                old_value = __atomic_load_n (lock, __ATOMIC_ACQUIRE);
+            }
+            rounds++;
+        }
+    }
+
+    static inline void Unlock (uint32_t* lock, int bit_pos, Queue* queue) {
+        turbo_bit_spin_unlock (lock, bit_pos);
+    }
+};  // end of class SpinBitLock
+
+class BackoffBitLock {
+public:
+    struct Queue {};
+
+    static constexpr uint32_t kMaxPause = 1024;
+
+    static inline uint32_t Lock (uint32_t* lock, int bit_pos, Queue* queue) {
+        uint32_t rounds = 0;
+        uint32_t pause = 1;
+        while (true) {
+            uint32_t old_value = __atomic_load_n (lock, __ATOMIC_ACQUIRE);
+            if (!(old_value & (1 << bit_pos)) &&
+                CAS (lock, &old_value, old_value | (1 << bit_pos))) {
+                return rounds;
+            }
+            rounds++;
+            for (uint32_t i = 0; i < pause; i++) {
+                TURBO_CPU_RELAX ();
+            }
+            pause = std::min (pause * 2, kMaxPause);
+        }
+    }
+
+    static inline void Unlock (uint32_t* lock, int bit_pos, Queue* queue) {
+        turbo_bit_spin_unlock (lock, bit_pos);
+    }
+};  // end of class BackoffBitLock
+
+class TicketBitLock {
+public:
+    struct Queue {
+        std::atomic<uint32_t> next{0};
+        std::atomic<uint32_t> serving{0};
+    };
+
+    static inline uint32_t Lock (uint32_t* lock, int bit_pos, Queue* queue) {
+        uint32_t ticket = queue->next.fetch_add (1, std::memory_order_relaxed);
+        uint32_t rounds = 0;
+        while (true) {
+            uint32_t ahead = ticket - queue->serving.load (std::memory_order_acquire);
+            if (ahead == 0) {
+                break;
+            }
+            rounds++;
+            // wait longer the farther back in the queue
+            for (uint32_t i = 0; i < ahead; i++) {
+                TURBO_CPU_RELAX ();
+            }
+        }
+        // the other bits of the word may be changed concurrently
+        __atomic_fetch_or (lock, 1 << bit_pos, __ATOMIC_ACQUIRE);
+        return rounds;
+    }
+
+    static inline void Unlock (uint32_t* lock, int bit_pos, Queue* queue) {
+        __atomic_fetch_and (lock, ~(1 << bit_pos), __ATOMIC_RELEASE);
+        queue->serving.store (queue->serving.load (std::memory_order_relaxed) + 1,
+                              std::memory_order_release);
+    }
+};  // end of class TicketBitLock
+
 // https://rigtorp.se/spinlock/
 class AtomicSpinLock {
 public:
@@ -420,1337 +646,3824 @@ public:
     void inline unlock () noexcept { lock_.store (false, std::memory_order_release); }
 };  // end of class AtomicSpinLock
 
-};  // namespace util
+/** StripedCounter
+ *  @note: a counter split into kStripeCount cache line padded stripes. A thread picks
+ *         its stripe on first use and keeps adding to it, so concurrent writers rarely
+ *         share a cache line. Load sums all stripes, which is a snapshot of the count
+ *         when there are concurrent updates.
+ */
+template <int kStripeCount>
+class StripedCounter {
+public:
+    static_assert (kStripeCount > 0, "StripedCounter needs at least one stripe");
 
-// A thin wrapper around std::hash, performing an additional simple mixing step
-// of the result. from https://github.com/martinus/robin-hood-hashing
-template <typename T>
-struct hash : public std::hash<T> {
-    size_t operator() (T const& obj) const
-        noexcept (noexcept (std::declval<std::hash<T>> ().operator() (std::declval<T const&> ()))) {
-        // call base hash
-        auto result = std::hash<T>::operator() (obj);
-        // return mixed of that, to be save against identity has
-        return util::Hasher::hash_int (static_cast<uint64_t> (result));
+    StripedCounter () {
+        for (auto& stripe : stripes_) {
+            stripe.count.store (0, std::memory_order_relaxed);
+        }
     }
-};
-template <>
-struct hash<std::string> {
-    size_t operator() (std::string const& str) const noexcept {
-        return util::Hasher::hash (str.data (), str.size ());
+
+    inline void Add (int64_t delta) {
+        stripes_[stripeIndex ()].count.fetch_add (delta, std::memory_order_relaxed);
     }
-};
-template <class T>
-struct hash<T*> {
-    size_t operator() (T* ptr) const noexcept {
-        return util::Hasher::hash_int (reinterpret_cast<size_t> (ptr));
+
+    inline size_t Load () const {
+        // a record may be added and deleted via different stripes
+        int64_t sum = 0;
+        for (auto& stripe : stripes_) {
+            sum += stripe.count.load (std::memory_order_relaxed);
+        }
+        return sum < 0 ? 0 : sum;
     }
-};
-#define TURBO_HASH_INT(T)                                                \
-    template <>                                                          \
-    struct hash<T> {                                                     \
-        size_t operator() (T obj) const noexcept {                       \
-            return util::Hasher::hash_int (static_cast<uint64_t> (obj)); \
-        }                                                                \
+
+private:
+    static inline int stripeIndex () {
+        static std::atomic<int> next_stripe{0};
+        static thread_local int stripe =
+            next_stripe.fetch_add (1, std::memory_order_relaxed) % kStripeCount;
+        return stripe;
     }
-#if defined(__GNUC__) && !defined(__clang__)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wuseless-cast"
-#endif
-// see https://en.cppreference.com/w/cpp/utility/hash
-TURBO_HASH_INT (bool);
-TURBO_HASH_INT (char);
-TURBO_HASH_INT (signed char);
-TURBO_HASH_INT (unsigned char);
-TURBO_HASH_INT (char16_t);
-TURBO_HASH_INT (char32_t);
-TURBO_HASH_INT (wchar_t);
-TURBO_HASH_INT (short);
-TURBO_HASH_INT (unsigned short);
-TURBO_HASH_INT (int);
-TURBO_HASH_INT (unsigned int);
-TURBO_HASH_INT (long);
-TURBO_HASH_INT (long long);
-TURBO_HASH_INT (unsigned long);
-TURBO_HASH_INT (unsigned long long);
-#if defined(__GNUC__) && !defined(__clang__)
-#pragma GCC diagnostic pop
-#endif
-// dummy hash, unsed as mixer when turbo::hash is already used
-template <typename T>
-struct identity_hash {
-    constexpr size_t operator() (T const& obj) const noexcept { return static_cast<size_t> (obj); }
-};
 
-namespace detail {
+    struct alignas (64) Stripe {
+        std::atomic<int64_t> count;
+    };
 
-// using wrapper classes for hash and key_equal prevents the diamond problem
-// when the same type is used. see https://stackoverflow.com/a/28771920/48181
-// from robinhood hash. https://github.com/martinus/robin-hood-hashing
-template <typename T>
-struct WrapHash : public T {
-    WrapHash () = default;
-    explicit WrapHash (T const& o) noexcept (noexcept (T (std::declval<T const&> ()))) : T (o) {}
-};
-template <typename T>
-struct WrapKeyEqual : public T {
-    WrapKeyEqual () = default;
-    explicit WrapKeyEqual (T const& o) noexcept (noexcept (T (std::declval<T const&> ())))
-        : T (o) {}
-};
+    Stripe stripes_[kStripeCount];
+};  // end of class StripedCounter
 
-/** TurboHashTable
- *  @format:
- *           | bucket 0 | bucket 1 | ... | bucket n |
- *           |  cell 0  |  cell 0  |     |          |
- *           |  cell 1  |  cell 1  |     |          |
- *           |  cell 2  |  cell 2  |     |          |
- *           |    ...   |    ...   |     |          |
- *
+// A counter that counts nothing, for tables whose size is never queried
+class NullCounter {
+public:
+    inline void Add (int64_t delta) {}
+
+    inline size_t Load () const { return 0; }
+};  // end of class NullCounter
+
+/** MallocRecordAllocator
+ *  @note: allocate every out-of-line record with malloc
  */
-template <typename Key, typename T, typename Hash, typename KeyEqual, int kCellCountLimit = 32768>
-class TurboHashTable : public WrapHash<Hash>, public WrapKeyEqual<KeyEqual> {
+class MallocRecordAllocator {
 public:
-    static constexpr bool is_key_flat = std::is_same<Key, std::string>::value == false;
-    static constexpr bool is_value_flat = std::is_same<T, std::string>::value == false;
+    inline char* Allocate (size_t size) { return reinterpret_cast<char*> (malloc (size)); }
 
-    using key_type = Key;
-    using mapped_type = T;
-    using size_type = size_t;
-    using hasher = Hash;
+    inline void Release (char* addr) { free (addr); }
 
-    // private:
+    inline void ReleaseBatch (void* const* addrs, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            free (addrs[i]);
+        }
+    }
+};  // end of class MallocRecordAllocator
+
+/** SlabRecordAllocator
+ *  @note: record allocator with an arena per thread. An arena bump allocates records of a
+ *         size class from 64 KiB slabs of that class and keeps a free list per class. The
+ *         slab header at the 64 KiB aligned start tells the class and the owner arena of a
+ *         record, so records need no header. A record released by another thread, e.g. by
+ *         an epoche cleanup, goes back to a lock-free list of its owner arena, which takes
+ *         the whole list when its own free list runs dry. Records above 8 KiB get a block
+ *         of their own. The arena of an exited thread is adopted by the next new thread.
+ *         Slabs are returned to the system when the allocator is destroyed.
+ */
+class SlabRecordAllocator {
+public:
+    SlabRecordAllocator () : uid_ (nextUid ()) {
+        std::lock_guard<std::mutex> lock (registryMutex ());
+        liveAllocators ().insert (uid_);
+    }
 
-    /**
-     *  @note: obtain the Record Lenght
-     */
-    template <bool IsT1Numeric, typename T1>
-    struct Record1Size {};
+    SlabRecordAllocator (const SlabRecordAllocator&) = delete;
+    SlabRecordAllocator& operator= (const SlabRecordAllocator&) = delete;
 
-    /**
-     *  @note: calcuate the Record Lenght
-     */
-    template <bool IsT1Numeric, typename T1>
-    struct Record1Format {};
+    ~SlabRecordAllocator () {
+        {
+            std::lock_guard<std::mutex> lock (registryMutex ());
+            liveAllocators ().erase (uid_);
+        }
+        for (Arena* arena : arenas_) {
+            for (char* slab : arena->slabs) {
+                free (slab);
+            }
+            delete arena;
+        }
+    }
 
-    /**
-     *  @note: encode T1 to memory
-     *  ! allocate memory space in advance
-     */
-    template <bool IsT1Numeric, typename T1>
-    struct EncodeToRecord1 {};
+    inline char* Allocate (size_t size) {
+        int size_class = sizeClass (size);
+        if (size_class == kLargeClass) {
+            char* block = newSlab (nullptr, kLargeClass, kSlabHeaderSize + size);
+            return block + kSlabHeaderSize;
+        }
+        Arena* arena = localArena (true);
+        FreeNode* node = arena->free_list[size_class];
+        if (node == nullptr) {
+            // take back the records released by other threads
+            node = arena->remote_free[size_class].exchange (nullptr, std::memory_order_acquire);
+        }
+        if (node != nullptr) {
+            arena->free_list[size_class] = node->next;
+            return reinterpret_cast<char*> (node);
+        }
+        size_t class_size = classSize (size_class);
+        if (arena->bump[size_class] + class_size > arena->bump_end[size_class]) {
+            char* slab = newSlab (arena, size_class, kSlabSize);
+            arena->slabs.push_back (slab);
+            arena->bump[size_class] = slab + kSlabHeaderSize;
+            arena->bump_end[size_class] = slab + kSlabSize;
+        }
+        char* addr = arena->bump[size_class];
+        arena->bump[size_class] += class_size;
+        return addr;
+    }
 
-    /** DecodeInRecord1
-     *  @note: decode T1
+    inline void Release (char* addr) { ReleaseBatch (reinterpret_cast<void* const*> (&addr), 1); }
+
+    /** ReleaseBatch
+     *  @note: records of the same owner and class that are next to each other in addrs are
+     *         linked into one chain and handed back with a single push.
      */
-    template <bool IsT1Numeric, typename T1>
-    struct DecodeInRecord1 {};
+    void ReleaseBatch (void* const* addrs, size_t count) {
+        Arena* local = localArena (false);
+        SlabHeader* chain_slab = nullptr;
+        FreeNode* chain_head = nullptr;
+        FreeNode* chain_tail = nullptr;
+        for (size_t i = 0; i <= count; i++) {
+            SlabHeader* slab = i < count ? slabOf (addrs[i]) : nullptr;
+            if (slab != nullptr && slab->size_class == kLargeClass) {
+                free (slab);
+                continue;
+            }
+            if (chain_head != nullptr &&
+                (slab == nullptr || slab->owner != chain_slab->owner ||
+                 slab->size_class != chain_slab->size_class)) {
+                pushChain (chain_slab, chain_head, chain_tail, local);
+                chain_head = nullptr;
+            }
+            if (slab == nullptr) {
+                break;
+            }
+            FreeNode* node = reinterpret_cast<FreeNode*> (addrs[i]);
+            node->next = chain_head;
+            if (chain_head == nullptr) {
+                chain_tail = node;
+                chain_slab = slab;
+            }
+            chain_head = node;
+        }
+    }
 
-/** Case 1: T1 is numeric
- *  * record memory layout:
- *         |   T1  |
- *         |
- *         |
- *     addr start here
- */
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-    template <typename T1>
-    struct Record1Size<true, T1> {
-        static inline size_t Size (char* addr) { return sizeof (T1); }
+private:
+    static constexpr size_t kSlabSize = 64 << 10;
+    static constexpr size_t kSlabHeaderSize = 64;
+    // 16 classes of 16 to 256 bytes, then 512 B, 1, 2, 4 and 8 KiB
+    static constexpr int kClassCount = 21;
+    static constexpr int kLargeClass = kClassCount;
+
+    struct FreeNode {
+        FreeNode* next;
     };
-#pragma GCC diagnostic pop
 
-    template <typename T1>
-    struct Record1Format<true, T1> {
-        static inline constexpr size_t Length (const T1& t1) { return sizeof (t1); }
-    };
-    template <typename T1>
-    struct EncodeToRecord1<true, T1> {
-        static inline void Encode (const T1& t1, char* addr) { *reinterpret_cast<T1*> (addr) = t1; }
+    struct Arena {
+        FreeNode* free_list[kClassCount] = {};
+        char* bump[kClassCount] = {};
+        char* bump_end[kClassCount] = {};
+        std::atomic<FreeNode*> remote_free[kClassCount] = {};
+        std::atomic<bool> owned{true};  // false once its thread has exited
+        std::vector<char*> slabs;
     };
-    template <typename T1>
-    struct DecodeInRecord1<true, T1> {
-        static inline T1 Decode (char* addr) { return *reinterpret_cast<T1*> (addr); }
+
+    struct SlabHeader {
+        Arena* owner;  // nullptr for a large record
+        int size_class;
     };
 
-    /** Case 2: T1 is std::string
-     *  * record memory layout:
-     *         |  len1  | buffer1
-     *         | size_t |
-     *         |
-     *     addr start here
-     */
-    template <typename T1>
-    struct Record1Size<false, T1> {
-        static inline size_t Size (char* addr) {
-            size_t len1 = *reinterpret_cast<size_t*> (addr);
-            return sizeof (size_t) + len1;
+    // the arenas of one thread, orphaned when the thread exits
+    struct ThreadArenas {
+        std::vector<std::pair<uint64_t, Arena*>> arenas;
+
+        ~ThreadArenas () {
+            std::lock_guard<std::mutex> lock (registryMutex ());
+            for (auto& entry : arenas) {
+                if (liveAllocators ().count (entry.first)) {
+                    entry.second->owned.store (false, std::memory_order_release);
+                }
+            }
         }
     };
-    template <typename T1>
-    struct Record1Format<false, T1> {
-        static inline size_t Length (const T1& t1) { return sizeof (size_t) + t1.size (); }
-    };
-    template <typename T1>
-    struct EncodeToRecord1<false, T1> {
-        static inline void Encode (const T1& t1, char* addr) {
-            *reinterpret_cast<size_t*> (addr) = t1.size ();
-            memcpy (addr + sizeof (size_t), t1.data (), t1.size ());
+
+    static inline int sizeClass (size_t size) {
+        if (size <= 256) return size == 0 ? 0 : (size - 1) >> 4;
+        if (size > (8 << 10)) return kLargeClass;
+        return 16 + (63 - __builtin_clzl (size - 1)) - 8;
+    }
+
+    static inline size_t classSize (int size_class) {
+        return size_class < 16 ? (size_class + 1) << 4 : 512LU << (size_class - 16);
+    }
+
+    static inline SlabHeader* slabOf (void* addr) {
+        return reinterpret_cast<SlabHeader*> (reinterpret_cast<uintptr_t> (addr) &
+                                              ~(kSlabSize - 1));
+    }
+
+    static char* newSlab (Arena* owner, int size_class, size_t size) {
+        void* slab = nullptr;
+        if (posix_memalign (&slab, kSlabSize, size) != 0) {
+            perror ("slab alloc memory fail\n");
+            exit (1);
         }
-    };
-    // When T1 is std::string, 'Decode' return util::Slice, which is the reference
-    // of real value.
-    template <typename T1>
-    struct DecodeInRecord1<false, T1> {
-        static inline util::Slice Decode (char* addr) {
-            size_t len1 = *reinterpret_cast<size_t*> (addr);
-            return util::Slice (addr + sizeof (size_t), len1);
+        SlabHeader* header = reinterpret_cast<SlabHeader*> (slab);
+        header->owner = owner;
+        header->size_class = size_class;
+        return reinterpret_cast<char*> (slab);
+    }
+
+    // give a chain of free records back to the arena that owns their slab
+    static inline void pushChain (SlabHeader* slab, FreeNode* head, FreeNode* tail,
+                                  Arena* local) {
+        Arena* owner = slab->owner;
+        if (owner == local) {
+            tail->next = owner->free_list[slab->size_class];
+            owner->free_list[slab->size_class] = head;
+            return;
         }
-    };
+        std::atomic<FreeNode*>& remote = owner->remote_free[slab->size_class];
+        FreeNode* old_head = remote.load (std::memory_order_relaxed);
+        do {
+            tail->next = old_head;
+        } while (!remote.compare_exchange_weak (old_head, head, std::memory_order_release,
+                                                std::memory_order_relaxed));
+    }
 
-    /**
-     *  @note: obtain the Record Lenght
-     */
-    template <bool IsT1Numeric, bool IsT2Numeric, typename T1, typename T2>
-    struct Record2Size {};
+    // the arena of the calling thread, created or adopted on first use when 'create'
+    inline Arena* localArena (bool create) {
+        static thread_local ThreadArenas thread_arenas;
+        for (auto& entry : thread_arenas.arenas) {
+            if (entry.first == uid_) return entry.second;
+        }
+        if (!create) return nullptr;
+
+        Arena* arena = nullptr;
+        {
+            std::lock_guard<std::mutex> lock (arenas_mutex_);
+            for (Arena* orphan : arenas_) {
+                bool owned = false;
+                if (!orphan->owned.load (std::memory_order_acquire) &&
+                    orphan->owned.compare_exchange_strong (owned, true)) {
+                    arena = orphan;
+                    break;
+                }
+            }
+            if (arena == nullptr) {
+                arena = new Arena ();
+                arenas_.push_back (arena);
+            }
+        }
+        {
+            // forget the arenas of destroyed allocators
+            std::lock_guard<std::mutex> lock (registryMutex ());
+            auto& arenas = thread_arenas.arenas;
+            arenas.erase (std::remove_if (arenas.begin (), arenas.end (),
+                                          [] (const std::pair<uint64_t, Arena*>& entry) {
+                                              return liveAllocators ().count (entry.first) == 0;
+                                          }),
+                          arenas.end ());
+            arenas.push_back ({uid_, arena});
+        }
+        return arena;
+    }
 
-    /**
-     *  @note: calculate the Record Lenght
-     */
-    template <bool IsT1Numeric, bool IsT2Numeric, typename T1, typename T2>
-    struct Record2Format {};
+    static uint64_t nextUid () {
+        static std::atomic<uint64_t> uid{0};
+        return uid.fetch_add (1);
+    }
 
-    /** EncodeToRecord2
-     *  @note: encode T1 and T2 to addr.
-     *  ! The memory space should be allocated in advance
-     */
-    template <bool IsT1Numeric, bool IsT2Numeric, typename T1, typename T2>
-    struct EncodeToRecord2 {};
+    // the allocators alive, so an exiting thread only touches arenas that still exist
+    static std::mutex& registryMutex () {
+        static std::mutex mutex;
+        return mutex;
+    }
 
-    /** DecodeInRecord2
-     *  @note: decode T1 and T2
-     */
-    template <bool IsT1Numeric, bool IsT2Numeric, bool IsFirst, typename T1, typename T2>
-    struct DecodeInRecord2 {};
+    static std::unordered_set<uint64_t>& liveAllocators () {
+        static std::unordered_set<uint64_t> live;
+        return live;
+    }
 
-/** Case 1: T1 and T2 are numeric
- *  * record memory layout:
- *         |   T1  |   T2  |
- *         |
- *         |
- *     addr start here
+    const uint64_t uid_;
+    std::mutex arenas_mutex_;
+    std::vector<Arena*> arenas_;
+};  // end of class SlabRecordAllocator
+
+/** NUMA placement
+ *  @note: node helpers built on the mbind, move_pages and getcpu system calls, so that
+ *         no libnuma is needed. A placement is either a node id, kNumaDefault (the
+ *         policy of the calling thread) or kNumaInterleave (page by page over all nodes).
  */
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-    template <typename T1, typename T2>
-    struct Record2Size<true, true, T1, T2> {
-        static inline size_t Size (char* addr) { return sizeof (T1) + sizeof (T2); }
-    };
-#pragma GCC diagnostic pop
-    template <typename T1, typename T2>
-    struct Record2Format<true, true, T1, T2> {
-        static inline constexpr size_t Length (const T1& t1, const T2& t2) {
-            return sizeof (t1) + sizeof (t2);
-        }
-    };
-    template <typename T1, typename T2>
-    struct EncodeToRecord2<true, true, T1, T2> {
-        static inline void Encode (const T1& t1, const T2& t2, char* addr) {
-            *reinterpret_cast<T1*> (addr) = t1;
-            *reinterpret_cast<T2*> (addr + sizeof (T1)) = t2;
+static constexpr int kNumaDefault = -1;
+static constexpr int kNumaInterleave = -2;
+static constexpr int kMaxNumaNodes = 64;
+
+// number of online nodes, 1 when the system does not report them
+inline int NumaNodeCount () {
+    static const int node_count = [] () {
+        int count = 1;
+        FILE* online = fopen ("/sys/devices/system/node/online", "r");
+        if (online != nullptr) {
+            // a list like "0" or "0-1" or "0,2-3", the last id is the highest
+            char buf[256];
+            if (fgets (buf, sizeof (buf), online) != nullptr) {
+                const char* last = buf;
+                for (const char* c = buf; *c != '\0'; c++) {
+                    if (*c == '-' || *c == ',') last = c + 1;
+                }
+                count = atoi (last) + 1;
+            }
+            fclose (online);
         }
-    };
-    template <typename T1, typename T2>
-    struct DecodeInRecord2<true, true, true /* IsFirst */, T1, T2> {
-        static inline T1 Decode (char* addr) { return *reinterpret_cast<T1*> (addr); }
-    };
-    template <typename T1, typename T2>
-    struct DecodeInRecord2<true, true, false /* IsFirst*/, T1, T2> {
-        static inline T2 Decode (char* addr) { return *reinterpret_cast<T2*> (addr + sizeof (T1)); }
-    };
+        return std::max (1, std::min (count, kMaxNumaNodes));
+    }();
+    return node_count;
+}
 
-    /** Case 2: T1 is numeric, T2 is std::string
-     *  * record memory layout:
-     *         |   T1  |   len2  |   buffer2
-     *         |       |  size_t |
-     *         |                 |
-     *     addr start here     offset
-     */
-    template <typename T1, typename T2>
-    struct Record2Size<true, false, T1, T2> {
-        static inline size_t Size (char* addr) {
-            size_t len2 = *reinterpret_cast<size_t*> (addr + sizeof (T1));
-            return sizeof (T1) + sizeof (size_t) + len2;
+// node of the cpu the calling thread runs on
+inline int CurrentNumaNode () {
+    unsigned cpu = 0, node = 0;
+    if (syscall (SYS_getcpu, &cpu, &node, nullptr) != 0) {
+        return 0;
+    }
+    return node;
+}
+
+// node of the calling thread, looked up once. Threads that care pin themselves first.
+inline int ThreadNumaNode () {
+    static thread_local int node = CurrentNumaNode ();
+    return node;
+}
+
+// cpus of a node, empty when the system does not report them
+inline std::vector<int> NumaNodeCpus (int node) {
+    std::vector<int> cpus;
+    std::string path = "/sys/devices/system/node/node" + std::to_string (node) + "/cpulist";
+    FILE* cpulist = fopen (path.c_str (), "r");
+    if (cpulist == nullptr) {
+        return cpus;
+    }
+    char buf[1024];
+    if (fgets (buf, sizeof (buf), cpulist) != nullptr) {
+        std::stringstream ranges (buf);
+        std::string range;
+        while (std::getline (ranges, range, ',')) {
+            int first = 0, last = 0;
+            int n = sscanf (range.c_str (), "%d-%d", &first, &last);
+            if (n < 1) continue;
+            if (n == 1) last = first;
+            for (int cpu = first; cpu <= last; cpu++) cpus.push_back (cpu);
         }
-    };
-    template <typename T1, typename T2>
-    struct Record2Format<true, false, T1, T2> {
-        static inline size_t Length (const T1& t1, const T2& t2) {
-            return sizeof (t1) + sizeof (size_t) + t2.size ();
+    }
+    fclose (cpulist);
+    return cpus;
+}
+
+// run the calling thread on the cpus of a node only. Return false if it cannot.
+inline bool PinThreadToNumaNode (int node) {
+    std::vector<int> cpus = NumaNodeCpus (node);
+    if (cpus.empty ()) {
+        return false;
+    }
+    cpu_set_t cpu_set;
+    CPU_ZERO (&cpu_set);
+    for (int cpu : cpus) CPU_SET (cpu, &cpu_set);
+    return sched_setaffinity (0, sizeof (cpu_set), &cpu_set) == 0;
+}
+
+/** NumaPlace
+ *  @note: place the whole pages inside [addr, addr + size) on a node, or interleave them,
+ *         moving the pages already touched. Pages shared with other blocks are left alone.
+ *         Return false if the kernel refuses, e.g. the node is offline.
+ */
+inline bool NumaPlace (void* addr, size_t size, int placement) {
+    if (placement == kNumaDefault) {
+        return true;
+    }
+    const uintptr_t page_mask = sysconf (_SC_PAGESIZE) - 1;
+    uintptr_t begin = (reinterpret_cast<uintptr_t> (addr) + page_mask) & ~page_mask;
+    uintptr_t end = (reinterpret_cast<uintptr_t> (addr) + size) & ~page_mask;
+    if (begin >= end) {
+        return true;
+    }
+    int mode;
+    unsigned long node_mask;
+    if (placement == kNumaInterleave) {
+        mode = MPOL_INTERLEAVE;
+        node_mask = NumaNodeCount () == kMaxNumaNodes ? ~0LU : (1LU << NumaNodeCount ()) - 1;
+    } else {
+        assert (placement >= 0);
+        mode = MPOL_PREFERRED;
+        node_mask = 1LU << (placement % kMaxNumaNodes);
+    }
+    return syscall (SYS_mbind, begin, end - begin, mode, &node_mask, kMaxNumaNodes + 1,
+                    MPOL_MF_MOVE) == 0;
+}
+
+// node of the page holding addr, or -1 if it is not faulted in yet
+inline int NumaNodeOfAddress (const void* addr) {
+    void* page = const_cast<void*> (addr);
+    int status = -1;
+    if (syscall (SYS_move_pages, 0, 1, &page, nullptr, &status, 0) != 0 || status < 0) {
+        return -1;
+    }
+    return status;
+}
+
+/** AlignedCellAllocator
+ *  @note: allocate every cell array and directory with aligned_alloc. A placement is
+ *         applied to the whole pages of a block only, so small blocks stay where they are
+ *         first touched.
+ */
+class AlignedCellAllocator {
+public:
+    inline char* Allocate (size_t size, size_t alignment, int placement = kNumaDefault) {
+        char* addr = static_cast<char*> (aligned_alloc (alignment, size));
+        if (addr != nullptr && placement != kNumaDefault) {
+            NumaPlace (addr, size, placement);
         }
-    };
-    template <typename T1, typename T2>
-    struct EncodeToRecord2<true, false, T1, T2> {
-        static inline void Encode (const T1& t1, const T2& t2, char* addr) {
-            static constexpr size_t offset = sizeof (T1) + sizeof (size_t);
-            memcpy (addr, &t1, sizeof (T1));
-            *reinterpret_cast<size_t*> (addr + sizeof (T1)) = t2.size ();
-            if (t2.size () != 0) memcpy (addr + offset, t2.data (), t2.size ());
+        return addr;
+    }
+
+    inline void Release (char* addr) { free (addr); }
+
+    inline void ReleaseBatch (void* const* addrs, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            free (addrs[i]);
         }
-    };
-    template <typename T1, typename T2>
-    struct DecodeInRecord2<true, false, true /* IsFirst*/, T1, T2> {
-        static inline T1 Decode (char* addr) { return *reinterpret_cast<T1*> (addr); }
-    };
-    template <typename T1, typename T2>
-    struct DecodeInRecord2<true, false, false /* IsFirst*/, T1, T2> {
-        static inline util::Slice Decode (char* addr) {
-            size_t len2 = *reinterpret_cast<size_t*> (addr + sizeof (T1));
-            return util::Slice (addr + sizeof (T1) + sizeof (size_t), len2);
+    }
+};  // end of class AlignedCellAllocator
+
+/** HugePageCellAllocator
+ *  @note: carve cell arrays and directories out of regions backed by 2 MiB (or 1 GiB)
+ *         pages, so random probes over a large table hit far fewer dTLB entries. A region
+ *         is mapped with MAP_HUGETLB, or with a transparent huge page madvise when no huge
+ *         page is reserved. Sizes are rounded up to a power of two. Blocks smaller than a
+ *         page are bump allocated from regions of their size class, larger ones get a
+ *         region of their own. Released blocks go to a free list of their size class, so
+ *         a rehash reuses the arrays retired by earlier ones. Every NUMA placement has its
+ *         own regions. Regions are returned to the system when the allocator is destroyed.
+ */
+template <size_t kPageSize = 2LU << 20>
+class HugePageCellAllocator {
+    static_assert (kPageSize == (2LU << 20) || kPageSize == (1LU << 30),
+                   "huge pages are either 2 MiB or 1 GiB");
+
+public:
+    HugePageCellAllocator () = default;
+
+    HugePageCellAllocator (const HugePageCellAllocator&) = delete;
+    HugePageCellAllocator& operator= (const HugePageCellAllocator&) = delete;
+
+    ~HugePageCellAllocator () {
+        for (auto& mapping : mappings_) {
+            munmap (mapping.first, mapping.second);
         }
-    };
+    }
 
-    /** Case 3: T1 is std::string, T2 is numeric
-     *  * record memory layout:
-     *         |  len1  |   T2  |   buffer1
-     *         | size_t |       |
-     *         |
-     *     addr start here
-     */
-    template <typename T1, typename T2>
-    struct Record2Size<false, true, T1, T2> {
-        static inline size_t Size (char* addr) {
-            size_t len1 = *reinterpret_cast<size_t*> (addr);
-            return sizeof (size_t) + sizeof (T2) + len1;
+    char* Allocate (size_t size, size_t alignment, int placement = kNumaDefault) {
+        int size_class = sizeClass (size);
+        size_t class_size = 1LU << size_class;
+        // blocks are aligned to their size
+        assert (alignment <= class_size);
+        std::lock_guard<std::mutex> lock (mutex_);
+        Arena& arena = arenas_[placement];
+        FreeNode* node = arena.free_lists[size_class];
+        if (node != nullptr) {
+            arena.free_lists[size_class] = node->next;
+            return reinterpret_cast<char*> (node);
         }
-    };
-    template <typename T1, typename T2>
-    struct Record2Format<false, true, T1, T2> {
-        static inline size_t Length (const T1& t1, const T2& t2) {
-            return sizeof (size_t) + sizeof (t2) + t1.size ();
+        if (class_size >= kPageSize) {
+            char* region = mapRegion (class_size, placement);
+            if (region != nullptr) {
+                regions_[region] = {placement, size_class};
+            }
+            return region;
         }
-    };
-    template <typename T1, typename T2>
-    struct EncodeToRecord2<false, true, T1, T2> {
-        static inline void Encode (const T1& t1, const T2& t2, char* addr) {
-            static constexpr size_t offset = sizeof (size_t) + sizeof (T2);
-            *reinterpret_cast<size_t*> (addr) = t1.size ();
-            memcpy (addr + sizeof (size_t), &t2, sizeof (T2));
-            memcpy (addr + offset, t1.data (), t1.size ());
+        if (arena.bump[size_class] == arena.bump_end[size_class]) {
+            char* region = mapRegion (kPageSize, placement);
+            if (region == nullptr) {
+                return nullptr;
+            }
+            regions_[region] = {placement, size_class};
+            arena.bump[size_class] = region;
+            arena.bump_end[size_class] = region + kPageSize;
         }
-    };
-    template <typename T1, typename T2>
-    struct DecodeInRecord2<false, true, true /* IsFirst*/, T1, T2> {
-        static inline util::Slice Decode (char* addr) {
-            size_t len1 = *reinterpret_cast<size_t*> (addr);
-            return util::Slice (addr + sizeof (size_t) + sizeof (T2), len1);
+        char* addr = arena.bump[size_class];
+        arena.bump[size_class] += class_size;
+        return addr;
+    }
+
+    inline void Release (char* addr) { ReleaseBatch (reinterpret_cast<void* const*> (&addr), 1); }
+
+    void ReleaseBatch (void* const* addrs, size_t count) {
+        std::lock_guard<std::mutex> lock (mutex_);
+        for (size_t i = 0; i < count; i++) {
+            // a block is either in a region of its class or starts its own region
+            char* region = reinterpret_cast<char*> (reinterpret_cast<uintptr_t> (addrs[i]) &
+                                                    ~(kPageSize - 1));
+            auto found = regions_.find (region);
+            assert (found != regions_.end ());
+            const Region& info = found->second;
+            FreeNode*& free_list = arenas_[info.placement].free_lists[info.size_class];
+            FreeNode* node = reinterpret_cast<FreeNode*> (addrs[i]);
+            node->next = free_list;
+            free_list = node;
         }
+    }
+
+    // bytes mapped in total, and the part of them backed by reserved (MAP_HUGETLB) pages
+    size_t MappedBytes () {
+        std::lock_guard<std::mutex> lock (mutex_);
+        return mapped_bytes_;
+    }
+
+    size_t HugeTlbBytes () {
+        std::lock_guard<std::mutex> lock (mutex_);
+        return hugetlb_bytes_;
+    }
+
+private:
+    static constexpr int kMinClass = 6;  // 64 bytes
+    static constexpr int kClassCount = 48;
+
+    struct FreeNode {
+        FreeNode* next;
     };
-    template <typename T1, typename T2>
-    struct DecodeInRecord2<false, true, false /* IsFirst*/, T1, T2> {
-        static inline T2 Decode (char* addr) {
-            return *reinterpret_cast<T2*> (addr + sizeof (size_t));
-        }
+
+    // the blocks of one placement
+    struct Arena {
+        FreeNode* free_lists[kClassCount] = {};
+        char* bump[kClassCount] = {};
+        char* bump_end[kClassCount] = {};
     };
 
-    /** Case 4: T1 is std::string, T2 is std::string
-     *  * record memory layout:
-     *         |  len1  |  len2  | buffer1 | bufer2 |
-     *         |   u32  |  u32   |         |
-     *         |                 |
-     *     addr start here     offset
-     */
-    template <typename T1, typename T2>
-    struct Record2Size<false, false, T1, T2> {
-        static inline size_t Size (char* addr) {
-            uint32_t len1 = *reinterpret_cast<uint32_t*> (addr);
-            uint32_t len2 = *reinterpret_cast<uint32_t*> (addr + sizeof (uint32_t));
-            return sizeof (uint32_t) + sizeof (uint32_t) + len1 + len2;
-        }
+    struct Region {
+        int placement;
+        int size_class;
     };
-    template <typename T1, typename T2>
-    struct Record2Format<false, false, T1, T2> {
-        static inline size_t Length (const T1& t1, const T2& t2) {
-            return sizeof (uint32_t) + sizeof (uint32_t) + t1.size () + t2.size ();
+
+    static inline int sizeClass (size_t size) {
+        int size_class = size <= 1 ? 0 : 64 - __builtin_clzl (size - 1);
+        return std::max (size_class, kMinClass);
+    }
+
+    char* mapRegion (size_t size, int placement) {
+        int huge_flags = MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+        huge_flags |= __builtin_ctzl (kPageSize) << MAP_HUGE_SHIFT;
+#endif
+        void* addr = mmap (nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | huge_flags, -1, 0);
+        if (addr != MAP_FAILED) {
+            NumaPlace (addr, size, placement);
+            mappings_.push_back ({addr, size});
+            mapped_bytes_ += size;
+            hugetlb_bytes_ += size;
+            return static_cast<char*> (addr);
         }
-    };
-    template <typename T1, typename T2>
-    struct EncodeToRecord2<false, false, T1, T2> {
-        static inline void Encode (const T1& t1, const T2& t2, char* addr) {
-            static constexpr uint32_t offset = sizeof (uint32_t) + sizeof (uint32_t);
-            *reinterpret_cast<uint32_t*> (addr) = t1.size ();
-            *reinterpret_cast<uint32_t*> (addr + sizeof (uint32_t)) = t2.size ();
-            memcpy (addr + offset, t1.data (), t1.size ());
-            if (t2.size () != 0) memcpy (addr + offset + t1.size (), t2.data (), t2.size ());
+        // no reserved huge page left: map a page aligned range and ask for transparent
+        // huge pages
+        size_t len = size + kPageSize;
+        char* raw = static_cast<char*> (
+            mmap (nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            return nullptr;
         }
-    };
-    template <typename T1, typename T2>
-    struct DecodeInRecord2<false, false, true /* IsFirst*/, T1, T2> {
-        static inline util::Slice Decode (char* addr) {
-            uint32_t len1 = *reinterpret_cast<uint32_t*> (addr);
-            return util::Slice (addr + sizeof (uint32_t) + sizeof (uint32_t), len1);
+        char* aligned = reinterpret_cast<char*> (
+            (reinterpret_cast<uintptr_t> (raw) + kPageSize - 1) & ~(kPageSize - 1));
+        if (aligned != raw) {
+            munmap (raw, aligned - raw);
         }
-    };
-    template <typename T1, typename T2>
-    struct DecodeInRecord2<false, false, false /* IsFirst*/, T1, T2> {
-        static inline util::Slice Decode (char* addr) {
-            uint32_t len1 = *reinterpret_cast<uint32_t*> (addr);
-            uint32_t len2 = *reinterpret_cast<uint32_t*> (addr + sizeof (uint32_t));
-            return util::Slice (addr + sizeof (uint32_t) + sizeof (uint32_t) + len1, len2);
+        if (aligned + size != raw + len) {
+            munmap (aligned + size, raw + len - (aligned + size));
         }
-    };
+        madvise (aligned, size, MADV_HUGEPAGE);
+        NumaPlace (aligned, size, placement);
+        mappings_.push_back ({aligned, size});
+        mapped_bytes_ += size;
+        return aligned;
+    }
 
-    using H2Tag = uint8_t;
-    using H1Tag = typename std::conditional<is_key_flat, Key, uint64_t>::type;
-    using Entry = typename std::conditional<is_key_flat && is_value_flat, T, char*>::type;
+    std::mutex mutex_;
+    std::unordered_map<int, Arena> arenas_;  // by placement
+    std::unordered_map<char*, Region> regions_;
+    std::vector<std::pair<void*, size_t>> mappings_;
+    size_t mapped_bytes_ = 0;
+    size_t hugetlb_bytes_ = 0;
+};  // end of class HugePageCellAllocator
+
+/** ReservedCellAllocator
+ *  @note: reserve kReserveBytes of address space for every block, so a cell array can
+ *         grow in place up to that size, see Expand. The blocks are slices of ranges of
+ *         kGroupBlocks blocks, one mapping per range and NUMA placement, so a table of
+ *         many buckets stays far below vm.max_map_count. A range is mapped without a swap
+ *         reservation and its pages are committed when first touched, so it costs the
+ *         pages of the cells in use only. A released block gives its pages back and reads
+ *         as zero when it is handed out again. With this allocator MinorRehash doubles a
+ *         bucket within its own cell array, without a second array and a copy, as long as
+ *         it stays below kReserveBytes (32768 cells of 128 bytes by default). Blocks larger
+ *         than that, like the bucket directories, are mapped at their size.
+ *         Every block takes at least a page, so a table of many small buckets misses the
+ *         dTLB more often than with packed cell arrays.
+ */
+template <size_t kReserveBytes = 4LU << 20, size_t kGroupBlocks = 256>
+class ReservedCellAllocator {
+    static_assert (kReserveBytes % 4096 == 0, "reserve whole pages");
 
-    template <typename T1, bool flat_key>
-    struct H1Convert {};
+public:
+    ReservedCellAllocator () = default;
+
+    ReservedCellAllocator (const ReservedCellAllocator&) = delete;
+    ReservedCellAllocator& operator= (const ReservedCellAllocator&) = delete;
+
+    ~ReservedCellAllocator () {
+        for (char* range : ranges_) {
+            munmap (range, kReserveBytes * kGroupBlocks);
+        }
+    }
+
+    char* Allocate (size_t size, size_t alignment, int placement = kNumaDefault) {
+        // blocks are page aligned
+        assert (alignment <= 4096);
+        if (size > kReserveBytes) {
+            size_t len = (size + 4095) & ~4095LU;
+            char* addr = mapRange (len, placement);
+            if (addr == nullptr) {
+                return nullptr;
+            }
+            std::lock_guard<std::mutex> lock (mutex_);
+            blocks_[addr] = len;
+            return addr;
+        }
+        std::lock_guard<std::mutex> lock (mutex_);
+        std::vector<char*>& free_blocks = free_blocks_[placement];
+        if (free_blocks.empty ()) {
+            char* range = mapRange (kReserveBytes * kGroupBlocks, placement);
+            if (range == nullptr) {
+                return nullptr;
+            }
+            ranges_.push_back (range);
+            for (size_t i = kGroupBlocks; i-- > 0;) {
+                free_blocks.push_back (range + i * kReserveBytes);
+            }
+        }
+        char* addr = free_blocks.back ();
+        free_blocks.pop_back ();
+        slices_[addr] = placement;
+        return addr;
+    }
+
+    // grow the block at addr to size bytes in place. The new part reads as zero.
+    inline bool Expand (char* addr, size_t size) { return size <= kReserveBytes; }
+
+    inline void Release (char* addr) { ReleaseBatch (reinterpret_cast<void* const*> (&addr), 1); }
+
+    void ReleaseBatch (void* const* addrs, size_t count) {
+        std::lock_guard<std::mutex> lock (mutex_);
+        for (size_t i = 0; i < count; i++) {
+            char* addr = static_cast<char*> (addrs[i]);
+            auto slice = slices_.find (addr);
+            if (slice != slices_.end ()) {
+                // the range stays mapped, the pages of the block are dropped
+                madvise (addr, kReserveBytes, MADV_DONTNEED);
+                free_blocks_[slice->second].push_back (addr);
+                slices_.erase (slice);
+                continue;
+            }
+            auto block = blocks_.find (addr);
+            assert (block != blocks_.end ());
+            munmap (block->first, block->second);
+            blocks_.erase (block);
+        }
+    }
+
+    // mappings held, the ranges of the blocks and the blocks larger than kReserveBytes
+    size_t MappingCount () {
+        std::lock_guard<std::mutex> lock (mutex_);
+        return ranges_.size () + blocks_.size ();
+    }
+
+private:
+    static char* mapRange (size_t len, int placement) {
+        void* addr = mmap (nullptr, len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+        if (placement != kNumaDefault) {
+            NumaPlace (addr, len, placement);
+        }
+        return static_cast<char*> (addr);
+    }
+
+    std::mutex mutex_;
+    std::vector<char*> ranges_;                                // the blocks are sliced from
+    std::unordered_map<int, std::vector<char*>> free_blocks_;  // by placement
+    std::unordered_map<char*, int> slices_;     // placement of every block in use of a range
+    std::unordered_map<char*, size_t> blocks_;  // length of every block mapped on its own
+};  // end of class ReservedCellAllocator
+
+/** CanExpandInPlace
+ *  @note: whether a cell allocator grows its blocks in place through
+ *         Expand (addr, size), like ReservedCellAllocator.
+ */
+template <typename Allocator, typename = void>
+struct CanExpandInPlace : std::false_type {};
+
+template <typename Allocator>
+struct CanExpandInPlace<Allocator, std::void_t<decltype (std::declval<Allocator&> ().Expand (
+                                       std::declval<char*> (), size_t ()))>> : std::true_type {};
+
+};  // namespace util
+
+// A thin wrapper around std::hash, performing an additional simple mixing step
+// of the result. from https://github.com/martinus/robin-hood-hashing
+template <typename T>
+struct hash : public std::hash<T> {
+    size_t operator() (T const& obj) const
+        noexcept (noexcept (std::declval<std::hash<T>> ().operator() (std::declval<T const&> ()))) {
+        // call base hash
+        auto result = std::hash<T>::operator() (obj);
+        // return mixed of that, to be save against identity has
+        return util::Hasher::hash_int (static_cast<uint64_t> (result));
+    }
+};
+template <>
+struct hash<std::string> {
+    size_t operator() (std::string const& str) const noexcept {
+        return util::Hasher::hash (str.data (), str.size ());
+    }
+};
+template <class T>
+struct hash<T*> {
+    size_t operator() (T* ptr) const noexcept {
+        return util::Hasher::hash_int (reinterpret_cast<size_t> (ptr));
+    }
+};
+#define TURBO_HASH_INT(T)                                                \
+    template <>                                                          \
+    struct hash<T> {                                                     \
+        size_t operator() (T obj) const noexcept {                       \
+            return util::Hasher::hash_int (static_cast<uint64_t> (obj)); \
+        }                                                                \
+    }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuseless-cast"
+#endif
+// see https://en.cppreference.com/w/cpp/utility/hash
+TURBO_HASH_INT (bool);
+TURBO_HASH_INT (char);
+TURBO_HASH_INT (signed char);
+TURBO_HASH_INT (unsigned char);
+TURBO_HASH_INT (char16_t);
+TURBO_HASH_INT (char32_t);
+TURBO_HASH_INT (wchar_t);
+TURBO_HASH_INT (short);
+TURBO_HASH_INT (unsigned short);
+TURBO_HASH_INT (int);
+TURBO_HASH_INT (unsigned int);
+TURBO_HASH_INT (long);
+TURBO_HASH_INT (long long);
+TURBO_HASH_INT (unsigned long);
+TURBO_HASH_INT (unsigned long long);
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+// dummy hash, unsed as mixer when turbo::hash is already used
+template <typename T>
+struct identity_hash {
+    constexpr size_t operator() (T const& obj) const noexcept { return static_cast<size_t> (obj); }
+};
+
+/** MaintenanceOptions
+ *  @note: settings of the background maintenance threads of a hash table.
+ *         A bucket whose used slots (live and deleted) exceed grow_load_factor of its
+ *         capacity is rehashed to twice its cells. A bucket whose deleted slots exceed
+ *         gc_deleted_ratio of its capacity is compacted in place. A bucket whose live
+ *         slots would fill less than shrink_load_factor of half its capacity is halved.
+ */
+struct MaintenanceOptions {
+    int threads = 1;                // background threads, each scans 1 / threads of the buckets
+    double grow_load_factor = 0.85;
+    double gc_deleted_ratio = 0.2;
+    double shrink_load_factor = 0;  // halve buckets whose live slots stay below this, 0: never
+    uint32_t interval_ms = 100;     // pause between two scans of all the buckets
+    size_t expire_per_scan = 4096;  // expired records a thread drops per scan at most, 0: none
+};
+
+/** NumaPolicy
+ *  @note: placement of a hash table on a multi-socket host.
+ *         kInterleave spreads the cell arrays and the directory page by page over the nodes.
+ *         kPartition places the cells of bucket bi on node bi % node_count. NodeOfKey tells
+ *         the node of a key, so that keys can be routed to threads running on that node.
+ *         kReplicate keeps a read-only copy of the bucket directory on every node. Lookups
+ *         read the copy of their thread's node, every rehash updates all the copies.
+ *  Cells are placed page by page, so small cell arrays need a cell allocator that carves
+ *  them out of per-node regions, like util::HugePageCellAllocator.
+ */
+enum class NumaPolicy { kNone, kInterleave, kPartition, kReplicate };
+
+struct NumaOptions {
+    NumaPolicy policy = NumaPolicy::kNone;
+    int node_count = 0;  // nodes to place on, 0: all the online nodes
+};
+
+/** MaintenanceStats
+ *  @note: work done by the background maintenance threads since they started.
+ */
+struct MaintenanceStats {
+    size_t scans = 0;      // full passes over the buckets
+    size_t grown = 0;      // buckets rehashed to twice their cells
+    size_t compacted = 0;  // buckets rehashed to drop the deleted slots
+    size_t shrunk = 0;     // buckets rehashed to fewer cells
+    size_t migrated = 0;   // incremental rehashes finished
+    size_t doubled = 0;    // directory doublings requested
+    size_t expired = 0;    // expired records dropped
+};
+
+/** LockStats
+ *  @note: contention on the write locks since the hash table was created. The counters
+ *         are kept per thread like those of TableStats, and only in builds with
+ *         TURBO_HASH_STATS. Otherwise they stay 0.
+ */
+struct LockStats {
+    size_t bucket_locks = 0;      // bucket lock acquisitions
+    size_t bucket_contended = 0;  // of them, the ones that found the lock taken
+    size_t bucket_waits = 0;      // rounds waited for bucket locks, see the BucketLock policy
+    size_t cell_contended = 0;    // cell locks of single key writes found taken
+};
+
+/** TableStats
+ *  @note: a snapshot of a hash table, see GetTableStats. The counters of the finds, inserts,
+ *         deletes and rehashes are kept per thread, and only in builds with
+ *         TURBO_HASH_STATS. Otherwise they stay 0. The rest is read when the snapshot is
+ *         taken.
+ */
+static constexpr int kProbeHistogramSize = kTurboMaxProbeLen + 1;
+struct TableStats {
+    // [i]: operations that probed i cells, the last entry also counts the longer ones
+    std::array<size_t, kProbeHistogramSize> find_probes{};
+    std::array<size_t, kProbeHistogramSize> insert_probes{};  // up to the cell written
+    std::array<size_t, kProbeHistogramSize> delete_probes{};
+    size_t find_retries = 0;       // lookups read again as a write raced with them
+    size_t rehashes = 0;           // buckets grown or compacted by MinorRehash
+    size_t rehash_nanos = 0;       // time spent in them
+    size_t rehash_bytes = 0;       // bytes of the slots they moved
+    size_t bucket_lock_waits = 0;  // rounds waited for bucket locks, see LockStats
+    size_t garbage_pending = 0;    // cell arrays and records retired, not freed yet
+    size_t garbage_pending_bytes = 0;  // bytes of the cell arrays among them
+    std::vector<size_t> bucket_cells;  // [i]: buckets of 2^i cells
+};
+
+/** Cell layouts
+ *  @note: select the cell format of a hash table through its CellLayout parameter.
+ *         Wider cells hold more slots, so a lookup probes fewer cells at a high load
+ *         factor, but each probe touches more bytes.
+ */
+struct Cell128 {};   // 128-byte cell, 7 slots, 8-byte hash tag (default)
+struct Cell256 {};   // 256-byte cell, 14 slots, 16-byte hash tag
+struct Cell1024 {};  // 1 KiB cell, 58 slots, 64-byte hash tag
+
+namespace detail {
+
+// using wrapper classes for hash and key_equal prevents the diamond problem
+// when the same type is used. see https://stackoverflow.com/a/28771920/48181
+// from robinhood hash. https://github.com/martinus/robin-hood-hashing
+template <typename T>
+struct WrapHash : public T {
+    WrapHash () = default;
+    explicit WrapHash (T const& o) noexcept (noexcept (T (std::declval<T const&> ()))) : T (o) {}
+};
+template <typename T>
+struct WrapKeyEqual : public T {
+    WrapKeyEqual () = default;
+    explicit WrapKeyEqual (T const& o) noexcept (noexcept (T (std::declval<T const&> ())))
+        : T (o) {}
+};
+
+/** TurboHashTable
+ *  @format:
+ *           | bucket 0 | bucket 1 | ... | bucket n |
+ *           |  cell 0  |  cell 0  |     |          |
+ *           |  cell 1  |  cell 1  |     |          |
+ *           |  cell 2  |  cell 2  |     |          |
+ *           |    ...   |    ...   |     |          |
+ *
+ */
+template <typename Key, typename T, typename Hash, typename KeyEqual, int kCellCountLimit = 32768,
+          typename SizeCounter = util::StripedCounter<64>,
+          typename RecordAllocator = util::MallocRecordAllocator, typename CellLayout = Cell128,
+          typename CellAllocator = util::AlignedCellAllocator,
+          typename BucketLock = util::SpinBitLock>
+class TurboHashTable : public WrapHash<Hash>, public WrapKeyEqual<KeyEqual> {
+public:
+    static constexpr bool is_key_flat = std::is_same<Key, std::string>::value == false;
+    static constexpr bool is_value_flat = std::is_same<T, std::string>::value == false;
+
+    using key_type = Key;
+    using mapped_type = T;
+    using size_type = size_t;
+    using hasher = Hash;
+
+    // private:
+
+    /**
+     *  @note: obtain the Record Lenght
+     */
+    template <bool IsT1Numeric, typename T1>
+    struct Record1Size {};
+
+    /**
+     *  @note: calcuate the Record Lenght
+     */
+    template <bool IsT1Numeric, typename T1>
+    struct Record1Format {};
+
+    /**
+     *  @note: encode T1 to memory
+     *  ! allocate memory space in advance
+     */
+    template <bool IsT1Numeric, typename T1>
+    struct EncodeToRecord1 {};
+
+    /** DecodeInRecord1
+     *  @note: decode T1
+     */
+    template <bool IsT1Numeric, typename T1>
+    struct DecodeInRecord1 {};
+
+/** Case 1: T1 is numeric
+ *  * record memory layout:
+ *         |   T1  |
+ *         |
+ *         |
+ *     addr start here
+ */
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
     template <typename T1>
-    struct H1Convert<T1, false> {
-        inline T1 operator() (const Key& key, uint64_t hash) { return hash; }
-    };
-    template <typename T1>
-    struct H1Convert<T1, true> {
-        inline T1 operator() (const Key& key, uint64_t hash) { return key; }
+    struct Record1Size<true, T1> {
+        static inline size_t Size (char* addr) { return sizeof (T1); }
     };
 #pragma GCC diagnostic pop
 
-    /** PartialHash
-     *  @note: a 64-bit hash is used to locate the cell location, and provide
-     * hash-tag.
-     *  @format:
-     *  | MSB    - - - - - - - - - - - - - - - - - - LSB |
-     *  |     32 bit     |   16 bit  |  8 bit  |  8 bit  |
-     *  |    bucket_hash |    H2     |                   |
-     *  |                     H1                         |
-     *  ! if Key is numeric, H1 store the key itself
-     */
-    struct PartialHash {
-        PartialHash (const Key& key, uint64_t hash)
-            : H1_ (H1Convert<H1Tag, is_key_flat>{}(key, hash)),
-              H2_ ((hash >> 16) & 0xFFFF),
-              bucket_hash_ (hash >> 32){};
-        H1Tag H1_;              // H1:
-        H2Tag H2_;              // H2: 2 byte hash tag
-        uint32_t bucket_hash_;  // used to locate in the bucket directory
-    };                          // end of class PartialHash
+    template <typename T1>
+    struct Record1Format<true, T1> {
+        static inline constexpr size_t Length (const T1& t1) { return sizeof (t1); }
+    };
+    template <typename T1>
+    struct EncodeToRecord1<true, T1> {
+        static inline void Encode (const T1& t1, char* addr) { *reinterpret_cast<T1*> (addr) = t1; }
+    };
+    template <typename T1>
+    struct DecodeInRecord1<true, T1> {
+        static inline T1 Decode (char* addr) { return *reinterpret_cast<T1*> (addr); }
+    };
 
-    /** HashSlot
-     *  @node:
+    /** Case 2: T1 is std::string
+     *  * record memory layout:
+     *         |  len1  | buffer1
+     *         | size_t |
+     *         |
+     *     addr start here
      */
-    struct HashSlot {
-        union {
-            struct {
-                H1Tag H1;
-                Entry entry;
-            };
-            uint64_t _[2];
-        };
+    template <typename T1>
+    struct Record1Size<false, T1> {
+        static inline size_t Size (char* addr) {
+            size_t len1 = *reinterpret_cast<size_t*> (addr);
+            return sizeof (size_t) + len1;
+        }
     };
+    template <typename T1>
+    struct Record1Format<false, T1> {
+        static inline size_t Length (const T1& t1) { return sizeof (size_t) + t1.size (); }
+    };
+    template <typename T1>
+    struct EncodeToRecord1<false, T1> {
+        static inline void Encode (const T1& t1, char* addr) {
+            *reinterpret_cast<size_t*> (addr) = t1.size ();
+            memcpy (addr + sizeof (size_t), t1.data (), t1.size ());
+        }
+    };
+    // When T1 is std::string, 'Decode' return util::Slice, which is the reference
+    // of real value.
+    template <typename T1>
+    struct DecodeInRecord1<false, T1> {
+        static inline util::Slice Decode (char* addr) {
+            size_t len1 = *reinterpret_cast<size_t*> (addr);
+            return util::Slice (addr + sizeof (size_t), len1);
+        }
+    };
+
+    /**
+     *  @note: obtain the Record Lenght
+     */
+    template <bool IsT1Numeric, bool IsT2Numeric, typename T1, typename T2>
+    struct Record2Size {};
+
+    /**
+     *  @note: calculate the Record Lenght
+     */
+    template <bool IsT1Numeric, bool IsT2Numeric, typename T1, typename T2>
+    struct Record2Format {};
+
+    /** EncodeToRecord2
+     *  @note: encode T1 and T2 to addr.
+     *  ! The memory space should be allocated in advance
+     */
+    template <bool IsT1Numeric, bool IsT2Numeric, typename T1, typename T2>
+    struct EncodeToRecord2 {};
+
+    /** DecodeInRecord2
+     *  @note: decode T1 and T2
+     */
+    template <bool IsT1Numeric, bool IsT2Numeric, bool IsFirst, typename T1, typename T2>
+    struct DecodeInRecord2 {};
+
+/** Case 1: T1 and T2 are numeric
+ *  * record memory layout:
+ *         |   T1  |   T2  |
+ *         |
+ *         |
+ *     addr start here
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+    template <typename T1, typename T2>
+    struct Record2Size<true, true, T1, T2> {
+        static inline size_t Size (char* addr) { return sizeof (T1) + sizeof (T2); }
+    };
+#pragma GCC diagnostic pop
+    template <typename T1, typename T2>
+    struct Record2Format<true, true, T1, T2> {
+        static inline constexpr size_t Length (const T1& t1, const T2& t2) {
+            return sizeof (t1) + sizeof (t2);
+        }
+    };
+    template <typename T1, typename T2>
+    struct EncodeToRecord2<true, true, T1, T2> {
+        static inline void Encode (const T1& t1, const T2& t2, char* addr) {
+            *reinterpret_cast<T1*> (addr) = t1;
+            *reinterpret_cast<T2*> (addr + sizeof (T1)) = t2;
+        }
+    };
+    template <typename T1, typename T2>
+    struct DecodeInRecord2<true, true, true /* IsFirst */, T1, T2> {
+        static inline T1 Decode (char* addr) { return *reinterpret_cast<T1*> (addr); }
+    };
+    template <typename T1, typename T2>
+    struct DecodeInRecord2<true, true, false /* IsFirst*/, T1, T2> {
+        static inline T2 Decode (char* addr) { return *reinterpret_cast<T2*> (addr + sizeof (T1)); }
+    };
+
+    /** Case 2: T1 is numeric, T2 is std::string
+     *  * record memory layout:
+     *         |   T1  |   len2  |   buffer2
+     *         |       |  size_t |
+     *         |                 |
+     *     addr start here     offset
+     */
+    template <typename T1, typename T2>
+    struct Record2Size<true, false, T1, T2> {
+        static inline size_t Size (char* addr) {
+            size_t len2 = *reinterpret_cast<size_t*> (addr + sizeof (T1));
+            return sizeof (T1) + sizeof (size_t) + len2;
+        }
+    };
+    template <typename T1, typename T2>
+    struct Record2Format<true, false, T1, T2> {
+        static inline size_t Length (const T1& t1, const T2& t2) {
+            return sizeof (t1) + sizeof (size_t) + t2.size ();
+        }
+    };
+    template <typename T1, typename T2>
+    struct EncodeToRecord2<true, false, T1, T2> {
+        static inline void Encode (const T1& t1, const T2& t2, char* addr) {
+            static constexpr size_t offset = sizeof (T1) + sizeof (size_t);
+            memcpy (addr, &t1, sizeof (T1));
+            *reinterpret_cast<size_t*> (addr + sizeof (T1)) = t2.size ();
+            if (t2.size () != 0) memcpy (addr + offset, t2.data (), t2.size ());
+        }
+    };
+    template <typename T1, typename T2>
+    struct DecodeInRecord2<true, false, true /* IsFirst*/, T1, T2> {
+        static inline T1 Decode (char* addr) { return *reinterpret_cast<T1*> (addr); }
+    };
+    template <typename T1, typename T2>
+    struct DecodeInRecord2<true, false, false /* IsFirst*/, T1, T2> {
+        static inline util::Slice Decode (char* addr) {
+            size_t len2 = *reinterpret_cast<size_t*> (addr + sizeof (T1));
+            return util::Slice (addr + sizeof (T1) + sizeof (size_t), len2);
+        }
+    };
+
+    /** Case 3: T1 is std::string, T2 is numeric
+     *  * record memory layout:
+     *         |  len1  |   T2  |   buffer1
+     *         | size_t |       |
+     *         |
+     *     addr start here
+     */
+    template <typename T1, typename T2>
+    struct Record2Size<false, true, T1, T2> {
+        static inline size_t Size (char* addr) {
+            size_t len1 = *reinterpret_cast<size_t*> (addr);
+            return sizeof (size_t) + sizeof (T2) + len1;
+        }
+    };
+    template <typename T1, typename T2>
+    struct Record2Format<false, true, T1, T2> {
+        static inline size_t Length (const T1& t1, const T2& t2) {
+            return sizeof (size_t) + sizeof (t2) + t1.size ();
+        }
+    };
+    template <typename T1, typename T2>
+    struct EncodeToRecord2<false, true, T1, T2> {
+        static inline void Encode (const T1& t1, const T2& t2, char* addr) {
+            static constexpr size_t offset = sizeof (size_t) + sizeof (T2);
+            *reinterpret_cast<size_t*> (addr) = t1.size ();
+            memcpy (addr + sizeof (size_t), &t2, sizeof (T2));
+            memcpy (addr + offset, t1.data (), t1.size ());
+        }
+    };
+    template <typename T1, typename T2>
+    struct DecodeInRecord2<false, true, true /* IsFirst*/, T1, T2> {
+        static inline util::Slice Decode (char* addr) {
+            size_t len1 = *reinterpret_cast<size_t*> (addr);
+            return util::Slice (addr + sizeof (size_t) + sizeof (T2), len1);
+        }
+    };
+    template <typename T1, typename T2>
+    struct DecodeInRecord2<false, true, false /* IsFirst*/, T1, T2> {
+        static inline T2 Decode (char* addr) {
+            return *reinterpret_cast<T2*> (addr + sizeof (size_t));
+        }
+    };
+
+    /** Case 4: T1 is std::string, T2 is std::string
+     *  * record memory layout:
+     *         |  len1  |  len2  | buffer1 | bufer2 |
+     *         |   u32  |  u32   |         |
+     *         |                 |
+     *     addr start here     offset
+     */
+    template <typename T1, typename T2>
+    struct Record2Size<false, false, T1, T2> {
+        static inline size_t Size (char* addr) {
+            uint32_t len1 = *reinterpret_cast<uint32_t*> (addr);
+            uint32_t len2 = *reinterpret_cast<uint32_t*> (addr + sizeof (uint32_t));
+            return sizeof (uint32_t) + sizeof (uint32_t) + len1 + len2;
+        }
+    };
+    template <typename T1, typename T2>
+    struct Record2Format<false, false, T1, T2> {
+        static inline size_t Length (const T1& t1, const T2& t2) {
+            return sizeof (uint32_t) + sizeof (uint32_t) + t1.size () + t2.size ();
+        }
+    };
+    template <typename T1, typename T2>
+    struct EncodeToRecord2<false, false, T1, T2> {
+        static inline void Encode (const T1& t1, const T2& t2, char* addr) {
+            static constexpr uint32_t offset = sizeof (uint32_t) + sizeof (uint32_t);
+            *reinterpret_cast<uint32_t*> (addr) = t1.size ();
+            *reinterpret_cast<uint32_t*> (addr + sizeof (uint32_t)) = t2.size ();
+            memcpy (addr + offset, t1.data (), t1.size ());
+            if (t2.size () != 0) memcpy (addr + offset + t1.size (), t2.data (), t2.size ());
+        }
+    };
+    template <typename T1, typename T2>
+    struct DecodeInRecord2<false, false, true /* IsFirst*/, T1, T2> {
+        static inline util::Slice Decode (char* addr) {
+            uint32_t len1 = *reinterpret_cast<uint32_t*> (addr);
+            return util::Slice (addr + sizeof (uint32_t) + sizeof (uint32_t), len1);
+        }
+    };
+    template <typename T1, typename T2>
+    struct DecodeInRecord2<false, false, false /* IsFirst*/, T1, T2> {
+        static inline util::Slice Decode (char* addr) {
+            uint32_t len1 = *reinterpret_cast<uint32_t*> (addr);
+            uint32_t len2 = *reinterpret_cast<uint32_t*> (addr + sizeof (uint32_t));
+            return util::Slice (addr + sizeof (uint32_t) + sizeof (uint32_t) + len1, len2);
+        }
+    };
+
+    /** InlineEntry
+     *  @note: a record of at most 7 bytes is kept in the slot's 8-byte entry word instead of
+     *         the heap (small string optimization). Heap addresses never set the MSB, so the
+     *         MSB tells an inline entry from a pointer. Numeric fields store their raw bytes.
+     *  @format:
+     *  | MSB - - - - - - - - - - - - - - - - - - - - - - - - LSB |
+     *  |  1  |  1 bit  | 3 bit | 3 bit |      56 bit              |
+     *  | tag |    0    | len2  | len1  | buffer1 | buffer2 | 0..  |
+     */
+    struct InlineEntry {
+        static constexpr size_t kCapacity = 7;
+        static constexpr uint64_t kInlineBit = 1LU << 63;
+
+        static inline bool Fits (size_t len1, size_t len2) {
+            // written so that len1 + len2 cannot wrap around
+            return len1 <= kCapacity && len2 <= kCapacity - len1;
+        }
+
+        static inline bool IsInline (const char* entry) {
+            return (reinterpret_cast<uint64_t> (entry) & kInlineBit) != 0;
+        }
+
+        static inline char* Encode (const void* buf1, size_t len1, const void* buf2,
+                                    size_t len2) {
+            uint64_t word = 0;
+            if (len1 != 0) memcpy (&word, buf1, len1);
+            if (len2 != 0) memcpy (reinterpret_cast<char*> (&word) + len1, buf2, len2);
+            word |= kInlineBit | (static_cast<uint64_t> ((len2 << 3) | len1) << 56);
+            return reinterpret_cast<char*> (word);
+        }
+
+        static inline size_t Len1 (const char* entry) {
+            return (reinterpret_cast<uint64_t> (entry) >> 56) & 0x7;
+        }
+
+        static inline size_t Len2 (const char* entry) {
+            return (reinterpret_cast<uint64_t> (entry) >> 59) & 0x7;
+        }
+
+        // the buffers start at the entry word itself (little endian)
+        static inline const char* Buffer (char* const& entry) {
+            return reinterpret_cast<const char*> (&entry);
+        }
+
+        static inline util::Slice First (char* const& entry) {
+            return util::Slice (Buffer (entry), Len1 (entry));
+        }
+
+        static inline util::Slice Second (char* const& entry) {
+            return util::Slice (Buffer (entry) + Len1 (entry), Len2 (entry));
+        }
+
+        template <typename N>
+        static inline N SecondNumeric (char* const& entry) {
+            N n;
+            memcpy (&n, Buffer (entry) + Len1 (entry), sizeof (N));
+            return n;
+        }
+    };
+
+    /** ExpiringEntry
+     *  @note: a record written by PutWithTTL is always kept on the heap, behind an 8-byte
+     *         header holding its deadline on the NowNanos clock. Its entry points to the
+     *         record itself with bit 62 set, so the records without a deadline, and their
+     *         lookups, stay as they are.
+     *  @format:
+     *  | deadline | record ... |
+     *  | uint64_t | ^ entry (tagged)
+     */
+    struct ExpiringEntry {
+        static constexpr size_t kHeaderSize = sizeof (uint64_t);
+        static constexpr uint64_t kExpiryBit = 1LU << 62;
+
+        static inline bool Has (const char* entry) {
+            uint64_t word = reinterpret_cast<uint64_t> (entry);
+            return (word & (InlineEntry::kInlineBit | kExpiryBit)) == kExpiryBit;
+        }
+
+        static inline char* Encode (char* block) {
+            return reinterpret_cast<char*> (reinterpret_cast<uint64_t> (block + kHeaderSize) |
+                                            kExpiryBit);
+        }
+
+        // the encoded record of a heap entry, with or without a deadline
+        static inline char* Record (char* entry) {
+            return reinterpret_cast<char*> (reinterpret_cast<uint64_t> (entry) & ~kExpiryBit);
+        }
+
+        // the address the record allocator returned for a heap entry
+        static inline char* Block (char* entry) {
+            return Has (entry) ? Record (entry) - kHeaderSize : entry;
+        }
+
+        static inline uint64_t Deadline (char* entry) {
+            uint64_t deadline;
+            memcpy (&deadline, Record (entry) - kHeaderSize, sizeof (deadline));
+            return deadline;
+        }
+
+        static inline bool Expired (char* entry, uint64_t now) {
+            return Has (entry) && Deadline (entry) <= now;
+        }
+
+        template <bool key_flat, bool value_flat>
+        static inline char* Store (const Key& key, const T& value, uint64_t deadline,
+                                   RecordAllocator& allocator) {
+            size_t buf_len = Record2Format<key_flat, value_flat, Key, T>::Length (key, value);
+            char* block = (char*)allocator.Allocate (kHeaderSize + buf_len);
+            memcpy (block, &deadline, sizeof (deadline));
+            EncodeToRecord2<key_flat, value_flat, Key, T>::Encode (key, value,
+                                                                   block + kHeaderSize);
+            return Encode (block);
+        }
+    };
+
+    using H2Tag = uint8_t;
+    using H1Tag = typename std::conditional<is_key_flat, Key, uint64_t>::type;
+    using Entry = typename std::conditional<is_key_flat && is_value_flat, T, char*>::type;
+
+    template <typename T1, bool flat_key>
+    struct H1Convert {};
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+    template <typename T1>
+    struct H1Convert<T1, false> {
+        inline T1 operator() (const Key& key, uint64_t hash) { return hash; }
+    };
+    template <typename T1>
+    struct H1Convert<T1, true> {
+        inline T1 operator() (const Key& key, uint64_t hash) { return key; }
+    };
+#pragma GCC diagnostic pop
+
+    /** PartialHash
+     *  @note: a 64-bit hash is used to locate the cell location, and provide
+     * hash-tag.
+     *  @format:
+     *  | MSB    - - - - - - - - - - - - - - - - - - LSB |
+     *  |     32 bit     |   16 bit  |  8 bit  |  8 bit  |
+     *  |    bucket_hash |    H2     |                   |
+     *  |                     H1                         |
+     *  ! if Key is numeric, H1 store the key itself
+     */
+    struct PartialHash {
+        PartialHash (const Key& key, uint64_t hash)
+            : H1_ (H1Convert<H1Tag, is_key_flat>{}(key, hash)),
+              H2_ ((hash >> 16) & 0xFFFF),
+              bucket_hash_ (hash >> 32){};
+        H1Tag H1_;              // H1:
+        H2Tag H2_;              // H2: 2 byte hash tag
+        uint32_t bucket_hash_;  // used to locate in the bucket directory
+    };                          // end of class PartialHash
+
+    /** HashSlot
+     *  @node:
+     */
+    struct HashSlot {
+        union {
+            struct {
+                H1Tag H1;
+                Entry entry;
+            };
+            uint64_t _[2];
+        };
+    };
+
+    template <typename T1, bool key_flat, bool value_flat>
+    struct SlotRecord : public HashSlot {};
+
+    using SlotType = SlotRecord<Key, is_key_flat, is_value_flat>;
+
+    /** CellMeta256V2
+     *  @note: Hash cell whose size is 256 byte. There are 14 slots in the cell.
+     *  @format:
+     *  | ------------------- 32 Byte meta --------------------| ----- Slots ----- |
+     *  |    4 Bytes   |     4 Bytes     | 8 Bytes  | 16 Bytes |   16 Bytes * 14   |
+     *  |  Bitmap Zone | Sequence Number | Refs     | Hash Tag |
+     *
+     *  |- Bitmap Zone:
+     *      2  - 15 bit: indicate which slot is valid or not
+     *      18 - 31 bit: delete_bitmap. 1: deleted
+     *
+     *  |- Sequence Number: increase for each write
+     *
+     *  |- Refs: 2 - 15 bit, reference bits of the cache mode
+     *
+     *  |- Hash Tag
+     *      One byte tag (H2) for the slot
+     *
+     *  |- Slots:
+     *      0  -  7 byte: H1 tag or real key for flat_key
+     *      8  - 15 byte: pointer to data or read value for flat_value
+     */
+    class CellMeta256V2 {
+    public:
+        static constexpr uint16_t BitMapMask = 0xFFFC;
+        static constexpr int CellSizeLeftShift = 8;
+        static constexpr int SlotSizeLeftShift = 4;
+        static constexpr int kDeleteBitmapOffset = 16;
+
+        struct Version {
+            explicit Version (uint64_t data) : data_ (data) {}
+            explicit Version (uint16_t b, uint16_t bd, uint32_t seq)
+                : bitmap_ (b), bitmap_deleted_ (bd), seq_no_ (seq) {}
+
+            Version (const Version& v) { this->data_ = v.data_; }
+            union {
+                struct {
+                    uint16_t bitmap_;
+                    uint16_t bitmap_deleted_;
+                    uint32_t seq_no_;
+                };
+                uint64_t data_;
+            };
+
+            inline bool IsPosValid (int i) { return (bitmap_ & ~bitmap_deleted_ & (1 << i)) != 0; }
+
+            bool operator== (const Version& v1) { return data_ == v1.data_; }
+            bool operator!= (const Version& v1) { return data_ != v1.data_; }
+        };
+
+        explicit CellMeta256V2 (char* rep)
+            // the hash tags are matched by the runtime selected kernel
+            : meta_ (rep + 16), ver_ (LoadVersion (rep)) {}
+
+        ~CellMeta256V2 () {}
+
+        static inline H2Tag SetHashVec (H2Tag hash) { return hash; }
+
+        static inline Version LoadVersion (char* cell_addr) {
+            return Version (__atomic_load_n ((uint64_t*)cell_addr, __ATOMIC_ACQUIRE) &
+                            (0xFFFF'FFFF'FFFC'FFFCLU));
+        }
+
+        // keeps the lock bit of the writer holding the cell
+        static inline void StoreVersion (char* cell_addr, const Version& v) {
+            uint64_t* word = reinterpret_cast<uint64_t*> (cell_addr);
+            uint64_t lock = __atomic_load_n (word, __ATOMIC_RELAXED) & (1LU << kLockBitPos);
+            __atomic_store_n (word, v.data_ | lock, __ATOMIC_RELEASE);
+        }
+
+        // Set while a writer holds the cell. A bit of the bitmap that no slot uses, which
+        // LoadVersion masks out.
+        static constexpr int kLockBitPos = 0;
+
+        // Set on a cell of the old cell array once an incremental rehash has moved its
+        // slots. LoadVersion masks this bit out.
+        static constexpr uint64_t kMigratedBit = 1LU << 16;
+
+        static inline bool IsMigrated (char* cell_addr) {
+            return __atomic_load_n ((uint64_t*)cell_addr, __ATOMIC_ACQUIRE) & kMigratedBit;
+        }
+
+        static inline void SetMigrated (char* cell_addr) {
+            // set the flag and advance the sequence number
+            uint64_t v = __atomic_load_n ((uint64_t*)cell_addr, __ATOMIC_ACQUIRE);
+            __atomic_store_n ((uint64_t*)cell_addr, (v | kMigratedBit) + (1LU << 32),
+                              __ATOMIC_RELEASE);
+        }
+
+        static inline SlotType* LocateSlot (char* cell_addr, int slot_i) {
+            return reinterpret_cast<SlotType*> (cell_addr + (slot_i << SlotSizeLeftShift));
+        }
+
+        static inline H2Tag* LocateH2Tag (char* cell_addr, int slot_i) {
+            return reinterpret_cast<H2Tag*> (cell_addr + 16) + slot_i;
+        }
+
+        // the reference bits of the cache mode, one per slot, in the unused meta bytes
+        using ReferenceWord = uint16_t;
+        static constexpr int kReferenceOffset = 8;
+
+        static inline uint16_t SlotBit (int slot_i) { return 1 << slot_i; }
+
+        inline Version GetVersion () { return ver_; }
+
+        inline util::BitSet MatchBitSet (H2Tag hash) {
+            uint64_t mask = util::simd_kernels.match_tag16 (meta_, hash);
+            return util::BitSet (mask & ver_.bitmap_ & ~ver_.bitmap_deleted_ & BitMapMask);
+        }
+
+        inline util::BitSet EraseBitSet () {
+            return util::BitSet (ver_.bitmap_deleted_ & BitMapMask);
+        }
+
+        inline util::BitSet BackupBitSet () { return util::BitSet (~ver_.bitmap_ & BitMapMask); }
+
+        inline util::BitSet ValidBitSet () {
+            return util::BitSet (ver_.bitmap_ & ~ver_.bitmap_deleted_ & BitMapMask);
+        }
+
+        inline bool IsDeleted (int i) { return (ver_.bitmap_deleted_ >> i) & 0x1; }
+
+        inline bool Full () { return __builtin_popcount (ver_.bitmap_ & BitMapMask) == 13; }
+
+        inline bool Occupy (int slot_index) { return ver_.bitmap_ & (1 << slot_index); }
+
+        inline int OccupyCount () { return __builtin_popcount (ver_.bitmap_); }
+
+        inline static constexpr uint8_t StartSlotPos () { return 2; }
+
+        inline static constexpr uint32_t CellSize () {
+            // cell size (include meta) in byte
+            return 256;
+        }
+
+        inline static constexpr uint32_t SlotMaxRange () {
+            // used for rehashing. Though we have 16 slots, one is reserved for update
+            // and deletion.
+            return 15;
+        }
+
+        inline static constexpr uint32_t SlotCount () {
+            // slot count
+            return 14;
+        }
+
+        inline static std::string Name () { return "CellMeta256V2"; }
+
+        inline static constexpr size_t size () {
+            // the meta size in byte in current cell
+            return 32;
+        }
+
+        std::string BitMapToString () {
+            std::string res;
+            char buffer[1024];
+            uint64_t H2s[2];
+            memcpy (H2s, meta_, 16);
+            sprintf (buffer, "bitmap: 0b%s, deleted: 0b%s - H2: 0x%016lx%016lx",
+                     print_binary (ver_.bitmap_).c_str (),
+                     print_binary (ver_.bitmap_deleted_).c_str (), H2s[1], H2s[0]);
+            return buffer;
+        }
+
+        std::string ToString () { return BitMapToString (); }
+
+        std::string print_binary (uint16_t bitmap) {
+            char buffer[1024];
+            static std::string bit_rep[16] = {"0000", "0001", "0010", "0011", "0100", "0101",
+                                              "0110", "0111", "1000", "1001", "1010", "1011",
+                                              "1100", "1101", "1110", "1111"};
+            sprintf (buffer, "%s%s%s%s", bit_rep[(bitmap >> 12) & 0x0F].c_str (),
+                     bit_rep[(bitmap >> 8) & 0x0F].c_str (), bit_rep[(bitmap >> 4) & 0x0F].c_str (),
+                     bit_rep[(bitmap >> 0) & 0x0F].c_str ());
+            return buffer;
+        }
+
+        const char* meta_;  // 16 byte hash tags
+        Version ver_;
+
+    };  // end of class CellMeta256V2
+
+    /** CellMeta128
+     *  @note: Hash cell whose size is 128 byte. There are 7 slots in the cell.
+     *  @format:
+     *  | ------------------- 16 Byte meta -----------------| ----- Slots -----
+     *  |   2 Bytes   | 2 Byte |      4 Bytes    |  8 Bytes | 16 byte * 7 slot
+     *  | Bitmap Zone |  None  | Sequence Number | Hash Tag |
+     *
+     *  |- Bitmap Zone:
+     *      1  -  7 bit: bitmap_, indicate which slot is valid or not
+     *      9  - 15 bit: bitmap_deleted_, 1: deleted
+     *
+     *  |- Sequence Number: increase for each write
+     *
+     *  |- Hash Tag
+     *      One byte tag (H2) for the slot. The byte of slot 0 holds the reference bits
+     *      of the cache mode instead.
+     *
+     *  |- Slots:
+     *      0  -  7 byte: H1 tag or real key for flat_key
+     *      8  - 15 byte: pointer to data or read value for flat_value
+     */
+    class CellMeta128 {
+    public:
+        static constexpr uint8_t BitMapMask = 0xFE;
+        static constexpr int CellSizeLeftShift = 7;
+        static constexpr int SlotSizeLeftShift = 4;
+        static constexpr int kDeleteBitmapOffset = 8;
+
+        struct Version {
+            explicit Version (uint64_t data) : data_ (data) {}
+            explicit Version (uint8_t b, uint8_t bd, uint32_t seq)
+                : bitmap_ (b), bitmap_deleted_ (bd), seq_no_ (seq) {}
+            union {
+                struct {
+                    uint8_t bitmap_;
+                    uint8_t bitmap_deleted_;
+                    uint16_t _none;
+                    uint32_t seq_no_;
+                };
+                uint64_t data_;
+            };
+
+            inline bool IsPosValid (int i) { return (bitmap_ & ~bitmap_deleted_ & (1 << i)) != 0; }
+
+            bool operator== (const Version& v1) { return data_ == v1.data_; }
+            bool operator!= (const Version& v1) { return data_ != v1.data_; }
+        };
+
+        explicit CellMeta128 (char* rep)
+            // obtain the hash tags to meta_
+            : meta_ (_mm_set_pi64x (*reinterpret_cast<size_t*> (rep + 8))),
+              ver_ (LoadVersion (rep)) {}
+
+        ~CellMeta128 () {}
+
+        static __m64 SetHashVec (uint16_t hash) { return _mm_set1_pi8 (hash); }
+
+        static inline Version LoadVersion (char* cell_addr) {
+            return Version (__atomic_load_n ((uint64_t*)cell_addr, __ATOMIC_ACQUIRE) &
+                            (0xFFFF'FFFF'0000'FEFELU));
+        }
+
+        // keeps the lock bit of the writer holding the cell
+        static inline void StoreVersion (char* cell_addr, const Version& v) {
+            uint64_t* word = reinterpret_cast<uint64_t*> (cell_addr);
+            uint64_t lock = __atomic_load_n (word, __ATOMIC_RELAXED) & (1LU << kLockBitPos);
+            __atomic_store_n (word, v.data_ | lock, __ATOMIC_RELEASE);
+        }
+
+        // Set while a writer holds the cell. Kept in the unused half word, which LoadVersion
+        // masks out.
+        static constexpr int kLockBitPos = 16;
+
+        // Set on a cell of the old cell array once an incremental rehash has moved its
+        // slots. LoadVersion masks this bit out.
+        static constexpr uint64_t kMigratedBit = 1LU << 8;
+
+        static inline bool IsMigrated (char* cell_addr) {
+            return __atomic_load_n ((uint64_t*)cell_addr, __ATOMIC_ACQUIRE) & kMigratedBit;
+        }
+
+        static inline void SetMigrated (char* cell_addr) {
+            // set the flag and advance the sequence number
+            uint64_t v = __atomic_load_n ((uint64_t*)cell_addr, __ATOMIC_ACQUIRE);
+            __atomic_store_n ((uint64_t*)cell_addr, (v | kMigratedBit) + (1LU << 32),
+                              __ATOMIC_RELEASE);
+        }
+
+        static inline SlotType* LocateSlot (char* cell_addr, int slot_i) {
+            return reinterpret_cast<SlotType*> (cell_addr + (slot_i << SlotSizeLeftShift));
+        }
+
+        static inline H2Tag* LocateH2Tag (char* cell_addr, int slot_i) {
+            return reinterpret_cast<H2Tag*> (cell_addr + 8) + slot_i;
+        }
+
+        // the reference bits of the cache mode, one per slot, in the hash tag of slot 0,
+        // which holds the meta and is never matched
+        using ReferenceWord = uint8_t;
+        static constexpr int kReferenceOffset = 8;
+
+        static inline uint8_t SlotBit (int slot_i) { return 1 << slot_i; }
+
+        inline Version GetVersion () { return ver_; }
+
+        inline util::BitSet MatchBitSet (const __m64& hash_vec) {
+            auto compare_res = _mm_cmpeq_pi8 (hash_vec, meta_);
+            uint8_t mask = _mm_movemask_pi8 (compare_res);
+            return util::BitSet (mask & ver_.bitmap_ & ~ver_.bitmap_deleted_ & BitMapMask);
+        }
+
+        inline util::BitSet EraseBitSet () {
+            return util::BitSet (ver_.bitmap_deleted_ & BitMapMask);
+        }
+
+        inline util::BitSet BackupBitSet () { return util::BitSet (~ver_.bitmap_ & BitMapMask); }
+
+        inline util::BitSet ValidBitSet () {
+            return util::BitSet (ver_.bitmap_ & ~ver_.bitmap_deleted_ & BitMapMask);
+        }
+
+        inline bool IsDeleted (int i) { return (ver_.bitmap_deleted_ >> i) & 0x1; }
+
+        inline bool Full () { return __builtin_popcount (ver_.bitmap_ & BitMapMask) == 6; }
+
+        inline bool Occupy (int slot_index) { return ver_.bitmap_ & (1 << slot_index); }
+
+        inline int OccupyCount () { return __builtin_popcount (ver_.bitmap_); }
+
+        inline static constexpr uint8_t StartSlotPos () { return 1; }
+
+        inline static constexpr uint32_t CellSize () {
+            // cell size (include meta) in byte
+            return 128;
+        }
+
+        inline static constexpr uint32_t SlotMaxRange () { return 7; }
+
+        inline static constexpr uint32_t SlotCount () {
+            // slot count
+            return 7;
+        }
+
+        inline static std::string Name () { return "CellMeta128"; }
+
+        inline static constexpr size_t size () {
+            // the meta size in byte in current cell
+            return 16;
+        }
+
+        std::string BitMapToString () {
+            std::string res;
+            char buffer[1024];
+            uint64_t H2s[2];
+            memcpy (H2s, &meta_, 16);
+            sprintf (buffer, "bitmap: 0b%s, deleted: 0b%s - H2: 0x%016lx%016lx",
+                     print_binary (ver_.bitmap_).c_str (),
+                     print_binary (ver_.bitmap_deleted_).c_str (), H2s[1], H2s[0]);
+            return buffer;
+        }
+
+        std::string ToString () { return BitMapToString (); }
+
+        std::string print_binary (uint16_t bitmap) {
+            char buffer[1024];
+            static std::string bit_rep[16] = {"0000", "0001", "0010", "0011", "0100", "0101",
+                                              "0110", "0111", "1000", "1001", "1010", "1011",
+                                              "1100", "1101", "1110", "1111"};
+            sprintf (buffer, "%s%s%s%s", bit_rep[(bitmap >> 12) & 0x0F].c_str (),
+                     bit_rep[(bitmap >> 8) & 0x0F].c_str (), bit_rep[(bitmap >> 4) & 0x0F].c_str (),
+                     bit_rep[(bitmap >> 0) & 0x0F].c_str ());
+            return buffer;
+        }
+
+        __m64 meta_;  // 8 byte integer vector
+        Version ver_;
+
+    };  // end of class CellMeta128
+
+    /** CellMeta1024
+     *  @note: Hash cell whose size is 1 KiB. There are 58 slots in the cell, whose 64 hash
+     *         tags are matched by a single compare with AVX-512, or two with AVX2.
+     *  @format:
+     *  | ----------------------------- 96 Byte meta ----------------------------| -- Slots -- |
+     *  |  8 Bytes  |     8 Bytes     |     8 Bytes     | 8 Bytes |  64 Bytes  |  16 B * 58  |
+     *  |  Bitmap   |  Delete Bitmap  | Sequence Number |  Refs   |  Hash Tag  |
+     *
+     *  |- Bitmap: 6 - 63 bit, indicate which slot is valid or not
+     *
+     *  |- Delete Bitmap: 6 - 63 bit, 1: deleted
+     *
+     *  |- Sequence Number: twice the number of writes, odd while a write is in progress.
+     *      The version spans three words, so it is read and written as a seqlock.
+     *
+     *  |- Refs: 6 - 63 bit, reference bits of the cache mode
+     *
+     *  |- Hash Tag
+     *      One byte tag (H2) for the slot
+     *
+     *  |- Slots:
+     *      0  -  7 byte: H1 tag or real key for flat_key
+     *      8  - 15 byte: pointer to data or read value for flat_value
+     */
+    class CellMeta1024 {
+    public:
+        static constexpr uint64_t BitMapMask = 0xFFFF'FFFF'FFFF'FFC0LU;
+        static constexpr int CellSizeLeftShift = 10;
+        static constexpr int SlotSizeLeftShift = 4;
+
+        struct Version {
+            explicit Version (uint64_t b, uint64_t bd, uint32_t seq)
+                : bitmap_ (b), bitmap_deleted_ (bd), seq_no_ (seq) {}
+
+            uint64_t bitmap_;
+            uint64_t bitmap_deleted_;
+            uint32_t seq_no_;
+
+            inline bool IsPosValid (int i) {
+                return (bitmap_ & ~bitmap_deleted_ & SlotBit (i)) != 0;
+            }
+
+            bool operator== (const Version& v1) {
+                return bitmap_ == v1.bitmap_ && bitmap_deleted_ == v1.bitmap_deleted_ &&
+                       seq_no_ == v1.seq_no_;
+            }
+            bool operator!= (const Version& v1) { return !(*this == v1); }
+        };
+
+        explicit CellMeta1024 (char* rep)
+            // the hash tags are matched by the runtime selected kernel
+            : meta_ (rep + 32), ver_ (LoadVersion (rep)) {}
+
+        ~CellMeta1024 () {}
+
+        static inline H2Tag SetHashVec (H2Tag hash) { return hash; }
+
+        static inline Version LoadVersion (char* cell_addr) {
+            uint64_t* words = reinterpret_cast<uint64_t*> (cell_addr);
+            while (true) {
+                uint64_t seq = __atomic_load_n (&words[2], __ATOMIC_ACQUIRE);
+                if TURBO_UNLIKELY (seq & 1) {
+                    TURBO_CPU_RELAX ();
+                    continue;
+                }
+                uint64_t bitmap = __atomic_load_n (&words[0], __ATOMIC_ACQUIRE);
+                uint64_t bitmap_deleted = __atomic_load_n (&words[1], __ATOMIC_ACQUIRE);
+                if TURBO_LIKELY (__atomic_load_n (&words[2], __ATOMIC_ACQUIRE) == seq) {
+                    return Version (bitmap & BitMapMask, bitmap_deleted & BitMapMask,
+                                    static_cast<uint32_t> (seq >> 1));
+                }
+            }
+        }
+
+        // only called by the writer holding the cell, whose lock bit is kept
+        static inline void StoreVersion (char* cell_addr, const Version& v) {
+            uint64_t* words = reinterpret_cast<uint64_t*> (cell_addr);
+            uint64_t seq = static_cast<uint64_t> (v.seq_no_) << 1;
+            uint64_t lock = __atomic_load_n (&words[0], __ATOMIC_RELAXED) & (1LU << kLockBitPos);
+            __atomic_store_n (&words[2], seq - 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence (__ATOMIC_RELEASE);
+            __atomic_store_n (&words[0], v.bitmap_ | lock, __ATOMIC_RELAXED);
+            __atomic_store_n (&words[1], v.bitmap_deleted_, __ATOMIC_RELAXED);
+            __atomic_store_n (&words[2], seq, __ATOMIC_RELEASE);
+        }
+
+        // Set on a cell of the old cell array once an incremental rehash has moved its
+        // slots. Kept in a non-slot bit of the bitmap, which LoadVersion masks out.
+        static constexpr uint64_t kMigratedBit = 1LU;
+
+        // Set while a writer holds the cell, next to kMigratedBit.
+        static constexpr int kLockBitPos = 1;
+
+        static inline bool IsMigrated (char* cell_addr) {
+            return __atomic_load_n ((uint64_t*)cell_addr, __ATOMIC_ACQUIRE) & kMigratedBit;
+        }
+
+        static inline void SetMigrated (char* cell_addr) {
+            // set the flag and advance the sequence number
+            uint64_t* words = reinterpret_cast<uint64_t*> (cell_addr);
+            uint64_t seq = __atomic_load_n (&words[2], __ATOMIC_RELAXED);
+            __atomic_store_n (&words[2], seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence (__ATOMIC_RELEASE);
+            __atomic_store_n (&words[0], words[0] | kMigratedBit, __ATOMIC_RELAXED);
+            __atomic_store_n (&words[2], seq + 2, __ATOMIC_RELEASE);
+        }
+
+        static inline SlotType* LocateSlot (char* cell_addr, int slot_i) {
+            return reinterpret_cast<SlotType*> (cell_addr + (slot_i << SlotSizeLeftShift));
+        }
+
+        static inline H2Tag* LocateH2Tag (char* cell_addr, int slot_i) {
+            return reinterpret_cast<H2Tag*> (cell_addr + 32) + slot_i;
+        }
+
+        // the reference bits of the cache mode, one per slot, in the unused meta word
+        using ReferenceWord = uint64_t;
+        static constexpr int kReferenceOffset = 24;
+
+        static inline uint64_t SlotBit (int slot_i) { return 1LU << slot_i; }
+
+        inline Version GetVersion () { return ver_; }
+
+        inline util::BitSet MatchBitSet (H2Tag hash) {
+            uint64_t mask = util::simd_kernels.match_tag64 (meta_, hash);
+            return util::BitSet (mask & ver_.bitmap_ & ~ver_.bitmap_deleted_);
+        }
+
+        inline util::BitSet EraseBitSet () { return util::BitSet (ver_.bitmap_deleted_); }
+
+        inline util::BitSet BackupBitSet () { return util::BitSet (~ver_.bitmap_ & BitMapMask); }
+
+        inline util::BitSet ValidBitSet () {
+            return util::BitSet (ver_.bitmap_ & ~ver_.bitmap_deleted_);
+        }
+
+        inline bool IsDeleted (int i) { return (ver_.bitmap_deleted_ >> i) & 0x1; }
+
+        inline bool Full () { return __builtin_popcountll (ver_.bitmap_) == SlotCount () - 1; }
+
+        inline bool Occupy (int slot_index) { return ver_.bitmap_ & SlotBit (slot_index); }
+
+        inline int OccupyCount () { return __builtin_popcountll (ver_.bitmap_); }
+
+        inline static constexpr uint8_t StartSlotPos () { return 6; }
+
+        inline static constexpr uint32_t CellSize () {
+            // cell size (include meta) in byte
+            return 1024;
+        }
+
+        inline static constexpr uint32_t SlotMaxRange () { return 63; }
+
+        inline static constexpr uint32_t SlotCount () {
+            // slot count
+            return 58;
+        }
+
+        inline static std::string Name () { return "CellMeta1024"; }
+
+        inline static constexpr size_t size () {
+            // the meta size in byte in current cell
+            return 96;
+        }
+
+        std::string BitMapToString () {
+            char buffer[1024];
+            uint64_t H2s[8];
+            memcpy (H2s, meta_, 64);
+            sprintf (buffer,
+                     "bitmap: 0x%016lx, deleted: 0x%016lx - H2: "
+                     "0x%016lx%016lx%016lx%016lx%016lx%016lx%016lx%016lx",
+                     ver_.bitmap_, ver_.bitmap_deleted_, H2s[7], H2s[6], H2s[5], H2s[4], H2s[3],
+                     H2s[2], H2s[1], H2s[0]);
+            return buffer;
+        }
+
+        std::string ToString () { return BitMapToString (); }
+
+        const char* meta_;  // 64 byte hash tags
+        Version ver_;
+
+    };  // end of class CellMeta1024
+
+    /** ProbeWithinBucket
+     *  @note: probe within a bucket
+     */
+    class ProbeWithinBucket {
+    public:
+        static const int MAX_PROBE_LEN = kTurboMaxProbeLen;
+        static const int PROBE_STEP = kTurboProbeStep;
+        ProbeWithinBucket (uint64_t initial_hash, uint32_t cell_count_mask, uint32_t bucket_i) {
+            h_ = initial_hash;
+            cell_count_mask_ = cell_count_mask;
+            cell_index_ = h_ & cell_count_mask_;
+            bucket_i_ = bucket_i;
+            probe_count_ = 0;
+        }
+
+        inline void reset () {
+            cell_index_ = h_ & cell_count_mask_;
+            probe_count_ = 0;
+        }
+
+        // indicate whether we have already probed all the assocaite cells
+        inline operator bool () const { return probe_count_ <= cell_count_mask_; }
+
+        inline void next () {
+            cell_index_ += PROBE_STEP;
+            // CellCountMask should be like 0b11
+            cell_index_ &= cell_count_mask_;
+            probe_count_++;
+        }
+
+        inline std::pair<uint32_t, uint32_t> offset () { return {bucket_i_, cell_index_}; }
+
+        static std::string name () { return "ProbeWithinBucket"; }
+
+    private:
+        uint64_t h_;
+        uint32_t cell_count_mask_;
+        uint32_t cell_index_;
+        uint32_t bucket_i_;
+        uint32_t probe_count_;
+    };
+
+    static_assert (__builtin_popcount (kCellCountLimit) == 1,
+                   "kCellCountLimit should be power of two");
+    static_assert (kCellCountLimit <= kTurboCellCountLimit,
+                   "kCellCountLimit needs to be <= kTurboCellCountLimit");
+
+    using CellMeta = typename std::conditional<
+        std::is_same<CellLayout, Cell1024>::value, CellMeta1024,
+        typename std::conditional<std::is_same<CellLayout, Cell256>::value, CellMeta256V2,
+                                  CellMeta128>::type>::type;
+    using WHash = WrapHash<Hash>;
+    using WKeyEqual = WrapKeyEqual<KeyEqual>;
+
+    static_assert (sizeof (HashSlot) == 16, "HashSlot size error.");
+    /** SlotInfo
+     *  @note: use to store the target slot location info
+     */
+    class SlotInfo {
+    public:
+        uint32_t bucket;   // bucket index
+        uint32_t cell;     // cell index
+        uint8_t slot;      // slot index
+        uint8_t old_slot;  // if equal_key, this save old slot position
+        H1Tag H1;          // hash-tag in HashSlot
+        H2Tag H2;          // hash-tag in CellMeta
+        bool equal_key;    // If we find a equal key in this slot
+        SlotInfo (uint32_t b, uint32_t a, int s, H1Tag h1, H2Tag h2, bool euqal, int os = 0)
+            : bucket (b), cell (a), slot (s), old_slot (os), H1 (h1), H2 (h2), equal_key (euqal) {}
+        SlotInfo ()
+            : bucket (0), cell (0), slot (0), old_slot (0), H1 (0), H2 (0), equal_key (false) {}
+
+        std::string ToString () {
+            std::ostringstream ss;
+            ss << "bi: " << bucket << ", ci: " << cell << ", si: " << slot << ", H2: " << H2
+               << ", H1: " << H1;
+            return ss.str ();
+        }
+    };  // end of class SlotInfo
+
+    template <typename T1, bool key_flat, bool value_flat>
+    class DataRecord;
+
+    template <typename T1>
+    class DataRecord<T1, true, true> {
+    public:
+        DataRecord () = default;
+        explicit DataRecord (const H1Tag& k, const Entry& v) : key_ (k), val_ (v) {}
+        inline Key key () { return key_; }
+        inline T value () { return val_; }
 
-    template <typename T1, bool key_flat, bool value_flat>
-    struct SlotRecord : public HashSlot {};
-
-    using SlotType = SlotRecord<Key, is_key_flat, is_value_flat>;
+    private:
+        Key key_;
+        T val_;
+    };
 
-    /** CellMeta256V2
-     *  @note: Hash cell whose size is 256 byte. There are 14 slots in the cell.
-     *  @format:
-     *  | ------------------- 32 Byte meta --------------------| ----- Slots ----- |
-     *  |    4 Bytes   |     4 Bytes     | 8 Bytes  | 16 Bytes |   16 Bytes * 14   |
-     *  |  Bitmap Zone | Sequence Number | None     | Hash Tag |
-     *
-     *  |- Bitmap Zone:
-     *      2  - 15 bit: indicate which slot is valid or not
-     *      18 - 31 bit: delete_bitmap. 1: deleted
-     *
-     *  |- Sequence Number: increase for each write
-     *
-     *  |- Hash Tag
-     *      One byte tag (H2) for the slot
-     *
-     *  |- Slots:
-     *      0  -  7 byte: H1 tag or real key for flat_key
-     *      8  - 15 byte: pointer to data or read value for flat_value
+    /**
+     * @brief both key and value is numeric type
+     * HashSlot:
+     *          | key | value |
      */
-    class CellMeta256V2 {
-    public:
-        static constexpr uint16_t BitMapMask = 0xFFFC;
-        static constexpr int CellSizeLeftShift = 8;
-        static constexpr int SlotSizeLeftShift = 4;
-        static constexpr int kDeleteBitmapOffset = 16;
+    template <typename T1>
+    struct SlotRecord<T1, true, true> : public HashSlot {
+        inline void Store (uint64_t hash, const Key& key, const T& value,
+                           RecordAllocator& allocator, uint64_t deadline = 0) {
+            HashSlot::H1 = key;
+            HashSlot::entry = value;
+        }
 
-        struct Version {
-            explicit Version (uint64_t data) : data_ (data) {}
-            explicit Version (uint16_t b, uint16_t bd, uint32_t seq)
-                : bitmap_ (b), bitmap_deleted_ (bd), seq_no_ (seq) {}
+        inline char* ReleaseAddress () { return nullptr; }
 
-            Version (const Version& v) { this->data_ = v.data_; }
-            union {
-                struct {
-                    uint16_t bitmap_;
-                    uint16_t bitmap_deleted_;
-                    uint32_t seq_no_;
-                };
-                uint64_t data_;
-            };
+        inline Key first (void) { return HashSlot::H1; }
 
-            inline bool IsPosValid (int i) { return (bitmap_ & ~bitmap_deleted_ & (1 << i)) != 0; }
+        inline T second (void) { return HashSlot::entry; }
 
-            bool operator== (const Version& v1) { return data_ == v1.data_; }
-            bool operator!= (const Version& v1) { return data_ != v1.data_; }
-        };
+        inline Key compareKey (void) { return HashSlot::H1; }
 
-        explicit CellMeta256V2 (char* rep)
-            // obtain the hash tags to meta_
-            : meta_ (_mm_loadu_si128 (reinterpret_cast<const __m128i*> (rep + 16))),
-              ver_ (LoadVersion (rep)) {}
+        DataRecord<T1, true, true> Record () {
+            return DataRecord<T1, true, true>{HashSlot::H1, HashSlot::entry};
+        }
+    };
 
-        ~CellMeta256V2 () {}
+    template <typename T1>
+    class DataRecord<T1, true, false> {
+    public:
+        DataRecord () = default;
+        explicit DataRecord (const H1Tag& k, const Entry& ptr) : key_ (k), ptr_ (ptr) {}
+        inline Key key () { return key_; }
+        inline T value () {
+            if (InlineEntry::IsInline (ptr_)) return InlineEntry::Second (ptr_);
+            return DecodeInRecord2<true, false, false, Key, T>::Decode (
+                ExpiringEntry::Record (ptr_));
+        }
 
-        static inline __m128i SetHashVec (H2Tag hash) { return _mm_set1_epi8 (hash); }
+    private:
+        Key key_;
+        Entry ptr_;
+    };
 
-        static inline Version LoadVersion (char* cell_addr) {
-            return Version (__atomic_load_n ((uint64_t*)cell_addr, __ATOMIC_ACQUIRE) &
-                            (0xFFFF'FFFF'FFFC'FFFCLU));
+    /**
+     * @brief key is numeric, value is std::string
+     * HashSlot:
+     *          | key | pointer | -> | key | val_len | value
+     *                                     | size_t  | ...
+     *          | key | inline value |   (value no longer than 7 bytes)
+     */
+    template <typename T1>
+    struct SlotRecord<T1, true, false> : public HashSlot {
+        inline void Store (uint64_t hash, const Key& key, const T& value,
+                           RecordAllocator& allocator, uint64_t deadline = 0) {
+            HashSlot::H1 = key;
+            if (deadline != 0) {
+                HashSlot::entry =
+                    ExpiringEntry::template Store<true, false> (key, value, deadline, allocator);
+                return;
+            }
+            if (InlineEntry::Fits (0, value.size ())) {
+                HashSlot::entry = InlineEntry::Encode (nullptr, 0, value.data (), value.size ());
+                return;
+            }
+            size_t buf_len = Record2Format<true, false, Key, T>::Length (key, value);
+            char* addr = (char*)allocator.Allocate (buf_len);
+            EncodeToRecord2<true, false, Key, T>::Encode (key, value, addr);
+            HashSlot::entry = addr;
         }
 
-        static inline void StoreVersion (char* cell_addr, const Version& v) {
-            __atomic_store_n (reinterpret_cast<uint64_t*> (cell_addr), v.data_, __ATOMIC_RELEASE);
+        inline char* ReleaseAddress () {
+            return InlineEntry::IsInline (HashSlot::entry)
+                       ? nullptr
+                       : ExpiringEntry::Block (HashSlot::entry);
         }
 
-        static inline SlotType* LocateSlot (char* cell_addr, int slot_i) {
-            return reinterpret_cast<SlotType*> (cell_addr + (slot_i << SlotSizeLeftShift));
-        }
+        inline Key first (void) { return HashSlot::H1; }
 
-        static inline H2Tag* LocateH2Tag (char* cell_addr, int slot_i) {
-            return reinterpret_cast<H2Tag*> (cell_addr + 16) + slot_i;
+        inline T second (void) {
+            if (InlineEntry::IsInline (HashSlot::entry)) {
+                return InlineEntry::Second (HashSlot::entry);
+            }
+            return DecodeInRecord2<true, false, false, Key, T>::Decode (
+                ExpiringEntry::Record (HashSlot::entry));
         }
 
-        inline Version GetVersion () { return ver_; }
+        inline Key compareKey (void) { return HashSlot::H1; }
 
-        inline util::BitSet MatchBitSet (const __m128i& hash_vec) {
-#ifdef __AVX512__
-            uint16_t mask = _mm_cmpeq_epi8_mask (hash_vec, meta_);
-#else
-            auto compare_res = _mm_cmpeq_epi8 (hash_vec, meta_);
-            uint16_t mask = _mm_movemask_epi8 (compare_res);
-#endif
-            return util::BitSet (mask & ver_.bitmap_ & ~ver_.bitmap_deleted_ & BitMapMask);
+        DataRecord<T1, true, false> Record () {
+            return DataRecord<T1, true, false>{HashSlot::H1, HashSlot::entry};
         }
+    };
 
-        inline util::BitSet EraseBitSet () {
-            return util::BitSet (ver_.bitmap_deleted_ & BitMapMask);
+    template <typename T1>
+    class DataRecord<T1, false, true> {
+    public:
+        DataRecord () = default;
+        explicit DataRecord (const H1Tag& k, const Entry& kvptr) : h1_ (k), ptr_ (kvptr) {}
+        inline Key key () {
+            if (InlineEntry::IsInline (ptr_)) return InlineEntry::First (ptr_);
+            return DecodeInRecord2<false, true, true, Key, T>::Decode (
+                ExpiringEntry::Record (ptr_));
+        }
+        inline T value () {
+            if (InlineEntry::IsInline (ptr_)) return InlineEntry::template SecondNumeric<T> (ptr_);
+            return DecodeInRecord2<false, true, false, Key, T>::Decode (
+                ExpiringEntry::Record (ptr_));
         }
 
-        inline util::BitSet BackupBitSet () { return util::BitSet (~ver_.bitmap_ & BitMapMask); }
-
-        inline util::BitSet ValidBitSet () {
-            return util::BitSet (ver_.bitmap_ & ~ver_.bitmap_deleted_ & BitMapMask);
+    private:
+        H1Tag h1_;
+        Entry ptr_;
+    };
+    /**
+     * @brief key is std::string, value is numeric
+     * HashSlot:
+     *          | H1 | pointer | -> | key_len | value | key_buffer
+     *                              | size_t  |   T   |  ...
+     *          | H1 | inline key, value |   (key and value no longer than 7 bytes)
+     */
+    template <typename T1>
+    struct SlotRecord<T1, false, true> : public HashSlot {
+        inline void Store (uint64_t hash, const Key& key, const T& value,
+                           RecordAllocator& allocator, uint64_t deadline = 0) {
+            HashSlot::H1 = hash;
+            if (deadline != 0) {
+                HashSlot::entry =
+                    ExpiringEntry::template Store<false, true> (key, value, deadline, allocator);
+                return;
+            }
+            if (InlineEntry::Fits (key.size (), sizeof (T))) {
+                HashSlot::entry =
+                    InlineEntry::Encode (key.data (), key.size (), &value, sizeof (T));
+                return;
+            }
+            size_t buf_len = Record2Format<false, true, Key, T>::Length (key, value);
+            char* addr = (char*)allocator.Allocate (buf_len);
+            EncodeToRecord2<false, true, Key, T>::Encode (key, value, addr);
+            HashSlot::entry = addr;
         }
 
-        inline bool IsDeleted (int i) { return (ver_.bitmap_deleted_ >> i) & 0x1; }
+        inline char* ReleaseAddress () {
+            return InlineEntry::IsInline (HashSlot::entry)
+                       ? nullptr
+                       : ExpiringEntry::Block (HashSlot::entry);
+        }
 
-        inline bool Full () { return __builtin_popcount (ver_.bitmap_ & BitMapMask) == 13; }
+        inline Key first (void) { return compareKey (); }
 
-        inline bool Occupy (int slot_index) { return ver_.bitmap_ & (1 << slot_index); }
+        inline T second (void) {
+            if (InlineEntry::IsInline (HashSlot::entry)) {
+                return InlineEntry::template SecondNumeric<T> (HashSlot::entry);
+            }
+            return DecodeInRecord2<false, true, false, Key, T>::Decode (
+                ExpiringEntry::Record (HashSlot::entry));
+        }
 
-        inline int OccupyCount () { return __builtin_popcount (ver_.bitmap_); }
+        inline util::Slice compareKey (void) {
+            if (InlineEntry::IsInline (HashSlot::entry)) {
+                return InlineEntry::First (HashSlot::entry);
+            }
+            return DecodeInRecord2<false, true, true, Key, T>::Decode (
+                ExpiringEntry::Record (HashSlot::entry));
+        }
 
-        inline static constexpr uint8_t StartSlotPos () { return 2; }
+        DataRecord<T1, false, true> Record () {
+            return DataRecord<T1, false, true>{HashSlot::H1, HashSlot::entry};
+        }
+    };
 
-        inline static constexpr uint32_t CellSize () {
-            // cell size (include meta) in byte
-            return 256;
+    template <typename T1>
+    class DataRecord<T1, false, false> {
+    public:
+        DataRecord () = default;
+        explicit DataRecord (const H1Tag& k, const Entry& kvptr) : h1_ (k), ptr_ (kvptr) {}
+        inline Key key () {
+            if (InlineEntry::IsInline (ptr_)) return InlineEntry::First (ptr_);
+            return DecodeInRecord2<false, false, true, Key, T>::Decode (
+                ExpiringEntry::Record (ptr_));
+        }
+        inline T value () {
+            if (InlineEntry::IsInline (ptr_)) return InlineEntry::Second (ptr_);
+            return DecodeInRecord2<false, false, false, Key, T>::Decode (
+                ExpiringEntry::Record (ptr_));
         }
 
-        inline static constexpr uint32_t SlotMaxRange () {
-            // used for rehashing. Though we have 16 slots, one is reserved for update
-            // and deletion.
-            return 15;
+    private:
+        H1Tag h1_;
+        Entry ptr_;
+    };
+    /**
+     * @brief key and value both are std::string
+     * HashSlot:
+     *          | H1 | pointer | -> | key_len | value_len | key_buf | value_buf
+     *                              | size_t  |  size_t   |  ...    |  ...
+     *          | H1 | inline key, value |   (key and value no longer than 7 bytes)
+     *
+     */
+    template <typename T1>
+    struct SlotRecord<T1, false, false> : public HashSlot {
+        inline void Store (uint64_t hash, const Key& key, const T& value,
+                           RecordAllocator& allocator, uint64_t deadline = 0) {
+            HashSlot::H1 = hash;
+            if (deadline != 0) {
+                HashSlot::entry =
+                    ExpiringEntry::template Store<false, false> (key, value, deadline, allocator);
+                return;
+            }
+            if (InlineEntry::Fits (key.size (), value.size ())) {
+                HashSlot::entry =
+                    InlineEntry::Encode (key.data (), key.size (), value.data (), value.size ());
+                return;
+            }
+            size_t buf_len = Record2Format<false, false, Key, T>::Length (key, value);
+            char* addr = (char*)allocator.Allocate (buf_len);
+            EncodeToRecord2<false, false, Key, T>::Encode (key, value, addr);
+            HashSlot::entry = addr;
         }
 
-        inline static constexpr uint32_t SlotCount () {
-            // slot count
-            return 14;
+        inline char* ReleaseAddress () {
+            return InlineEntry::IsInline (HashSlot::entry)
+                       ? nullptr
+                       : ExpiringEntry::Block (HashSlot::entry);
         }
 
-        inline static std::string Name () { return "CellMeta256V2"; }
+        inline Key first (void) { return compareKey (); }
 
-        inline static constexpr size_t size () {
-            // the meta size in byte in current cell
-            return 32;
+        inline T second (void) {
+            if (InlineEntry::IsInline (HashSlot::entry)) {
+                return InlineEntry::Second (HashSlot::entry);
+            }
+            return DecodeInRecord2<false, false, false, Key, T>::Decode (
+                ExpiringEntry::Record (HashSlot::entry));
         }
 
-        std::string BitMapToString () {
-            std::string res;
-            char buffer[1024];
-            uint64_t H2s[4];
-            memcpy (H2s, &meta_, 32);
-            sprintf (buffer, "bitmap: 0b%s, deleted: 0b%s - H2: 0x%016lx%016lx%016lx%016lx",
-                     print_binary (ver_.bitmap_).c_str (),
-                     print_binary (ver_.bitmap_deleted_).c_str (), H2s[3], H2s[2], H2s[1], H2s[0]);
-            return buffer;
+        inline util::Slice compareKey (void) {
+            if (InlineEntry::IsInline (HashSlot::entry)) {
+                return InlineEntry::First (HashSlot::entry);
+            }
+            return DecodeInRecord2<false, false, true, Key, T>::Decode (
+                ExpiringEntry::Record (HashSlot::entry));
         }
 
-        std::string ToString () { return BitMapToString (); }
-
-        std::string print_binary (uint16_t bitmap) {
-            char buffer[1024];
-            static std::string bit_rep[16] = {"0000", "0001", "0010", "0011", "0100", "0101",
-                                              "0110", "0111", "1000", "1001", "1010", "1011",
-                                              "1100", "1101", "1110", "1111"};
-            sprintf (buffer, "%s%s%s%s", bit_rep[(bitmap >> 12) & 0x0F].c_str (),
-                     bit_rep[(bitmap >> 8) & 0x0F].c_str (), bit_rep[(bitmap >> 4) & 0x0F].c_str (),
-                     bit_rep[(bitmap >> 0) & 0x0F].c_str ());
-            return buffer;
+        DataRecord<T1, false, false> Record () {
+            return DataRecord<T1, false, false>{HashSlot::H1, HashSlot::entry};
         }
+    };
 
-        __m128i meta_;  // 16 byte integer vector for hash tags
-        Version ver_;
-
-    };  // end of class CellMeta256V2
+    using RecordType = DataRecord<Key, is_key_flat, is_value_flat>;
 
-    /** CellMeta128
-     *  @note: Hash cell whose size is 128 byte. There are 7 slots in the cell.
-     *  @format:
-     *  | ------------------- 16 Byte meta -----------------| ----- Slots -----
-     *  |   2 Bytes   | 2 Byte |      4 Bytes    |  8 Bytes | 16 byte * 7 slot
-     *  | Bitmap Zone |  None  | Sequence Number | Hash Tag |
-     *
-     *  |- Bitmap Zone:
-     *      1  -  7 bit: bitmap_, indicate which slot is valid or not
-     *      9  - 15 bit: bitmap_deleted_, 1: deleted
-     *
-     *  |- Sequence Number: increase for each write
-     *
-     *  |- Hash Tag
-     *      One byte tag (H2) for the slot
-     *
-     *  |- Slots:
-     *      0  -  7 byte: H1 tag or real key for flat_key
-     *      8  - 15 byte: pointer to data or read value for flat_value
+    using LockQueue = typename BucketLock::Queue;
+
+    /** BucketMeta
+     *  @note: a 8-byte
      */
-    class CellMeta128 {
+    class BucketMeta {
     public:
-        static constexpr uint8_t BitMapMask = 0xFE;
-        static constexpr int CellSizeLeftShift = 7;
-        static constexpr int SlotSizeLeftShift = 4;
-        static constexpr int kDeleteBitmapOffset = 8;
+        explicit BucketMeta (char* addr, uint32_t cell_count) {
+            data_ = (((uint64_t)addr) << 16) | (__builtin_ctz (cell_count) << 8);
+        }
 
-        struct Version {
-            explicit Version (uint64_t data) : data_ (data) {}
-            explicit Version (uint8_t b, uint8_t bd, uint32_t seq)
-                : bitmap_ (b), bitmap_deleted_ (bd), seq_no_ (seq) {}
-            union {
-                struct {
-                    uint8_t bitmap_;
-                    uint8_t bitmap_deleted_;
-                    uint16_t _none;
-                    uint32_t seq_no_;
-                };
-                uint64_t data_;
-            };
+        BucketMeta () : data_ (0) {}
 
-            inline bool IsPosValid (int i) { return (bitmap_ & ~bitmap_deleted_ & (1 << i)) != 0; }
+        BucketMeta (const BucketMeta& a) = default;
 
-            bool operator== (const Version& v1) { return data_ == v1.data_; }
-            bool operator!= (const Version& v1) { return data_ != v1.data_; }
-        };
+        inline char* Address () { return (char*)(data_ >> 16); }
 
-        explicit CellMeta128 (char* rep)
-            // obtain the hash tags to meta_
-            : meta_ (_mm_set_pi64x (*reinterpret_cast<size_t*> (rep + 8))),
-              ver_ (LoadVersion (rep)) {}
+        inline uint32_t CellCountMask () { return CellCount () - 1; }
 
-        ~CellMeta128 () {}
+        inline uint32_t CellCount () { return (1 << ((data_ >> 8) & 0xFF)); }
 
-        static __m64 SetHashVec (uint16_t hash) { return _mm_set1_pi8 (hash); }
+        inline void Reset (char* addr, uint32_t cell_count) {
+            __atomic_store_n (&data_,
+                              (data_ & 0xE7) | (((uint64_t)addr) << 16) |
+                                  (__builtin_ctz (cell_count) << 8),
+                              __ATOMIC_RELEASE);
+        }
 
-        static inline Version LoadVersion (char* cell_addr) {
-            return Version (__atomic_load_n ((uint64_t*)cell_addr, __ATOMIC_ACQUIRE) &
-                            (0xFFFF'FFFF'0000'FEFELU));
+        // install the new cells of an incremental rehash, the old ones are kept in the
+        // bucket's BucketMigration until all their slots are moved
+        inline void ResetMigrating (char* addr, uint32_t cell_count) {
+            __atomic_store_n (&data_,
+                              (data_ & 0xFF) | (1 << 3) | (((uint64_t)addr) << 16) |
+                                  (__builtin_ctz (cell_count) << 8),
+                              __ATOMIC_RELEASE);
         }
 
-        static inline void StoreVersion (char* cell_addr, const Version& v) {
-            __atomic_store_n (reinterpret_cast<uint64_t*> (cell_addr), v.data_, __ATOMIC_RELEASE);
+        inline bool IsMigrating (void) { return data_ & (1 << 3); }
+
+        // taken and released through the BucketLock policy, see lockBucket
+        inline uint32_t* LockWord (void) { return (uint32_t*)(&data_); }
+
+        inline bool IsLocked (void) { return util::turbo_lockbusy ((uint32_t*)(&data_), 0); }
+
+        inline bool TryRehashLock (void) {
+            return util::turbo_bit_spin_try_lock ((uint32_t*)(&data_), 1);
         }
 
-        static inline SlotType* LocateSlot (char* cell_addr, int slot_i) {
-            return reinterpret_cast<SlotType*> (cell_addr + (slot_i << SlotSizeLeftShift));
+        inline void RehashLock (void) { util::turbo_bit_spin_lock ((uint32_t*)(&data_), 1); }
+
+        inline void RehashUnlock (void) { util::turbo_bit_spin_unlock ((uint32_t*)(&data_), 1); }
+
+        inline bool IsRehashLocked (void) { return util::turbo_lockbusy ((uint32_t*)(&data_), 1); }
+
+        // Set by a directory doubling, with the bucket lock held, after this bucket has been
+        // split into the next directory. A moved bucket is never written again.
+        inline void SetMoved (void) { __atomic_fetch_or (&data_, 1 << 2, __ATOMIC_RELEASE); }
+
+        inline bool IsMoved (void) { return data_ & (1 << 2); }
+
+        // Set, with the bucket lock held, while the slots of this bucket move within its
+        // cells, see rehashInPlace. Reset clears it, but keeps the count of rehashes in
+        // place this bumps, so that a compaction, which keeps the cell count, still changes
+        // the meta for SameCells.
+        inline void SetRehashingInPlace (void) {
+            uint64_t data = __atomic_load_n (&data_, __ATOMIC_RELAXED);
+            uint64_t next;
+            do {
+                next = (data & ~0xE0LU) | ((data + (1 << 5)) & 0xE0) | (1 << 4);
+            } while (!__atomic_compare_exchange_n (&data_, &data, next, true, __ATOMIC_RELEASE,
+                                                   __ATOMIC_RELAXED));
         }
 
-        static inline H2Tag* LocateH2Tag (char* cell_addr, int slot_i) {
-            return reinterpret_cast<H2Tag*> (cell_addr + 8) + slot_i;
+        inline bool IsRehashingInPlace (void) { return data_ & (1 << 4); }
+
+        // the same cells and flags as meta, the bucket lock and rehash lock aside
+        inline bool SameCells (const BucketMeta& meta) const {
+            return ((data_ ^ meta.data_) & ~3LU) == 0;
         }
 
-        inline Version GetVersion () { return ver_; }
+        // read address, cell count and flags in one load
+        inline BucketMeta Load (void) const {
+            BucketMeta meta;
+            meta.data_ = __atomic_load_n (&data_, __ATOMIC_ACQUIRE);
+            return meta;
+        }
 
-        inline util::BitSet MatchBitSet (const __m64& hash_vec) {
-            auto compare_res = _mm_cmpeq_pi8 (hash_vec, meta_);
-            uint8_t mask = _mm_movemask_pi8 (compare_res);
-            return util::BitSet (mask & ver_.bitmap_ & ~ver_.bitmap_deleted_ & BitMapMask);
+        // LSB
+        // | 1 b bucket lock | 1 b rehash lock | 1 b moved | 1 b migrating |
+        // 1 b rehashing in place | 3 b rehashes in place |
+        // 8 b cell mask | 48 b address |
+        // The bucket lock is taken by rehash and the other changes of the whole bucket,
+        // writers of single keys lock cells, see BucketLockScope.
+        uint64_t data_;
+    };
+
+    /** BucketMigration
+     *  @note: the old cells of a bucket under incremental rehash. Writers of the bucket
+     *         move 'old_addr' cells to the bucket's new cells a few at a time, starting
+     *         with the cells their own key probes. 'cursor' is the next old cell to move.
+     */
+    struct BucketMigration {
+        char* old_addr;
+        uint32_t old_cell_count;
+        char* new_addr;
+        uint32_t cursor;
+    };
+
+    /** Directory
+     *  @note: the bucket directory. A doubling builds a directory with twice the buckets,
+     *         reachable through 'next' while the buckets are being split, and then replaces
+     *         the current one as a whole.
+     */
+    struct Directory {
+        explicit Directory (size_t count)
+            : buckets (nullptr),
+              migrations (nullptr),
+              lock_queues (nullptr),
+              bucket_count (count),
+              bucket_mask (count - 1),
+              next (nullptr) {}
+
+        inline uint32_t BucketIndex (uint64_t bucket_hash) const {
+            return bucket_hash & bucket_mask;
         }
 
-        inline util::BitSet EraseBitSet () {
-            return util::BitSet (ver_.bitmap_deleted_ & BitMapMask);
+        inline BucketMeta* Bucket (uint32_t bi) const { return &buckets[bi]; }
+
+        inline LockQueue* BucketLockQueue (uint32_t bi) const {
+            return lock_queues == nullptr ? nullptr : &lock_queues[bi];
         }
 
-        inline util::BitSet BackupBitSet () { return util::BitSet (~ver_.bitmap_ & BitMapMask); }
+        // the bucket lookups read: the copy on the node of the calling thread, if any
+        inline BucketMeta* ReadBucket (uint32_t bi) const {
+            if (replicas.empty ()) {
+                return &buckets[bi];
+            }
+            return &replicas[util::ThreadNumaNode () % replicas.size ()][bi];
+        }
 
-        inline util::BitSet ValidBitSet () {
-            return util::BitSet (ver_.bitmap_ & ~ver_.bitmap_deleted_ & BitMapMask);
+        // copy bucket bi to the replicas after any change of its cells or flags
+        inline void Publish (uint32_t bi) {
+            for (BucketMeta* replica : replicas) {
+                __atomic_store_n (&replica[bi].data_, buckets[bi].Load ().data_,
+                                  __ATOMIC_RELEASE);
+            }
         }
 
-        inline bool IsDeleted (int i) { return (ver_.bitmap_deleted_ >> i) & 0x1; }
+        BucketMeta* buckets;
+        std::vector<BucketMeta*> replicas;          // one per node with NumaPolicy::kReplicate
+        std::atomic<BucketMigration*>* migrations;  // one per bucket, null if not migrating
+        LockQueue* lock_queues;  // one per bucket, null if the BucketLock policy keeps none
+        const size_t bucket_count;
+        const size_t bucket_mask;
+        std::atomic<Directory*> next;
+    };
 
-        inline bool Full () { return __builtin_popcount (ver_.bitmap_ & BitMapMask) == 6; }
+    // the write lock of a cell, a bit of its version word
+    static inline bool tryLockCell (char* cell_addr) {
+        return util::turbo_bit_spin_try_lock ((uint32_t*)cell_addr, CellMeta::kLockBitPos);
+    }
 
-        inline bool Occupy (int slot_index) { return ver_.bitmap_ & (1 << slot_index); }
+    static inline void lockCell (char* cell_addr) {
+        util::turbo_bit_spin_lock ((uint32_t*)cell_addr, CellMeta::kLockBitPos);
+    }
 
-        inline int OccupyCount () { return __builtin_popcount (ver_.bitmap_); }
+    static inline void unlockCell (char* cell_addr) {
+        util::turbo_bit_spin_unlock ((uint32_t*)cell_addr, CellMeta::kLockBitPos);
+    }
 
-        inline static constexpr uint8_t StartSlotPos () { return 1; }
+    // release a cell lock taken by lockBucketCell
+    class CellUnlockScope {
+    public:
+        explicit CellUnlockScope (char* cell_addr) : cell_addr_ (cell_addr) {}
 
-        inline static constexpr uint32_t CellSize () {
-            // cell size (include meta) in byte
-            return 128;
+        ~CellUnlockScope () { unlockCell (cell_addr_); }
+        char* cell_addr_;
+    };
+
+    /** BucketLockScope
+     *  @note: hold the bucket lock. Writers of single keys do not take it, they lock the
+     *         cells they write and wait while the bucket is locked, see insertSlotInCells.
+     *         So all the cells are locked too, until the bucket lock is released. Cells that
+     *         are replaced meanwhile are retired locked. A bucket under incremental rehash
+     *         is only written under its bucket lock, its cells are left alone, and so
+     *         are the read-only zero cells of a bucket not written yet.
+     */
+    class BucketLockScope {
+    public:
+        BucketLockScope (TurboHashTable& table, Directory* dir, uint32_t bi,
+                         ThreadInfo& thread_info)
+            : meta_ (dir->Bucket (bi)),
+              queue_ (dir->BucketLockQueue (bi)),
+              cells_ (nullptr),
+              cell_count_ (0) {
+            table.lockBucket (meta_, queue_, thread_info);
+            if (!meta_->IsMigrating () && !meta_->IsMoved () &&
+                !table.isZeroCells (meta_->Address ())) {
+                cells_ = meta_->Address ();
+                cell_count_ = meta_->CellCount ();
+                for (uint32_t i = 0; i < cell_count_; i++) {
+                    lockCell (cells_ + ((size_t)i << kCellSizeLeftShift));
+                }
+            }
         }
 
-        inline static constexpr uint32_t SlotMaxRange () { return 7; }
+        ~BucketLockScope () {
+            if (cells_ != nullptr && meta_->Address () == cells_) {
+                for (uint32_t i = 0; i < cell_count_; i++) {
+                    unlockCell (cells_ + ((size_t)i << kCellSizeLeftShift));
+                }
+            }
+            BucketLock::Unlock (meta_->LockWord (), 0, queue_);
+        }
+        BucketMeta* meta_;
+        LockQueue* queue_;
+        char* cells_;
+        uint32_t cell_count_;
+    };
 
-        inline static constexpr uint32_t SlotCount () {
-            // slot count
-            return 7;
+    // take the lock bit of a bucket through the BucketLock policy, counting the contention
+    // with TURBO_HASH_STATS
+    inline void lockBucket (BucketMeta* bucket_meta, LockQueue* queue, ThreadInfo& thread_info) {
+        uint32_t rounds = BucketLock::Lock (bucket_meta->LockWord (), 0, queue);
+        if constexpr (kTurboHashStats) {
+            ThreadStats& stats = threadStats (thread_info);
+            countStat (stats.bucket_locks);
+            if (rounds != 0) {
+                countStat (stats.bucket_contended);
+                countStat (stats.bucket_waits, rounds);
+            }
         }
+    }
 
-        inline static std::string Name () { return "CellMeta128"; }
+    /** ThreadStats
+     *  @note: the counters of TableStats that one registry slot of the Epoche, i.e. one
+     *         thread, keeps with TURBO_HASH_STATS. Only that thread writes them, so they
+     *         are added to without atomic instructions, see countStat.
+     */
+    struct alignas (64) ThreadStats {
+        std::atomic<size_t> find_probes[kProbeHistogramSize];
+        std::atomic<size_t> insert_probes[kProbeHistogramSize];
+        std::atomic<size_t> delete_probes[kProbeHistogramSize];
+        std::atomic<size_t> find_retries;
+        std::atomic<size_t> rehashes;
+        std::atomic<size_t> rehash_nanos;
+        std::atomic<size_t> rehash_bytes;
+        std::atomic<size_t> bucket_locks;  // see LockStats
+        std::atomic<size_t> bucket_contended;
+        std::atomic<size_t> bucket_waits;
+        std::atomic<size_t> cell_contended;
+    };
 
-        inline static constexpr size_t size () {
-            // the meta size in byte in current cell
-            return 16;
+    inline ThreadStats& threadStats (ThreadInfo& thread_info) {
+        return thread_stats_[thread_info.slot ()];
+    }
+
+    static inline void countStat (std::atomic<size_t>& counter, size_t n = 1) {
+        counter.store (counter.load (std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static inline void countProbes (std::atomic<size_t>* histogram, size_t probes) {
+        countStat (histogram[std::min<size_t> (probes, kProbeHistogramSize - 1)]);
+    }
+
+    // an insert into the slot of info, in a bucket of cell_count_mask + 1 cells, counted
+    // by the cells probed from the first cell of the key to the cell written
+    inline void countInsert (ThreadInfo& thread_info, const SlotInfo& info,
+                             uint32_t cell_count_mask) {
+        uint32_t first_cell = H1ToHash (info.H1) & cell_count_mask;
+        countProbes (threadStats (thread_info).insert_probes,
+                     ((info.cell - first_cell) & cell_count_mask) + 1);
+    }
+
+    /** Usage: iterator every slot in the bucket, return the pointer in the slot
+     *  BucketIterator<CellMeta> iter(bucket_addr, cell_count_);
+     *  while (iter.valid()) {
+     *      ...
+     *      ++iter;
+     *  }
+     */
+    class BucketIterator {
+    public:
+        struct InfoPair {
+            SlotInfo slot_info;
+            SlotType hash_slot;
+        };
+
+        BucketIterator (uint32_t bi, char* bucket_addr, size_t cell_count, size_t cell_i = 0)
+            : bi_ (bi),
+              cell_count_ (cell_count),
+              cell_i_ (cell_i),
+              bitmap_ (0),
+              bucket_addr_ (bucket_addr) {
+            assert (bucket_addr != 0);
+            CellMeta meta (bucket_addr);
+            bitmap_ = meta.ValidBitSet ();
+            if (!bitmap_) toNextValidBitMap ();
+            // printf("Initial Bucket iter at ai: %u, si: %u\n", cell_i_, *bitmap_);
         }
 
-        std::string BitMapToString () {
-            std::string res;
-            char buffer[1024];
-            uint64_t H2s[2];
-            memcpy (H2s, &meta_, 16);
-            sprintf (buffer, "bitmap: 0b%s, deleted: 0b%s - H2: 0x%016lx%016lx",
-                     print_binary (ver_.bitmap_).c_str (),
-                     print_binary (ver_.bitmap_deleted_).c_str (), H2s[1], H2s[0]);
-            return buffer;
+        explicit operator bool () const { return (cell_i_ < cell_count_); }
+
+        // ++iterator
+        inline BucketIterator& operator++ () {
+            ++bitmap_;
+            if (!bitmap_) {
+                toNextValidBitMap ();
+            }
+            return *this;
         }
 
-        std::string ToString () { return BitMapToString (); }
+        inline InfoPair operator* () const {
+            // return the cell index, slot index and its slot content
+            uint8_t slot_index = *bitmap_;
+            char* cell_addr = bucket_addr_ + cell_i_ * CellMeta::CellSize ();
+            HashSlot* slot = CellMeta::LocateSlot (cell_addr, slot_index);
+            H2Tag H2 = *CellMeta::LocateH2Tag (cell_addr, slot_index);
+            return {{bi_ /* ignore bucket index */, cell_i_ /* cell index */,
+                     *bitmap_ /* slot index*/, static_cast<H1Tag> (slot->H1), H2, false, 0},
+                    *slot};
+        }
 
-        std::string print_binary (uint16_t bitmap) {
-            char buffer[1024];
-            static std::string bit_rep[16] = {"0000", "0001", "0010", "0011", "0100", "0101",
-                                              "0110", "0111", "1000", "1001", "1010", "1011",
-                                              "1100", "1101", "1110", "1111"};
-            sprintf (buffer, "%s%s%s%s", bit_rep[(bitmap >> 12) & 0x0F].c_str (),
-                     bit_rep[(bitmap >> 8) & 0x0F].c_str (), bit_rep[(bitmap >> 4) & 0x0F].c_str (),
-                     bit_rep[(bitmap >> 0) & 0x0F].c_str ());
+        inline bool valid () { return cell_i_ < cell_count_ && (bitmap_ ? true : false); }
+
+        std::string ToString () {
+            char buffer[128];
+            sprintf (buffer, "cell: %8d, slot: %2d", cell_i_, *bitmap_);
             return buffer;
         }
 
-        __m64 meta_;  // 8 byte integer vector
-        Version ver_;
-
-    };  // end of class CellMeta128
+    private:
+        inline void toNextValidBitMap () {
+            while (!bitmap_ && cell_i_ < cell_count_) {
+                cell_i_++;
+                if (cell_i_ == cell_count_) return;
+                char* cell_addr = bucket_addr_ + (cell_i_ << CellMeta::CellSizeLeftShift);
+                CellMeta meta (cell_addr);
+                bitmap_ = meta.ValidBitSet ();
+            }
+        }
 
-    /** ProbeWithinBucket
-     *  @note: probe within a bucket
-     */
-    class ProbeWithinBucket {
-    public:
-        static const int MAX_PROBE_LEN = kTurboMaxProbeLen;
-        static const int PROBE_STEP = kTurboProbeStep;
-        ProbeWithinBucket (uint64_t initial_hash, uint32_t cell_count_mask, uint32_t bucket_i) {
-            h_ = initial_hash;
-            cell_count_mask_ = cell_count_mask;
-            cell_index_ = h_ & cell_count_mask_;
-            bucket_i_ = bucket_i;
-            probe_count_ = 0;
+        friend bool operator== (const BucketIterator& a, const BucketIterator& b) {
+            return a.cell_i_ == b.cell_i_ && a.bitmap_ == b.bitmap_;
         }
 
-        inline void reset () {
-            cell_index_ = h_ & cell_count_mask_;
-            probe_count_ = 0;
+        friend bool operator!= (const BucketIterator& a, const BucketIterator& b) {
+            return a.cell_i_ != b.cell_i_ || a.bitmap_ != b.bitmap_;
         }
 
-        // indicate whether we have already probed all the assocaite cells
-        inline operator bool () const { return probe_count_ <= cell_count_mask_; }
+        uint32_t bi_;
+        uint32_t cell_count_;
+        uint32_t cell_i_;
+        util::BitSet bitmap_;
+        char* bucket_addr_;
+    };
 
-        inline void next () {
-            cell_index_ += PROBE_STEP;
-            // CellCountMask should be like 0b11
-            cell_index_ &= cell_count_mask_;
-            probe_count_++;
+public:
+    explicit TurboHashTable (uint32_t bucket_count = 128 << 10, uint32_t cell_count = 32,
+                             const NumaOptions& numa_options = NumaOptions ())
+        : numa_options_ (numa_options),
+          capacity_ (bucket_count * cell_count * (CellMeta::SlotCount () - 1)) {
+        if (!util::isPowerOfTwo (bucket_count) || !util::isPowerOfTwo (cell_count)) {
+            printf ("the hash table size setting is wrong. bucket: %u, cell: %u\n", bucket_count,
+                    cell_count);
+            exit (1);
+        }
+        if (numa_options_.node_count <= 0) {
+            numa_options_.node_count = util::NumaNodeCount ();
+        }
+        numa_options_.node_count = std::min (numa_options_.node_count, util::kMaxNumaNodes);
+
+        // every bucket starts on the shared zero cells, and gets cells of its own on the
+        // first write, see materializeBucket
+        zero_cells_ = (char*)mmap (nullptr, kZeroCellsSize, PROT_READ,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (zero_cells_ == MAP_FAILED) {
+            perror ("mmap zero cells fail\n");
+            exit (1);
+        }
+        Directory* dir = newDirectory (bucket_count);
+        for (size_t i = 0; i < bucket_count; ++i) {
+            dir->Bucket (i)->Reset (zero_cells_, cell_count);
+            dir->Publish (i);
         }
+        directory_.store (dir, std::memory_order_release);
 
-        inline std::pair<uint32_t, uint32_t> offset () { return {bucket_i_, cell_index_}; }
+        retire_cells_kind_ = epoche_.registerRetireKind (releaseCellsBatch, this);
+        retire_records_kind_ = epoche_.registerRetireKind (releaseRecordsBatch, this);
+        if constexpr (kTurboHashStats) {
+            thread_stats_.reset (new ThreadStats[TURBO_EPOCHE_MAX_THREADS] ());
+        }
+    }
 
-        static std::string name () { return "ProbeWithinBucket"; }
+    template <bool should_free>
+    typename std::enable_if<should_free == true>::type releaseAllRecords () {
+        IterateAllCallback ([this] (char* addr) {
+            if (!InlineEntry::IsInline (addr)) {
+                record_allocator_.Release (ExpiringEntry::Block (addr));
+            }
+        });
+    }
 
-    private:
-        uint64_t h_;
-        uint32_t cell_count_mask_;
-        uint32_t cell_index_;
-        uint32_t bucket_i_;
-        uint32_t probe_count_;
-    };
+    template <bool should_free>
+    typename std::enable_if<should_free == false>::type releaseAllRecords () {}
 
-    static_assert (__builtin_popcount (kCellCountLimit) == 1,
-                   "kCellCountLimit should be power of two");
-    static_assert (kCellCountLimit <= kTurboCellCountLimit,
-                   "kCellCountLimit needs to be <= kTurboCellCountLimit");
+    void ReleaseRecords () { releaseAllRecords<!is_key_flat || !is_value_flat> (); }
 
-    using CellMeta = CellMeta128;
-    using WHash = WrapHash<Hash>;
-    using WKeyEqual = WrapKeyEqual<KeyEqual>;
+    ~TurboHashTable () {
+        StopMaintenance ();
+        Directory* dir = currentDirectory ();
+        auto thread_info = getThreadInfo ();
+        for (size_t b = 0; b < dir->bucket_count; b++) {
+            if (dir->Bucket (b)->IsMigrating ()) {
+                finishMigration (dir, b, thread_info);
+            }
+        }
+        ReleaseRecords ();
+        releaseDirectory (currentDirectory ());
+        munmap (zero_cells_, kZeroCellsSize);
+    }
 
-    static_assert (sizeof (HashSlot) == 16, "HashSlot size error.");
-    /** SlotInfo
-     *  @note: use to store the target slot location info
+    /** MinorReHashAll
+     *  @note: not thread safe. This global rehashing will double the hash table
+     * capacity.
+     *  !
      */
-    class SlotInfo {
-    public:
-        uint32_t bucket;   // bucket index
-        uint32_t cell;     // cell index
-        uint8_t slot;      // slot index
-        uint8_t old_slot;  // if equal_key, this save old slot position
-        H1Tag H1;          // hash-tag in HashSlot
-        H2Tag H2;          // hash-tag in CellMeta
-        bool equal_key;    // If we find a equal key in this slot
-        SlotInfo (uint32_t b, uint32_t a, int s, H1Tag h1, H2Tag h2, bool euqal, int os = 0)
-            : bucket (b), cell (a), slot (s), old_slot (os), H1 (h1), H2 (h2), equal_key (euqal) {}
-        SlotInfo ()
-            : bucket (0), cell (0), slot (0), old_slot (0), H1 (0), H2 (0), equal_key (false) {}
+    size_t MinorReHashAll (int threads = 4) { return rehashAll (threads, false); }
 
-        std::string ToString () {
-            std::ostringstream ss;
-            ss << "bi: " << bucket << ", ci: " << cell << ", si: " << slot << ", H2: " << H2
-               << ", H1: " << H1;
-            return ss.str ();
+    size_t GCAll (int threads = 4) { return rehashAll (threads, true); }
+
+    /** ShrinkToFit
+     *  @note: release the memory left behind by deletions. Every bucket whose live slots
+     *         stay below shrink_load_factor of half its capacity is rehashed to half its
+     *         cells, repeatedly, and its deleted slots are dropped. The buckets are locked
+     *         one at a time, so other threads may keep using the table. The old cells are
+     *         freed through the epoch manager. Return the number of cells released.
+     */
+    size_t ShrinkToFit (double shrink_load_factor = kBulkLoadFactor, int threads = 4) {
+        size_t bucket_count = BucketCount ();
+        threads = std::max (1, std::min (threads, (int)bucket_count));
+        std::atomic<size_t> released (0);
+        runInParallel (threads, [&] (int t) {
+            auto thread_info = getThreadInfo ();
+            size_t start_b = bucket_count / threads * t;
+            size_t end_b = (t == threads - 1) ? bucket_count : start_b + bucket_count / threads;
+            size_t counts = 0;
+            for (size_t b = start_b; b < end_b; ++b) {
+                counts += ShrinkBucket (b, thread_info, shrink_load_factor);
+            }
+            released.fetch_add (counts, std::memory_order_relaxed);
+        });
+        return released.load ();
+    }
+
+    /** ShrinkBucket
+     *  @note: shrink bucket bi of the current directory under its lock, see ShrinkToFit.
+     *         Return the number of cells released.
+     */
+    size_t ShrinkBucket (uint32_t bi, ThreadInfo& thread_info,
+                         double shrink_load_factor = kBulkLoadFactor) {
+        EpocheGuard epoche_guard (thread_info);
+        Directory* dir = currentDirectory ();
+        if (bi >= dir->bucket_count) {
+            return 0;
         }
-    };  // end of class SlotInfo
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        BucketLockScope meta_lock (*this, dir, bi, thread_info);
+        if (bucket_meta->IsMoved ()) {
+            // the bucket is being split by a directory doubling
+            return 0;
+        }
+        return shrinkBucket (dir, bi, shrink_load_factor, thread_info);
+    }
 
-    class CellAllocator {
-    public:
-        inline char* Allocate (size_t cell_count) {
-            size_t size = cell_count * kCellSize;
-            return static_cast<char*> (aligned_alloc (kCellSize, size));
+    /** BulkLoad
+     *  @note: load the records in [first, last), whose elements provide .first (key) and
+     *         .second (value), e.g. std::pair<Key, T>. Not thread safe: no other thread
+     *         may access the table during the load. The keys must be unique and must not
+     *         exist in the table yet.
+     *         A first pass counts the records of every bucket, so each bucket is resized
+     *         once to its final cell count. Then the cells are filled directly with the
+     *         same layout MinorRehash produces, without locks or version bumps.
+     *         Return the number of loaded records.
+     */
+    template <typename RandomIt>
+    size_t BulkLoad (RandomIt first, RandomIt last, int threads = 4) {
+        size_t n = last - first;
+        size_t bucket_count = BucketCount ();
+        threads = std::max (1, std::min (threads, (int)bucket_count));
+
+        // Pass 1. hash the keys and count the records of each bucket per thread
+        std::vector<size_t> hash_values (n);
+        std::vector<std::vector<size_t>> cursors (threads, std::vector<size_t> (bucket_count));
+        runInParallel (threads, [&] (int t) {
+            size_t start_i = n / threads * t;
+            size_t end_i = (t == threads - 1) ? n : start_i + n / threads;
+            for (size_t i = start_i; i < end_i; i++) {
+                hash_values[i] = KeyToHash (first[i].first);
+                cursors[t][bucketIndex (hash_values[i] >> 32)]++;
+            }
+        });
+
+        // turn the counts into the position each thread writes its records to, so that
+        // the records of a bucket are adjacent in 'order'
+        std::vector<size_t> bucket_start (bucket_count + 1, 0);
+        for (size_t b = 0; b < bucket_count; b++) {
+            size_t offset = bucket_start[b];
+            for (int t = 0; t < threads; t++) {
+                size_t count = cursors[t][b];
+                cursors[t][b] = offset;
+                offset += count;
+            }
+            bucket_start[b + 1] = offset;
         }
 
-        inline void Release (char* addr) { free (addr); }
+        // Pass 2. scatter the record indexes by bucket
+        std::vector<size_t> order (n);
+        runInParallel (threads, [&] (int t) {
+            size_t start_i = n / threads * t;
+            size_t end_i = (t == threads - 1) ? n : start_i + n / threads;
+            for (size_t i = start_i; i < end_i; i++) {
+                order[cursors[t][bucketIndex (hash_values[i] >> 32)]++] = i;
+            }
+        });
+
+        // Pass 3. fill every bucket
+        runInParallel (threads, [&] (int t) {
+            auto thread_info = getThreadInfo ();
+            size_t start_b = bucket_count / threads * t;
+            size_t end_b = (t == threads - 1) ? bucket_count : start_b + bucket_count / threads;
+            for (size_t b = start_b; b < end_b; b++) {
+                bulkLoadBucket (b, first, order.data () + bucket_start[b],
+                                bucket_start[b + 1] - bucket_start[b], hash_values, thread_info);
+            }
+        });
+        return n;
+    }
+
+    struct FindNextSlotInRehashResult {
+        uint32_t cell_index;
+        uint8_t slot_index;
     };
 
-    /** RecordAllocator
-     *  @note: allocate memory space for new record
-     */
-    class RecordAllocator {
-    public:
-        inline char* Allocate (size_t size) { return reinterpret_cast<char*> (malloc (size)); }
+    // find the cell index and slot index, return false if there is no valid slot
+    // within MAX_PROBE_LEN cells.
+    inline bool tryFindNextSlotInRehash (uint8_t* slot_vec, H1Tag h1, uint32_t cell_count_mask,
+                                         FindNextSlotInRehashResult& res) {
+        uint32_t ai = H1ToHash (h1) & cell_count_mask;
+        int loop_count = 0;
 
-        inline void Release (char* addr) { free (addr); }
-    };
+        // find next cell that is not full yet
+        uint32_t SLOT_MAX_RANGE = CellMeta::SlotMaxRange ();
+        while (slot_vec[ai] >= SLOT_MAX_RANGE) {
+            // because we use linear probe, if this cell is full, we go to next cell
+            ai += ProbeWithinBucket::PROBE_STEP;
+            loop_count++;
+            if TURBO_UNLIKELY (loop_count >= ProbeWithinBucket::MAX_PROBE_LEN) {
+                return false;
+            }
+            if (ai > cell_count_mask) {
+                ai &= cell_count_mask;
+            }
+        }
+        res = {ai, slot_vec[ai]++};
+        return true;
+    }
 
-    template <typename T1, bool key_flat, bool value_flat>
-    class DataRecord;
+    // return the cell index and slot index
+    inline FindNextSlotInRehashResult findNextSlotInRehash (uint8_t* slot_vec, H1Tag h1,
+                                                            uint32_t cell_count_mask) {
+        FindNextSlotInRehashResult res;
+        if TURBO_UNLIKELY (!tryFindNextSlotInRehash (slot_vec, h1, cell_count_mask, res)) {
+            printf (
+                "ERROR!!! Even we rehash this bucket, we cannot find a valid "
+                "slot within %d "
+                "probe\n",
+                ProbeWithinBucket::MAX_PROBE_LEN);
+            exit (1);
+        }
+        return res;
+    }
 
-    template <typename T1>
-    class DataRecord<T1, true, true> {
-    public:
-        DataRecord () = default;
-        explicit DataRecord (const H1Tag& k, const Entry& v) : key_ (k), val_ (v) {}
-        inline Key key () { return key_; }
-        inline T value () { return val_; }
+    size_t MinorRehash (int bi, ThreadInfo& thread_info, bool isgc = false) {
+        return minorRehash (currentDirectory (), bi, thread_info, isgc);
+    }
 
-    private:
-        Key key_;
-        T val_;
-    };
+    /** GrowDirectory
+     *  @note: double the bucket count. Every bucket is split, under its bucket lock, into
+     *         bucket i and i + bucket_count of the new directory, which selects between them
+     *         by one more bit of the bucket hash. Readers and writers keep working: a split
+     *         bucket is marked moved and redirects them to the new directory. Once all the
+     *         buckets are split the new directory replaces the old one, which is retired
+     *         through the epoch manager. Only one doubling runs at a time.
+     */
+    void GrowDirectory (ThreadInfo& thread_info) {
+        EpocheGuard epoche_guard (thread_info);
+        growDirectory (currentDirectory (), thread_info);
+    }
 
-    /**
-     * @brief both key and value is numeric type
-     * HashSlot:
-     *          | key | value |
+    size_t BucketCount () { return currentDirectory ()->bucket_count; }
+
+    /** NodeOfKey
+     *  @note: the node the cells of a key are placed on with NumaPolicy::kPartition, or
+     *         util::kNumaDefault with the other policies. A key keeps its node across
+     *         directory doublings when the node count is a power of two.
      */
-    template <typename T1>
-    struct SlotRecord<T1, true, true> : public HashSlot {
-        inline void Store (uint64_t hash, const Key& key, const T& value,
-                           RecordAllocator& allocator) {
-            HashSlot::H1 = key;
-            HashSlot::entry = value;
+    int NodeOfKey (const Key& key) {
+        if (numa_options_.policy != NumaPolicy::kPartition) {
+            return util::kNumaDefault;
         }
+        return bucketIndex (KeyToHash (key) >> 32) % numa_options_.node_count;
+    }
 
-        inline char* ReleaseAddress () { return nullptr; }
+    const NumaOptions& GetNumaOptions () const { return numa_options_; }
 
-        inline Key first (void) { return HashSlot::H1; }
+    /** SetIncrementalRehash
+     *  @note: when enabled, a full bucket is not rehashed at once under its lock. Its new
+     *         cells are installed next to the old ones, and every later write to the bucket
+     *         moves a few old cells, so the latency of a single insert stays bounded.
+     *         Lookups search both cell arrays until the migration finishes. Not used with
+     *         PIN_KEY_TO_THREAD.
+     */
+    void SetIncrementalRehash (bool enable) {
+#ifndef PIN_KEY_TO_THREAD
+        incremental_rehash_.store (enable, std::memory_order_relaxed);
+#endif
+    }
 
-        inline T second (void) { return HashSlot::entry; }
+    /** SetCacheMode
+     *  @note: turn the table into a cache of bounded memory. A bucket grows to at most
+     *         max_cell_count cells, and the directory is never doubled. An insert into a
+     *         full bucket of that size evicts a record of the cell the key probes first
+     *         instead, CLOCK style: Find sets a reference bit of the slot it hits, and the
+     *         eviction gives the referenced slots a second chance. 0 turns it off. Not
+     *         used with PIN_KEY_TO_THREAD.
+     */
+    void SetCacheMode (uint32_t max_cell_count) {
+#ifndef PIN_KEY_TO_THREAD
+        cache_cell_count_.store (std::min<uint32_t> (max_cell_count, kCellCountLimit),
+                                 std::memory_order_relaxed);
+#endif
+    }
 
-        inline Key compareKey (void) { return HashSlot::H1; }
+    // records evicted by inserts in cache mode
+    size_t Evictions () const { return evictions_.load (std::memory_order_relaxed); }
+
+    /** StartMaintenance
+     *  @note: start options.threads background threads that keep scanning the buckets.
+     *         They grow the buckets that are close to filling up, compact the buckets
+     *         that hold many deleted slots and finish pending incremental rehashes, each
+     *         under the bucket lock, so that inserts rarely have to rehash inline. A
+     *         bucket already at kCellCountLimit makes them double the directory instead.
+     *         They also drop the records PutWithTTL wrote that have expired, at most
+     *         options.expire_per_scan per scan and thread, each under its cell lock.
+     *         Restarts the threads if they are already running.
+     */
+    void StartMaintenance (const MaintenanceOptions& options = MaintenanceOptions ()) {
+        StopMaintenance ();
+        maintenance_options_ = options;
+        maintenance_options_.threads = std::max (1, options.threads);
+        maintenance_stop_ = false;
+        for (int t = 0; t < maintenance_options_.threads; t++) {
+            maintenance_threads_.emplace_back ([this, t] { maintenanceWorker (t); });
+        }
+    }
 
-        DataRecord<T1, true, true> Record () {
-            return DataRecord<T1, true, true>{HashSlot::H1, HashSlot::entry};
+    // stop the background maintenance threads and wait for them to exit
+    void StopMaintenance () {
+        {
+            std::lock_guard<std::mutex> lock (maintenance_mutex_);
+            maintenance_stop_ = true;
         }
-    };
+        maintenance_cv_.notify_all ();
+        for (auto& worker : maintenance_threads_) {
+            worker.join ();
+        }
+        maintenance_threads_.clear ();
+    }
 
-    template <typename T1>
-    class DataRecord<T1, true, false> {
-    public:
-        DataRecord () = default;
-        explicit DataRecord (const H1Tag& k, const Entry& ptr) : key_ (k), ptr_ (ptr) {}
-        inline Key key () { return key_; }
-        inline T value () { return DecodeInRecord2<true, false, false, Key, T>::Decode (ptr_); }
+    MaintenanceStats GetMaintenanceStats () {
+        MaintenanceStats stats;
+        stats.scans = maintenance_scans_.load (std::memory_order_relaxed);
+        stats.grown = maintenance_grown_.load (std::memory_order_relaxed);
+        stats.compacted = maintenance_compacted_.load (std::memory_order_relaxed);
+        stats.shrunk = maintenance_shrunk_.load (std::memory_order_relaxed);
+        stats.migrated = maintenance_migrated_.load (std::memory_order_relaxed);
+        stats.doubled = maintenance_doubled_.load (std::memory_order_relaxed);
+        stats.expired = maintenance_expired_.load (std::memory_order_relaxed);
+        return stats;
+    }
 
-    private:
-        Key key_;
-        Entry ptr_;
-    };
+    LockStats GetLockStats () const {
+        LockStats stats;
+        if constexpr (kTurboHashStats) {
+            auto relaxed = std::memory_order_relaxed;
+            for (size_t t = 0; t < TURBO_EPOCHE_MAX_THREADS; t++) {
+                ThreadStats& thread_stats = thread_stats_[t];
+                stats.bucket_locks += thread_stats.bucket_locks.load (relaxed);
+                stats.bucket_contended += thread_stats.bucket_contended.load (relaxed);
+                stats.bucket_waits += thread_stats.bucket_waits.load (relaxed);
+                stats.cell_contended += thread_stats.cell_contended.load (relaxed);
+            }
+        }
+        return stats;
+    }
 
-    /**
-     * @brief key is numeric, value is std::string
-     * HashSlot:
-     *          | key | pointer | -> | key | val_len | value
-     *                                     | size_t  | ...
+    /** GetTableStats
+     *  @note: sum the counters of all the threads, see TableStats. The bucket cell counts
+     *         are read from the bucket metas, one pass over the directory.
      */
-    template <typename T1>
-    struct SlotRecord<T1, true, false> : public HashSlot {
-        inline void Store (uint64_t hash, const Key& key, const T& value,
-                           RecordAllocator& allocator) {
-            size_t buf_len = Record2Format<true, false, Key, T>::Length (key, value);
-            char* addr = (char*)allocator.Allocate (buf_len);
-            EncodeToRecord2<true, false, Key, T>::Encode (key, value, addr);
-
-            HashSlot::H1 = key;
-            HashSlot::entry = addr;
+    TableStats GetTableStats () {
+        TableStats stats;
+        if constexpr (kTurboHashStats) {
+            auto relaxed = std::memory_order_relaxed;
+            for (size_t t = 0; t < TURBO_EPOCHE_MAX_THREADS; t++) {
+                ThreadStats& thread_stats = thread_stats_[t];
+                for (int i = 0; i < kProbeHistogramSize; i++) {
+                    stats.find_probes[i] += thread_stats.find_probes[i].load (relaxed);
+                    stats.insert_probes[i] += thread_stats.insert_probes[i].load (relaxed);
+                    stats.delete_probes[i] += thread_stats.delete_probes[i].load (relaxed);
+                }
+                stats.find_retries += thread_stats.find_retries.load (relaxed);
+                stats.rehashes += thread_stats.rehashes.load (relaxed);
+                stats.rehash_nanos += thread_stats.rehash_nanos.load (relaxed);
+                stats.rehash_bytes += thread_stats.rehash_bytes.load (relaxed);
+                stats.bucket_lock_waits += thread_stats.bucket_waits.load (relaxed);
+            }
+        }
+        epoche_.pending (stats.garbage_pending, stats.garbage_pending_bytes);
+
+        Directory* dir = currentDirectory ();
+        stats.bucket_cells.assign (__builtin_ctz (kCellCountLimit) + 1, 0);
+        for (size_t b = 0; b < dir->bucket_count; b++) {
+            BucketMeta bucket_meta = dir->ReadBucket (b)->Load ();
+            if (!bucket_meta.IsMoved ()) {
+                stats.bucket_cells[__builtin_ctz (bucket_meta.CellCount ())]++;
+            }
         }
+        return stats;
+    }
 
-        inline char* ReleaseAddress () { return HashSlot::entry; }
+    template <typename HashKey>
+    inline size_t KeyToHash (HashKey& key) {
+        using Mix =
+            typename std::conditional<std::is_same<::turbo::hash<Key>, hasher>::value,
+                                      ::turbo::identity_hash<size_t>, ::turbo::hash<size_t>>::type;
+        return Mix{}(WHash::operator() (key));
+    }
 
-        inline Key first (void) { return HashSlot::H1; }
+    template <typename K>
+    struct IdenticalReturn {
+        constexpr K operator() (K const& key) const noexcept { return key; }
+    };
 
-        inline T second (void) {
-            return DecodeInRecord2<true, false, false, Key, T>::Decode (HashSlot::entry);
-        }
+    // For CellMeta, H1 may be used to store real key,
+    // we need to calculate the real hash of h1 accordingly.
+    // If key is flat (store the real key), we need to hash h1.
+    inline size_t H1ToHash (H1Tag h1) {
+        using ToHash = typename std::conditional<is_key_flat, ::turbo::hash<size_t>,
+                                                 IdenticalReturn<H1Tag>>::type;
+        return ToHash{}(h1);
+    }
 
-        inline Key compareKey (void) { return HashSlot::H1; }
+    inline ThreadInfo getThreadInfo () { return ThreadInfo (this->epoche_); }
 
-        DataRecord<T1, true, false> Record () {
-            return DataRecord<T1, true, false>{HashSlot::H1, HashSlot::entry};
-        }
-    };
+    /** Put
+     *  @note: insert or update a key-value record, return false if fails.
+     */
+    bool Put (const Key& key, const T& value, ThreadInfo& thread_info) {
+        EpocheGuard epoche_guard (thread_info);
+        // calculate hash value of the key
+        size_t hash_value = KeyToHash (key);
+        // update index, thread safe
+        return insertSlot (key, hash_value, PutValue{value}, thread_info);
+    }
 
-    template <typename T1>
-    class DataRecord<T1, false, true> {
-    public:
-        DataRecord () = default;
-        explicit DataRecord (const H1Tag& k, const Entry& kvptr) : h1_ (k), ptr_ (kvptr) {}
-        inline Key key () { return DecodeInRecord2<false, true, true, Key, T>::Decode (ptr_); }
-        inline T value () { return DecodeInRecord2<false, true, false, Key, T>::Decode (ptr_); }
+    /** PutWithTTL
+     *  @note: like Put, but the record expires ttl_ms milliseconds from now. Lookups miss
+     *         an expired record, inserts reuse its slot and the maintenance threads drop
+     *         it, see MaintenanceOptions::expire_per_scan. Until then it is still counted
+     *         by Size. A later Put of the key clears the deadline. Records of a table whose
+     *         key and value are both flat live in their slots, so they cannot expire.
+     */
+    bool PutWithTTL (const Key& key, const T& value, uint64_t ttl_ms, ThreadInfo& thread_info) {
+        static_assert (!is_key_flat || !is_value_flat,
+                       "PutWithTTL needs a key or value that is not flat");
+        EpocheGuard epoche_guard (thread_info);
+        size_t hash_value = KeyToHash (key);
+        if (!expiring_records_.load (std::memory_order_relaxed)) {
+            expiring_records_.store (true, std::memory_order_relaxed);
+        }
+        // a deadline beyond the range of the clock saturates, the record never expires
+        uint64_t now = util::NowNanos ();
+        uint64_t deadline = ttl_ms < (std::numeric_limits<uint64_t>::max () - now) / 1000000
+                                ? now + ttl_ms * 1000000
+                                : std::numeric_limits<uint64_t>::max ();
+        return insertSlot (key, hash_value, PutValue{value}, thread_info, deadline);
+    }
 
-    private:
-        H1Tag h1_;
-        Entry ptr_;
-    };
-    /**
-     * @brief key is std::string, value is numeric
-     * HashSlot:
-     *          | H1 | pointer | -> | key_len | value | key_buffer
-     *                              | size_t  |   T   |  ...
+    /** InsertIfAbsent
+     *  @note: insert a key-value record only if the key is missing. If the key is there,
+     *         callback (RecordType) gets its record instead and nothing is allocated,
+     *         encoded or retired. A lock-free lookup answers first, the cells are only
+     *         locked when the key is not found. Return true if the record was inserted.
      */
-    template <typename T1>
-    struct SlotRecord<T1, false, true> : public HashSlot {
-        inline void Store (uint64_t hash, const Key& key, const T& value,
-                           RecordAllocator& allocator) {
-            size_t buf_len = Record2Format<false, true, Key, T>::Length (key, value);
-            char* addr = (char*)allocator.Allocate (buf_len);
-            EncodeToRecord2<false, true, Key, T>::Encode (key, value, addr);
+    template <typename Fn>
+    bool InsertIfAbsent (const Key& key, const T& value, ThreadInfo& thread_info,
+                         Fn&& callback) {
+        return TryEmplace (key, thread_info, std::forward<Fn> (callback), value);
+    }
 
-            HashSlot::H1 = hash;
-            HashSlot::entry = addr;
+    bool InsertIfAbsent (const Key& key, const T& value, ThreadInfo& thread_info) {
+        return InsertIfAbsent (key, value, thread_info, [] (RecordType record) {});
+    }
+
+    /** TryEmplace
+     *  @note: like InsertIfAbsent, but the value is only constructed from args when the
+     *         key is missing.
+     */
+    template <typename Fn, typename... Args>
+    bool TryEmplace (const Key& key, ThreadInfo& thread_info, Fn&& callback, Args&&... args) {
+        EpocheGuard epoche_guard (thread_info);
+        size_t hash_value = KeyToHash (key);
+        FindSlotResult res = findSlot (key, hash_value);
+        if (res.find) {
+            callback (res.record);
+            return false;
         }
+        std::optional<T> value;
+        bool inserted = false;
+        insertSlot (key, hash_value,
+                    [&] (char* cell_addr, SlotType* old_slot) -> const T* {
+                        inserted = old_slot == nullptr;
+                        if (!inserted) {
+                            // inserted by another thread meanwhile
+                            callback (old_slot->Record ());
+                            return nullptr;
+                        }
+                        if (!value) {
+                            value.emplace (std::forward<Args> (args)...);
+                        }
+                        return &*value;
+                    },
+                    thread_info);
+        return inserted;
+    }
 
-        inline char* ReleaseAddress () { return HashSlot::entry; }
+    /** Upsert
+     *  @note: read, modify and write the value of a key with a single probe under the
+     *         lock of its cells. update_or_init (T& value, bool found) gets the current value if
+     *         found, or T () if not, and changes it in place. The result is stored. If the
+     *         directory is doubled meanwhile, update_or_init may run again, and only its
+     *         last result is stored. Return true if the key was inserted.
+     */
+    template <typename Fn>
+    bool Upsert (const Key& key, Fn&& update_or_init, ThreadInfo& thread_info) {
+        EpocheGuard epoche_guard (thread_info);
+        size_t hash_value = KeyToHash (key);
+        T value;
+        bool inserted = false;
+        insertSlot (key, hash_value,
+                    [&] (char* cell_addr, SlotType* old_slot) -> const T* {
+                        inserted = old_slot == nullptr;
+                        value = inserted ? T () : old_slot->second ();
+                        update_or_init (value, !inserted);
+                        return &value;
+                    },
+                    thread_info);
+        return inserted;
+    }
 
-        inline Key first (void) {
-            return DecodeInRecord2<false, true, true, Key, T>::Decode (HashSlot::entry);
-        }
+    /** CompareExchange
+     *  @note: replace the value of a key with desired if it equals expected, otherwise
+     *         load the current value into expected. A missing key is not inserted and
+     *         leaves expected as is. Return true if the value was replaced.
+     */
+    bool CompareExchange (const Key& key, T& expected, const T& desired,
+                          ThreadInfo& thread_info) {
+        EpocheGuard epoche_guard (thread_info);
+        size_t hash_value = KeyToHash (key);
+        bool exchanged = false;
+        insertSlot (key, hash_value,
+                    [&] (char* cell_addr, SlotType* old_slot) -> const T* {
+                        if (old_slot == nullptr) {
+                            return nullptr;
+                        }
+                        T current = old_slot->second ();
+                        if (!(current == expected)) {
+                            expected = current;
+                            return nullptr;
+                        }
+                        exchanged = true;
+                        return &desired;
+                    },
+                    thread_info);
+        return exchanged;
+    }
 
-        inline T second (void) {
-            return DecodeInRecord2<false, true, false, Key, T>::Decode (HashSlot::entry);
-        }
+    /** FetchAdd
+     *  @note: add delta to the numeric value of a key, inserting delta if the key is
+     *         missing. Return the value before the addition, T () for a missing key.
+     *         The value is updated in place in its slot with an atomic store and a version
+     *         bump, so no new slot is written and nothing is retired. The cell is still
+     *         locked, because rehashes and the other writers copy slots under its lock.
+     */
+    T FetchAdd (const Key& key, T delta, ThreadInfo& thread_info) {
+        static_assert (is_key_flat && is_value_flat && std::is_arithmetic<T>::value,
+                       "FetchAdd needs a flat key and a numeric value");
+        EpocheGuard epoche_guard (thread_info);
+        size_t hash_value = KeyToHash (key);
+        T old_value = T ();
+        insertSlot (key, hash_value,
+                    [&] (char* cell_addr, SlotType* old_slot) -> const T* {
+                        if (old_slot == nullptr) {
+                            old_value = T ();
+                            return &delta;
+                        }
+                        old_value = old_slot->second ();
+                        T new_value = old_value + delta;
+                        __atomic_store (&old_slot->entry, &new_value, __ATOMIC_RELAXED);
+                        auto version = CellMeta::LoadVersion (cell_addr);
+                        version.seq_no_++;
+                        std::atomic_thread_fence (std::memory_order_release);
+                        CellMeta::StoreVersion (cell_addr, version);
+                        return nullptr;
+                    },
+                    thread_info);
+        return old_value;
+    }
 
-        inline util::Slice compareKey (void) {
-            return DecodeInRecord2<false, true, true, Key, T>::Decode (HashSlot::entry);
+    /** PutBatch
+     *  @note: insert or update n key-value records. The keys are grouped by bucket, so
+     *         every bucket lock is taken once for all of its keys. The bucket is first
+     *         grown at once to the cells its keys need, see presizeBucket, then the first
+     *         cells they probe are prefetched before they are written. Keys of a bucket
+     *         that has been split or cannot grow any more are written one by one as by
+     *         Put. If a key appears more than once, the last value wins. Return false if
+     *         fails.
+     */
+    bool PutBatch (const Key* keys, const T* values, size_t n, ThreadInfo& thread_info) {
+        EpocheGuard epoche_guard (thread_info);
+        Directory* dir = currentDirectory ();
+        std::vector<size_t> hash_values (n);
+        // (bucket index, key index), sorted so that keys of a bucket are adjacent and
+        // keep their original order
+        std::vector<std::pair<uint32_t, size_t>> order (n);
+        for (size_t i = 0; i < n; i++) {
+            hash_values[i] = KeyToHash (keys[i]);
+            order[i] = {dir->BucketIndex (hash_values[i] >> 32), i};
         }
+        std::sort (order.begin (), order.end ());
+
+        size_t i = 0;
+        while (i < n) {
+            uint32_t bucket_i = order[i].first;
+            size_t end = i;
+            while (end < n && order[end].first == bucket_i) {
+                end++;
+            }
+            if (end < n) {
+                __builtin_prefetch (dir->Bucket (order[end].first));
+            }
 
-        DataRecord<T1, false, true> Record () {
-            return DataRecord<T1, false, true>{HashSlot::H1, HashSlot::entry};
+            size_t written = i;
+            {
+                // Obtain the bucket lock once for all the keys in this bucket
+                BucketLockScope meta_lock (*this, dir, bucket_i, thread_info);
+                BucketMeta* bucket_meta = dir->Bucket (bucket_i);
+                if (!bucket_meta->IsMoved ()) {
+                    presizeBucket (dir, bucket_i, end - i, thread_info);
+                    for (size_t p = i; p < end; p++) {
+                        size_t k = order[p].second;
+                        PartialHash partial_hash (keys[k], hash_values[k]);
+                        uint32_t cell_i =
+                            H1ToHash (partial_hash.H1_) & bucket_meta->CellCountMask ();
+                        prefetchCell (locateCell (bucket_meta->Address (), {bucket_i, cell_i}));
+                    }
+                    for (; written < end; written++) {
+                        size_t k = order[written].second;
+                        PartialHash partial_hash (keys[k], hash_values[k]);
+                        PutValue put_value{values[k]};
+                        if (!insertSlotLocked (dir, keys[k], hash_values[k], partial_hash,
+                                               put_value, thread_info, 0)) {
+                            break;
+                        }
+                    }
+                }
+            }
+            for (; written < end; written++) {
+                size_t k = order[written].second;
+                insertSlot (keys[k], hash_values[k], PutValue{values[k]}, thread_info);
+            }
+            i = end;
         }
-    };
+        return true;
+    }
 
-    template <typename T1>
-    class DataRecord<T1, false, false> {
-    public:
-        DataRecord () = default;
-        explicit DataRecord (const H1Tag& k, const Entry& kvptr) : h1_ (k), ptr_ (kvptr) {}
-        inline Key key () { return DecodeInRecord2<false, false, true, Key, T>::Decode (ptr_); }
-        inline T value () { return DecodeInRecord2<false, false, false, Key, T>::Decode (ptr_); }
+    template <typename Fn>
+    bool Find (const Key& key, ThreadInfo& thread_info, Fn&& callback) {
+        EpocheGuardReadonly epoche_guard (thread_info);
+        // calculate hash value of the key
+        size_t hash_value = KeyToHash (key);
+        FindSlotResult res = TURBO_UNLIKELY (cache_cell_count_.load (std::memory_order_relaxed))
+                                 ? findSlot<true> (key, hash_value)
+                                 : findSlot (key, hash_value);
+        if constexpr (kTurboHashStats) {
+            countFind (thread_info, res);
+        }
+        if (res.find) {
+            callback (res.record);
+            return true;
+        }
+        return false;
+    }
 
-    private:
-        H1Tag h1_;
-        Entry ptr_;
-    };
-    /**
-     * @brief key and value both are std::string
-     * HashSlot:
-     *          | H1 | pointer | -> | key_len | value_len | key_buf | value_buf
-     *                              | size_t  |  size_t   |  ...    |  ...
-     *
+    /** FindBatch
+     *  @note: look up n keys as a group. All keys of a group are hashed first, then
+     *         their bucket metas and first probed cells are prefetched, so the cache
+     *         misses of the group overlap instead of being paid one key after another.
+     *         callback (i, record) is called for every keys[i] that is found.
+     *         Return the number of keys found.
      */
-    template <typename T1>
-    struct SlotRecord<T1, false, false> : public HashSlot {
-        inline void Store (uint64_t hash, const Key& key, const T& value,
-                           RecordAllocator& allocator) {
-            size_t buf_len = Record2Format<false, false, Key, T>::Length (key, value);
-            char* addr = (char*)allocator.Allocate (buf_len);
-            EncodeToRecord2<false, false, Key, T>::Encode (key, value, addr);
-
-            HashSlot::H1 = hash;
-            HashSlot::entry = addr;
-        }
+    template <typename Fn>
+    size_t FindBatch (const Key* keys, size_t n, ThreadInfo& thread_info, Fn&& callback) {
+        EpocheGuardReadonly epoche_guard (thread_info);
+        size_t find = 0;
+        size_t hash_values[kFindBatchGroup];
+        for (size_t start = 0; start < n; start += kFindBatchGroup) {
+            const Key* group = keys + start;
+            size_t count = std::min (n - start, kFindBatchGroup);
+
+            // Stage 1. hash all the keys and prefetch their bucket meta
+            Directory* dir = currentDirectory ();
+            for (size_t i = 0; i < count; i++) {
+                hash_values[i] = KeyToHash (group[i]);
+                __builtin_prefetch (dir->ReadBucket (dir->BucketIndex (hash_values[i] >> 32)));
+            }
 
-        inline char* ReleaseAddress () { return HashSlot::entry; }
+            // Stage 2. locate the first probed cell of each key and prefetch it
+            for (size_t i = 0; i < count; i++) {
+                PartialHash partial_hash (group[i], hash_values[i]);
+                BucketMeta bucket_meta =
+                    dir->ReadBucket (dir->BucketIndex (partial_hash.bucket_hash_))->Load ();
+                uint32_t cell_i = H1ToHash (partial_hash.H1_) & bucket_meta.CellCountMask ();
+                prefetchCell (locateCell (bucket_meta.Address (), {0, cell_i}));
+            }
 
-        inline Key first (void) {
-            return DecodeInRecord2<false, false, true, Key, T>::Decode (HashSlot::entry);
+            // Stage 3. probe, the bucket meta and first cells are in cache by now
+            for (size_t i = 0; i < count; i++) {
+                FindSlotResult res = findSlot (group[i], hash_values[i]);
+                if constexpr (kTurboHashStats) {
+                    countFind (thread_info, res);
+                }
+                if (res.find) {
+                    callback (start + i, res.record);
+                    find++;
+                }
+            }
         }
+        return find;
+    }
 
-        inline T second (void) {
-            return DecodeInRecord2<false, false, false, Key, T>::Decode (HashSlot::entry);
-        }
+    bool Delete (const Key& key, ThreadInfo& thread_info) {
+        EpocheGuard epoche_guard (thread_info);
+        // calculate hash value of the key
+        size_t hash_value = KeyToHash (key);
+        return deleteSlot (key, hash_value, thread_info);
+    }
 
-        inline util::Slice compareKey (void) {
-            return DecodeInRecord2<false, false, true, Key, T>::Decode (HashSlot::entry);
-        }
+    double LoadFactor () {
+        return (double)size_.Load () / capacity_.load (std::memory_order_relaxed);
+    }
 
-        DataRecord<T1, false, false> Record () {
-            return DataRecord<T1, false, false>{HashSlot::H1, HashSlot::entry};
-        }
-    };
+    size_t Capacity () { return capacity_.load (); }
 
-    using RecordType = DataRecord<Key, is_key_flat, is_value_flat>;
+    size_t Size () { return size_.Load (); }
 
-    /** BucketMeta
-     *  @note: a 8-byte
-     */
-    class BucketMeta {
-    public:
-        explicit BucketMeta (char* addr, uint32_t cell_count) {
-            data_ = (((uint64_t)addr) << 16) | (__builtin_ctz (cell_count) << 8);
+    void IterateValidBucket () {
+        printf ("Iterate Valid Bucket\n");
+        for (size_t i = 0; i < BucketCount (); ++i) {
+            auto& bucket_meta = locateBucket (i);
+            BucketIterator iter (i, bucket_meta.Address (), bucket_meta.info.cell_count);
+            if (iter.valid ()) {
+                printf ("%s\n", PrintBucketMeta (i).c_str ());
+            }
         }
+    }
 
-        BucketMeta () : data_ (0) {}
+    void IterateBucket (uint32_t i) {
+        auto& bucket_meta = locateBucket (i);
+        BucketIterator iter (i, bucket_meta.Address (), bucket_meta.CellCount ());
+        while (iter.valid ()) {
+            auto res = (*iter);
+            SlotInfo& info = res.first;
+            info.bucket = i;
+            HashSlot& slot = res.second;
+            SlotType* record = &slot;
+            std::cout << info.ToString () << ", addr: " << (void*)slot._[1]
+                      << ". key: " << record->first () << ", value: " << record->second ()
+                      << std::endl;
+            ++iter;
+        }
+    }
 
-        BucketMeta (const BucketMeta& a) = default;
+    void IterateAll () {
+        size_t count = 0;
+        for (size_t i = 0; i < BucketCount (); ++i) {
+            BucketMeta* bucket_meta = locateBucket (i);
+            BucketIterator iter (i, bucket_meta->Address (), bucket_meta->CellCount ());
+            while (iter.valid ()) {
+                auto res = (*iter);
+                SlotInfo& info = res.slot_info;
+                HashSlot& slot = res.hash_slot;
+                SlotType* record = reinterpret_cast<SlotType*> (&slot);
+                std::cout << info.ToString () << ", addr: " << (void*)slot._[1]
+                          << ". key: " << record->first () << ", value: " << record->second ()
+                          << std::endl;
+                ++iter;
+                count++;
+            }
+        }
+        printf ("iterato %lu entries. total size: %lu\n", count, Size ());
+    }
 
-        inline char* Address () { return (char*)(data_ >> 16); }
+    template <typename Fn>
+    void IterateAllCallback (Fn&& callback) {
+        size_t threads = std::min (8LU, BucketCount ());
+        std::vector<std::thread> workers (threads);
+        for (size_t t = 0; t < threads; t++) {
+            workers[t] = std::thread ([&, t] {
+                size_t start_b = BucketCount () / threads * t;
+                size_t end_b = start_b + BucketCount () / threads;
+                size_t count = 0;
+                for (size_t i = start_b; i < end_b; ++i) {
+                    BucketMeta* bucket_meta = locateBucket (i);
+                    BucketIterator iter (i, bucket_meta->Address (), bucket_meta->CellCount ());
+                    while (iter.valid ()) {
+                        auto res = (*iter);
+                        auto& slot = res.hash_slot;
+                        callback (slot.entry);
+                        ++iter;
+                        count++;
+                    }
+                }
+            });
+        }
+        std::for_each (workers.begin (), workers.end (), [] (std::thread& t) { t.join (); });
 
-        inline uint32_t CellCountMask () { return CellCount () - 1; }
+        // printf ("iterato %lu entries. total size: %lu\n", count, Size ());
+    }
 
-        inline uint32_t CellCount () { return (1 << ((data_ >> 8) & 0xFF)); }
+    std::string ProbeStrategyName () { return ProbeWithinBucket::name (); }
 
-        inline void Reset (char* addr, uint32_t cell_count) {
-            data_ = (data_ & 0xFF) | (((uint64_t)addr) << 16) | (__builtin_ctz (cell_count) << 8);
+    std::string PrintBucketMeta (uint32_t bucket_i) {
+        std::string res;
+        char buffer[1024];
+        BucketMeta* bucket_meta = locateBucket (bucket_i);
+        char* search_bucket_addr = bucket_meta->Address ();
+        sprintf (buffer, "----- bucket %10u -----\n", bucket_i);
+        res += buffer;
+        ProbeWithinBucket probe (0, bucket_meta->CellCountMask (), bucket_i);
+        uint32_t i = 0;
+        int count_sum = 0;
+        while (probe) {
+            char* cell_addr = locateCell (search_bucket_addr, probe.offset ());
+            CellMeta meta (cell_addr);
+            int count = meta.OccupyCount ();
+            sprintf (buffer, "\t%4u - 0x%12lx: %s. Cell valid slot count: %d. ", i++,
+                     (uint64_t)cell_addr, meta.BitMapToString ().c_str (), count);
+            res += buffer;
+            auto valid_bitset = meta.ValidBitSet ();
+            for (int i : valid_bitset) {
+                std::ostringstream ss;
+                HashSlot* slot = CellMeta::LocateSlot (cell_addr, i);
+                ss << "s" << i << "H1: " << slot->H1 << ", ";
+                res += ss.str ();
+            }
+            res += "\n";
+            probe.next ();
+            count_sum += count;
         }
+        sprintf (buffer, "\tBucket %u: valid slot count: %d. Load factor: %f\n", bucket_i,
+                 count_sum,
+                 (double)count_sum / ((CellMeta::SlotCount () - 1) * bucket_meta->CellCount ()));
+        res += buffer;
+        return res;
+    }
 
-        inline bool TryLock (void) {
-            return util::turbo_bit_spin_try_lock ((uint32_t*)(&data_), 0);
+    std::string PrintLoadAndProbeLen (uint32_t bucket_i) {
+        std::string res;
+        char buffer[1024];
+        BucketMeta* bucket_meta = locateBucket (bucket_i);
+        char* search_bucket_addr = bucket_meta->Address ();
+        ProbeWithinBucket probe (0, bucket_meta->CellCountMask (), bucket_i);
+        uint32_t i = 0;
+        int count_sum = 0;
+        size_t probe_sum = 0;
+        size_t cur_probe = 0;
+        while (probe) {
+            char* cell_addr = locateCell (search_bucket_addr, probe.offset ());
+            CellMeta meta (cell_addr);
+            int count = meta.OccupyCount ();
+            if (count < meta.SlotCount () - 1) {
+                // not full
+                cur_probe = 0;
+            } else {
+                cur_probe++;
+            }
+            probe.next ();
+            count_sum += count;
+            probe_sum += cur_probe + 1;
         }
+        sprintf (buffer,
+                 "Bucket %u. Cell count: %d, valid slot count: %d. Load factor: %f "
+                 "Probe sum: %lu, "
+                 "Avg probe dis: %.2f",
+                 bucket_i, bucket_meta->CellCount (), count_sum,
+                 (double)count_sum / ((CellMeta::SlotCount () - 1) * bucket_meta->CellCount ()),
+                 probe_sum, (double)probe_sum / bucket_meta->CellCount ());
+        res += buffer;
+        return res;
+    }
 
-        inline void Lock (void) { util::turbo_bit_spin_lock ((uint32_t*)(&data_), 0); }
-
-        inline void Unlock (void) { util::turbo_bit_spin_unlock ((uint32_t*)(&data_), 0); }
+    void PrintAlProbeLen () {
+        for (size_t b = 0; b < BucketCount (); ++b) {
+            printf ("%s\n", PrintLoadAndProbeLen (b).c_str ());
+        }
+    }
 
-        inline bool IsLocked (void) { return util::turbo_lockbusy ((uint32_t*)(&data_), 0); }
+    void PrintAllMeta () {
+        for (size_t b = 0; b < BucketCount (); ++b) {
+            printf ("%s\n", PrintBucketMeta (b).c_str ());
+        }
+    }
 
-        inline bool TryRehashLock (void) {
-            return util::turbo_bit_spin_try_lock ((uint32_t*)(&data_), 1);
+    void PrintHashTable () {
+        for (int b = 0; b < BucketCount (); ++b) {
+            printf ("%s\n", PrintBucketMeta (b).c_str ());
         }
+    }
 
-        inline void RehashLock (void) { util::turbo_bit_spin_lock ((uint32_t*)(&data_), 1); }
+private:
+    inline Directory* currentDirectory () const {
+        return directory_.load (std::memory_order_acquire);
+    }
 
-        inline void RehashUnlock (void) { util::turbo_bit_spin_unlock ((uint32_t*)(&data_), 1); }
+    // bucket index and bucket in the current directory, for callers that do not run
+    // concurrently with a directory doubling
+    inline uint32_t bucketIndex (uint64_t hash) { return currentDirectory ()->BucketIndex (hash); }
 
-        inline bool IsRehashLocked (void) { return util::turbo_lockbusy ((uint32_t*)(&data_), 1); }
+    inline BucketMeta* locateBucket (uint32_t bi) const { return currentDirectory ()->Bucket (bi); }
 
-        // LSB
-        // | 1 b bucket lock | 1 b rehash lock | 6 b reserved | 8 b cell mask | 48 b address |
-        uint64_t data_;
-    };
+    // allocate the cells of bucket bi on the node the NUMA policy picks
+    inline char* allocateCells (size_t cell_count, uint32_t bi) {
+        int placement = util::kNumaDefault;
+        if (numa_options_.policy == NumaPolicy::kInterleave) {
+            placement = util::kNumaInterleave;
+        } else if (numa_options_.policy == NumaPolicy::kPartition) {
+            placement = bi % numa_options_.node_count;
+        }
+        return cell_allocator_.Allocate (cell_count * kCellSize, kCellSize, placement);
+    }
 
-    class BucketLockScope {
-    public:
-        BucketLockScope (BucketMeta* bucket_meta) : meta_ (bucket_meta) { meta_->Lock (); }
+    // whether a bucket still reads the shared zero cells, which are never written or freed
+    inline bool isZeroCells (char* bucket_addr) const { return bucket_addr == zero_cells_; }
 
-        ~BucketLockScope () { meta_->Unlock (); }
-        BucketMeta* meta_;
-    };
+    inline void releaseCells (char* bucket_addr) {
+        if (!isZeroCells (bucket_addr)) cell_allocator_.Release (bucket_addr);
+    }
 
-    /** Usage: iterator every slot in the bucket, return the pointer in the slot
-     *  BucketIterator<CellMeta> iter(bucket_addr, cell_count_);
-     *  while (iter.valid()) {
-     *      ...
-     *      ++iter;
-     *  }
-     */
-    class BucketIterator {
-    public:
-        struct InfoPair {
-            SlotInfo slot_info;
-            SlotType hash_slot;
-        };
+    inline void retireCells (char* bucket_addr, ThreadInfo& thread_info) {
+        if (!isZeroCells (bucket_addr)) {
+            epoche_.retire (bucket_addr, retire_cells_kind_, thread_info);
+        }
+    }
 
-        BucketIterator (uint32_t bi, char* bucket_addr, size_t cell_count, size_t cell_i = 0)
-            : bi_ (bi),
-              cell_count_ (cell_count),
-              cell_i_ (cell_i),
-              bitmap_ (0),
-              bucket_addr_ (bucket_addr) {
-            assert (bucket_addr != 0);
-            CellMeta meta (bucket_addr);
-            bitmap_ = meta.ValidBitSet ();
-            if (!bitmap_) toNextValidBitMap ();
-            // printf("Initial Bucket iter at ai: %u, si: %u\n", cell_i_, *bitmap_);
+    /** materializeBucket
+     *  @note: give bucket bi, which still reads the shared zero cells, zeroed cells of its
+     *         own before its first write. Readers of the zero cells see an empty bucket
+     *         either way. The caller holds the bucket lock.
+     */
+    void materializeBucket (Directory* dir, uint32_t bi) {
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        uint32_t cell_count = bucket_meta->CellCount ();
+        char* bucket_addr = allocateCells (cell_count, bi);
+        if (bucket_addr == nullptr) {
+            perror ("materialize alloc memory fail\n");
+            exit (1);
         }
+        memset (bucket_addr, 0, cell_count * kCellSize);
+        bucket_meta->Reset (bucket_addr, cell_count);
+        dir->Publish (bi);
+    }
 
-        explicit operator bool () const { return (cell_i_ < cell_count_); }
+    inline BucketMeta* allocateBucketMetas (size_t bucket_count, int placement) {
+        size_t bucket_meta_space = bucket_count * sizeof (BucketMeta);
+        char* addr = cell_allocator_.Allocate (bucket_meta_space, sizeof (BucketMeta), placement);
+        if (addr == nullptr) {
+            fprintf (stderr, "malloc %lu space fail.\n", bucket_meta_space);
+            exit (1);
+        }
+        memset (addr, 0, bucket_meta_space);
+        return (BucketMeta*)addr;
+    }
 
-        // ++iterator
-        inline BucketIterator& operator++ () {
-            ++bitmap_;
-            if (!bitmap_) {
-                toNextValidBitMap ();
+    // allocate a directory of bucket_count zeroed bucket metas
+    Directory* newDirectory (size_t bucket_count) {
+        Directory* dir = new Directory (bucket_count);
+        bool spread = numa_options_.policy == NumaPolicy::kInterleave ||
+                      numa_options_.policy == NumaPolicy::kPartition;
+        dir->buckets = allocateBucketMetas (
+            bucket_count, spread ? util::kNumaInterleave : util::kNumaDefault);
+        if (numa_options_.policy == NumaPolicy::kReplicate) {
+            for (int node = 0; node < numa_options_.node_count; node++) {
+                dir->replicas.push_back (allocateBucketMetas (bucket_count, node));
             }
-            return *this;
         }
-
-        inline InfoPair operator* () const {
-            // return the cell index, slot index and its slot content
-            uint8_t slot_index = *bitmap_;
-            char* cell_addr = bucket_addr_ + cell_i_ * CellMeta::CellSize ();
-            HashSlot* slot = CellMeta::LocateSlot (cell_addr, slot_index);
-            H2Tag H2 = *CellMeta::LocateH2Tag (cell_addr, slot_index);
-            return {{bi_ /* ignore bucket index */, cell_i_ /* cell index */,
-                     *bitmap_ /* slot index*/, static_cast<H1Tag> (slot->H1), H2, false, 0},
-                    *slot};
+        dir->migrations = new std::atomic<BucketMigration*>[bucket_count];
+        for (size_t b = 0; b < bucket_count; b++) {
+            dir->migrations[b].store (nullptr, std::memory_order_relaxed);
         }
-
-        inline bool valid () { return cell_i_ < cell_count_ && (bitmap_ ? true : false); }
-
-        std::string ToString () {
-            char buffer[128];
-            sprintf (buffer, "cell: %8d, slot: %2d", cell_i_, *bitmap_);
-            return buffer;
+        if (!std::is_empty<LockQueue>::value) {
+            dir->lock_queues = new LockQueue[bucket_count];
         }
+        return dir;
+    }
 
-    private:
-        inline void toNextValidBitMap () {
-            while (!bitmap_ && cell_i_ < cell_count_) {
-                cell_i_++;
-                if (cell_i_ == cell_count_) return;
-                char* cell_addr = bucket_addr_ + (cell_i_ << CellMeta::CellSizeLeftShift);
-                CellMeta meta (cell_addr);
-                bitmap_ = meta.ValidBitSet ();
-            }
+    // free the cells of every bucket and the directory itself. There must be no
+    // incremental rehash in progress.
+    void releaseDirectory (Directory* dir) {
+        for (size_t b = 0; b < dir->bucket_count; b++) {
+            releaseCells (dir->Bucket (b)->Address ());
         }
-
-        friend bool operator== (const BucketIterator& a, const BucketIterator& b) {
-            return a.cell_i_ == b.cell_i_ && a.bitmap_ == b.bitmap_;
+        cell_allocator_.Release ((char*)dir->buckets);
+        for (BucketMeta* replica : dir->replicas) {
+            cell_allocator_.Release ((char*)replica);
         }
+        delete[] dir->migrations;
+        delete[] dir->lock_queues;
+        delete dir;
+    }
 
-        friend bool operator!= (const BucketIterator& a, const BucketIterator& b) {
-            return a.cell_i_ != b.cell_i_ || a.bitmap_ != b.bitmap_;
+    // the full hash of a slot. A flat key is stored in H1 and hashed again, otherwise H1
+    // is the full hash.
+    inline size_t slotHash (H1Tag h1) {
+        if constexpr (is_key_flat) {
+            return KeyToHash (h1);
+        } else {
+            return h1;
         }
+    }
 
-        uint32_t bi_;
-        uint32_t cell_count_;
-        uint32_t cell_i_;
-        util::BitSet bitmap_;
-        char* bucket_addr_;
-    };
-
-public:
-    static constexpr int kSizeVecCount = 1 << 4;
-    explicit TurboHashTable (uint32_t bucket_count = 128 << 10, uint32_t cell_count = 32)
-        : bucket_count_ (bucket_count),
-          bucket_mask_ (bucket_count - 1),
-          capacity_ (bucket_count * cell_count * (CellMeta::SlotCount () - 1)),
-          size_ (0) {
-        if (!util::isPowerOfTwo (bucket_count) || !util::isPowerOfTwo (cell_count)) {
-            printf ("the hash table size setting is wrong. bucket: %u, cell: %u\n", bucket_count,
-                    cell_count);
-            exit (1);
+    void growDirectory (Directory* dir, ThreadInfo& thread_info) {
+        std::lock_guard<std::mutex> grow_lock (directory_mutex_);
+        if (currentDirectory () != dir) {
+            // another thread has doubled this directory
+            return;
         }
-
-        size_t bucket_meta_space = bucket_count * sizeof (BucketMeta);
-        BucketMeta* buckets_addr = nullptr;
-        buckets_addr = (BucketMeta*)aligned_alloc (sizeof (BucketMeta), bucket_meta_space);
-        if (buckets_addr == nullptr) {
-            fprintf (stderr, "malloc %lu space fail.\n", bucket_meta_space);
+        if (dir->bucket_count >= (1UL << 32)) {
+            printf ("Cannot double the bucket directory\n");
             exit (1);
         }
 
-        memset ((char*)buckets_addr, 0, bucket_meta_space);
-
-        buckets_ = buckets_addr;
-        for (size_t i = 0; i < bucket_count; ++i) {
-            uint32_t rnd_cell_count = cell_count;
-            char* addr = cell_allocator_.Allocate (rnd_cell_count);
-            memset (addr, 0, rnd_cell_count * kCellSize);
-            buckets_[i].Reset (addr, rnd_cell_count);
+        Directory* new_dir = newDirectory (dir->bucket_count << 1);
+        // publish the new directory to the threads that meet a moved bucket
+        dir->next.store (new_dir, std::memory_order_release);
+        for (size_t b = 0; b < dir->bucket_count; b++) {
+            splitBucket (dir, new_dir, b, thread_info);
         }
-    }
+        directory_.store (new_dir, std::memory_order_release);
 
-    template <bool should_free>
-    typename std::enable_if<should_free == true>::type releaseAllRecords () {
-        IterateAllCallback ([] (char* addr) { free (addr); });
+        // all the buckets of the old directory are moved, free it when no one reads it
+        epoche_.markNodeForDeletion ([=] () { releaseDirectory (dir); }, thread_info);
     }
 
-    template <bool should_free>
-    typename std::enable_if<should_free == false>::type releaseAllRecords () {}
+    /** splitBucket
+     *  @note: move the slots of bucket bi to bucket bi or bi + bucket_count of new_dir,
+     *         each with half of the cells, then mark bucket bi moved. The old cells are
+     *         left untouched for concurrent readers. A half without slots reads the zero
+     *         cells.
+     */
+    void splitBucket (Directory* dir, Directory* new_dir, uint32_t bi, ThreadInfo& thread_info) {
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        BucketLockScope meta_lock (*this, dir, bi, thread_info);
+        if (bucket_meta->IsMigrating ()) {
+            finishMigration (dir, bi, thread_info);
+        }
+        uint32_t old_cell_count = bucket_meta->CellCount ();
 
-    void ReleaseRecords () { releaseAllRecords<!is_key_flat || !is_value_flat> (); }
+        std::vector<typename BucketIterator::InfoPair> slots[2];
+        BucketIterator iter (bi, bucket_meta->Address (), old_cell_count);
+        while (iter.valid ()) {
+            typename BucketIterator::InfoPair res = *iter;
+            uint32_t new_bi = new_dir->BucketIndex (slotHash (res.slot_info.H1) >> 32);
+            slots[new_bi == bi ? 0 : 1].push_back (res);
+            ++iter;
+        }
 
-    ~TurboHashTable () {
-        ReleaseRecords ();
-        for (size_t b = 0; b < bucket_count_; b++) {
-            BucketMeta* bucket_meta = locateBucket (b);
-            char* addr = bucket_meta->Address ();
-            free (addr);
+        size_t new_cell_count_sum = 0;
+        std::vector<H1Tag> h1s;
+        std::vector<FindNextSlotInRehashResult> positions;
+        for (int half = 0; half < 2; half++) {
+            h1s.clear ();
+            for (auto& res : slots[half]) {
+                h1s.push_back (res.slot_info.H1);
+            }
+            uint32_t new_cell_count =
+                planRehashSlots (h1s.data (), h1s.size (), std::max (1U, old_cell_count >> 1),
+                                 positions);
+            uint32_t new_bi = bi + half * dir->bucket_count;
+            new_cell_count_sum += new_cell_count;
+            if (slots[half].empty ()) {
+                new_dir->Bucket (new_bi)->Reset (zero_cells_, new_cell_count);
+                new_dir->Publish (new_bi);
+                continue;
+            }
+            char* new_bucket_addr = allocateCells (new_cell_count, new_bi);
+            if (new_bucket_addr == nullptr) {
+                perror ("split alloc memory fail\n");
+                exit (1);
+            }
+            memset (new_bucket_addr, 0, new_cell_count * kCellSize);
+            for (size_t i = 0; i < slots[half].size (); i++) {
+                char* des_cell_addr =
+                    new_bucket_addr + (positions[i].cell_index << kCellSizeLeftShift);
+                moveSlot (des_cell_addr, positions[i].slot_index, slots[half][i].slot_info,
+                          slots[half][i].hash_slot);
+            }
+            new_dir->Bucket (new_bi)->Reset (new_bucket_addr, new_cell_count);
+            new_dir->Publish (new_bi);
         }
-        free (buckets_);
+
+        capacity_.fetch_add ((new_cell_count_sum - old_cell_count) *
+                             (CellMeta::SlotCount () - 1));
+        // the new buckets are complete before any thread is redirected to them
+        bucket_meta->SetMoved ();
+        dir->Publish (bi);
     }
 
-    /** MinorReHashAll
-     *  @note: not thread safe. This global rehashing will double the hash table
-     * capacity.
-     *  !
+    /** planRehashSlots
+     *  @note: plan the cell and slot each of the h1s lands in, in the layout MinorRehash
+     *         produces, for a bucket of at least cell_count cells. The cell count is doubled
+     *         until every slot fits within the probe limit. Return the cell count.
      */
-    size_t MinorReHashAll () {
-        // rehash for all the buckets
-        int rehash_thread = 4;
-        printf ("Rehash threads: %d\n", rehash_thread);
-        std::vector<std::thread> workers (rehash_thread);
-        std::vector<size_t> add_capacity (rehash_thread, 0);
-        std::atomic<size_t> rehash_count (0);
-        auto rehash_start = util::NowMicros ();
-        for (int t = 0; t < rehash_thread; t++) {
-            workers[t] = std::thread ([&, t] {
-                auto thread_info = getThreadInfo ();
-                size_t start_b = bucket_count_ / rehash_thread * t;
-                size_t end_b = start_b + bucket_count_ / rehash_thread;
-                size_t counts = 0;
-                for (size_t i = start_b; i < end_b; ++i) {
-                    counts += MinorRehash (i, thread_info);
-                }
-                rehash_count.fetch_add (counts, std::memory_order_relaxed);
-            });
+    uint32_t planRehashSlots (const H1Tag* h1s, size_t count, uint32_t cell_count,
+                              std::vector<FindNextSlotInRehashResult>& positions) {
+        positions.resize (count);
+        std::vector<uint8_t> slot_vec;
+        while (true) {
+            slot_vec.assign (cell_count, CellMeta::StartSlotPos ());
+            bool succ = true;
+            for (size_t i = 0; i < count && succ; i++) {
+                succ = tryFindNextSlotInRehash (slot_vec.data (), h1s[i], cell_count - 1,
+                                                positions[i]);
+            }
+            if (succ) return cell_count;
+            if (cell_count >= kCellCountLimit) {
+                printf ("Cannot place %lu slots in %u cells\n", count, cell_count);
+                exit (1);
+            }
+            cell_count <<= 1;
         }
-        std::for_each (workers.begin (), workers.end (), [] (std::thread& t) { t.join (); });
-        double rehash_duration = util::NowMicros () - rehash_start;
-        printf ("Real rehash speed: %f Mops/s. entries: %lu, duration: %.2f s.\n",
-                (double)rehash_count / rehash_duration, rehash_count.load (),
-                rehash_duration / 1000000.0);
-        return rehash_count.load ();
     }
 
-    size_t GCAll () {
-        // gc for all the buckets
-        int rehash_thread = 4;
-        printf ("Rehash threads: %d\n", rehash_thread);
-        std::vector<std::thread> workers (rehash_thread);
-        std::vector<size_t> add_capacity (rehash_thread, 0);
-        std::atomic<size_t> rehash_count (0);
-        auto rehash_start = util::NowMicros ();
-        for (int t = 0; t < rehash_thread; t++) {
-            workers[t] = std::thread ([&, t] {
-                auto thread_info = getThreadInfo ();
-                size_t start_b = bucket_count_ / rehash_thread * t;
-                size_t end_b = start_b + bucket_count_ / rehash_thread;
-                size_t counts = 0;
-                for (size_t i = start_b; i < end_b; ++i) {
-                    counts += MinorRehash (i, thread_info, true);
-                }
-                rehash_count.fetch_add (counts, std::memory_order_relaxed);
-            });
+    // offset.first: bucket index
+    // offset.second: cell index
+    inline char* locateCell (char* bucket_addr, const std::pair<size_t, size_t>& offset) {
+        return bucket_addr +                           // locate the bucket
+               (offset.second << kCellSizeLeftShift);  // locate the cell cell
+    }
+
+    // prefetch every cache line of the cell, meta and slots
+    inline void prefetchCell (char* cell_addr) {
+        for (int i = 0; i < kCellSize; i += kCacheLineSize) {
+            __builtin_prefetch (cell_addr + i);
         }
-        std::for_each (workers.begin (), workers.end (), [] (std::thread& t) { t.join (); });
-        double rehash_duration = util::NowMicros () - rehash_start;
-        printf ("Real rehash speed: %f Mops/s. entries: %lu, duration: %.2f s.\n",
-                (double)rehash_count / rehash_duration, rehash_count.load (),
-                rehash_duration / 1000000.0);
-        return rehash_count.load ();
     }
 
-    struct FindNextSlotInRehashResult {
-        uint32_t cell_index;
-        uint8_t slot_index;
-    };
+    // used in rehash function, move slot to new cell_addr
+    inline void moveSlot (char* des_cell_addr, uint8_t des_slot_i, const SlotInfo& old_info,
+                          const HashSlot& old_slot) {
+        // move slot content, including H1 and pointer
+        HashSlot* des_slot = CellMeta::LocateSlot (des_cell_addr, des_slot_i);
+        des_slot->entry = old_slot.entry;
+        des_slot->H1 = old_info.H1;
 
-    // return the cell index and slot index
-    inline FindNextSlotInRehashResult findNextSlotInRehash (uint8_t* slot_vec, H1Tag h1,
-                                                            uint32_t cell_count_mask) {
-        uint32_t ai = H1ToHash (h1) & cell_count_mask;
-        int loop_count = 0;
+        // locate H2 and set H2
+        H2Tag* h2_tag_ptr = CellMeta::LocateH2Tag (des_cell_addr, des_slot_i);
+        *h2_tag_ptr = old_info.H2;
 
-        // find next cell that is not full yet
-        uint32_t SLOT_MAX_RANGE = CellMeta::SlotMaxRange ();
-        while (slot_vec[ai] >= SLOT_MAX_RANGE) {
-            // because we use linear probe, if this cell is full, we go to next cell
-            ai += ProbeWithinBucket::PROBE_STEP;
-            loop_count++;
-            if TURBO_UNLIKELY (loop_count > ProbeWithinBucket::MAX_PROBE_LEN) {
-                printf (
-                    "ERROR!!! Even we rehash this bucket, we cannot find a valid "
-                    "slot within %d "
-                    "probe\n",
-                    ProbeWithinBucket::MAX_PROBE_LEN);
-                exit (1);
-            }
-            if (ai > cell_count_mask) {
-                ai &= cell_count_mask;
-            }
+        // obtain and set bitmap
+        decltype (CellMeta::Version::bitmap_)* bitmap =
+            (decltype (CellMeta::Version::bitmap_)*)des_cell_addr;
+        *bitmap = (*bitmap) | CellMeta::SlotBit (des_slot_i);
+    }
+
+    // rehash bucket bi to twice its cells, or compact it when isgc. Return the slots moved
+    size_t minorRehash (Directory* dir, uint32_t bi, ThreadInfo& thread_info, bool isgc = false) {
+        if constexpr (!kTurboHashStats) {
+            return rehashBucket (dir, bi, thread_info, isgc);
+        } else {
+            uint64_t start = util::NowNanos ();
+            size_t count = rehashBucket (dir, bi, thread_info, isgc);
+            ThreadStats& stats = threadStats (thread_info);
+            countStat (stats.rehashes);
+            countStat (stats.rehash_nanos, util::NowNanos () - start);
+            countStat (stats.rehash_bytes, count * sizeof (HashSlot));
+            return count;
         }
-        return {ai, slot_vec[ai]++};
     }
 
-    size_t MinorRehash (int bi, ThreadInfo& thread_info, bool isgc = false) {
+    size_t rehashBucket (Directory* dir, uint32_t bi, ThreadInfo& thread_info, bool isgc) {
         size_t count = 0;
-        BucketMeta* bucket_meta = locateBucket (bi);
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        if (bucket_meta->IsMigrating ()) {
+            finishMigration (dir, bi, thread_info);
+        }
 
         // Step 1. Create new bucket and initialize its meta
         uint32_t old_cell_count = bucket_meta->CellCount ();
         uint32_t new_cell_count = isgc ? old_cell_count : old_cell_count << 1;
         uint32_t new_cell_count_mask = new_cell_count - 1;
         char* old_bucket_addr = bucket_meta->Address ();
-        char* new_bucket_addr = cell_allocator_.Allocate (new_cell_count);
+        if (isZeroCells (old_bucket_addr) && new_cell_count <= kCellCountLimit) {
+            // a bucket not written yet only changes its cell count
+            capacity_.fetch_add ((new_cell_count - old_cell_count) * (CellMeta::SlotCount () - 1));
+            bucket_meta->Reset (zero_cells_, new_cell_count);
+            dir->Publish (bi);
+            return 0;
+        }
+        if constexpr (kRehashInPlace) {
+            if (new_cell_count <= kCellCountLimit &&
+                cell_allocator_.Expand (old_bucket_addr, new_cell_count * kCellSize) &&
+                rehashInPlace (dir, bi, new_cell_count, count)) {
+                capacity_.fetch_add ((new_cell_count - old_cell_count) *
+                                     (CellMeta::SlotCount () - 1));
+                return count;
+            }
+        }
+        char* new_bucket_addr = allocateCells (new_cell_count, bi);
 
         if (new_cell_count > kCellCountLimit) {
             printf ("Cannot rehash\n");
             exit (1);
         }
 
-        capacity_.fetch_add (old_cell_count * (CellMeta::SlotCount () - 1));
+        capacity_.fetch_add ((new_cell_count - old_cell_count) * (CellMeta::SlotCount () - 1));
 
         if (new_bucket_addr == nullptr) {
             perror ("rehash alloc memory fail\n");
@@ -1814,283 +4527,750 @@ public:
 
         // Step 3. Reset bucket meta in buckets_
         bucket_meta->Reset (new_bucket_addr, new_cell_count);
+        dir->Publish (bi);
 
         // Step 4. Garbage collection for old bucket.
-        epoche_.markNodeForDeletion ([=] () { free (old_bucket_addr); }, thread_info);
+        epoche_.retire (old_bucket_addr, retire_cells_kind_, thread_info,
+                        old_cell_count * kCellSize);
 
         free (slot_vec);
         return count;
     }
 
-    template <typename HashKey>
-    inline size_t KeyToHash (HashKey& key) {
-        using Mix =
-            typename std::conditional<std::is_same<::turbo::hash<Key>, hasher>::value,
-                                      ::turbo::identity_hash<size_t>, ::turbo::hash<size_t>>::type;
-        return Mix{}(WHash::operator() (key));
+    /** rehashInPlace
+     *  @note: rehash bucket bi to new_cell_count cells, its cells or twice them, within
+     *         its own cell array, which the cell allocator has expanded. The slots get the
+     *         layout MinorRehash produces. Their new positions are planned first, then each
+     *         slot is moved once, along the cycles of that permutation. Lookups that ran
+     *         meanwhile are retried, see cellsChanged. The caller holds the bucket lock.
+     *         Return false, and change nothing, if the slots do not fit the probe limit.
+     */
+    bool rehashInPlace (Directory* dir, uint32_t bi, uint32_t new_cell_count, size_t& count) {
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        char* bucket_addr = bucket_meta->Address ();
+        uint32_t old_cell_count = bucket_meta->CellCount ();
+
+        // Step 1. number the live slots in cell order and plan their new positions
+        std::vector<uint64_t> live (old_cell_count, 0);  // live slots of each old cell
+        std::vector<uint32_t> first (old_cell_count);    // number of the first of them
+        std::vector<uint32_t> dest;                      // new cell << 8 | new slot
+        std::vector<uint8_t> slot_vec (new_cell_count, CellMeta::StartSlotPos ());
+        for (uint32_t ci = 0; ci < old_cell_count; ci++) {
+            char* cell_addr = locateCell (bucket_addr, {bi, ci});
+            CellMeta meta (cell_addr);
+            first[ci] = dest.size ();
+            for (int si : meta.ValidBitSet ()) {
+                FindNextSlotInRehashResult res;
+                if (!tryFindNextSlotInRehash (slot_vec.data (),
+                                              CellMeta::LocateSlot (cell_addr, si)->H1,
+                                              new_cell_count - 1, res)) {
+                    return false;
+                }
+                live[ci] |= 1LU << si;
+                dest.push_back (res.cell_index << 8 | res.slot_index);
+            }
+        }
+        auto number = [&] (uint32_t ci, uint32_t si) {
+            return first[ci] + __builtin_popcountl (live[ci] & ((1LU << si) - 1));
+        };
+
+        // Step 2. tell the lookups, then zero the new cells
+        bucket_meta->SetRehashingInPlace ();
+        dir->Publish (bi);
+        std::atomic_thread_fence (std::memory_order_release);
+        memset (bucket_addr + (size_t)old_cell_count * kCellSize, 0,
+                (size_t)(new_cell_count - old_cell_count) * kCellSize);
+
+        // Step 3. carry every slot not moved yet to its position, and the slot found
+        // there on to its own position, until a free position ends the cycle
+        std::vector<uint64_t> pending (live);
+        for (uint32_t ci = 0; ci < old_cell_count; ci++) {
+            while (pending[ci] != 0) {
+                uint32_t si = __builtin_ctzl (pending[ci]);
+                pending[ci] &= pending[ci] - 1;
+                uint32_t i = number (ci, si);
+                char* cell_addr = locateCell (bucket_addr, {bi, ci});
+                HashSlot carry = *CellMeta::LocateSlot (cell_addr, si);
+                H2Tag carry_h2 = *CellMeta::LocateH2Tag (cell_addr, si);
+                while (true) {
+                    uint32_t des_ci = dest[i] >> 8;
+                    uint32_t des_si = dest[i] & 0xFF;
+                    char* des_cell_addr = locateCell (bucket_addr, {bi, des_ci});
+                    HashSlot* des_slot = CellMeta::LocateSlot (des_cell_addr, des_si);
+                    H2Tag* des_h2 = CellMeta::LocateH2Tag (des_cell_addr, des_si);
+                    bool occupied =
+                        des_ci < old_cell_count && (pending[des_ci] & (1LU << des_si)) != 0;
+                    HashSlot next = *des_slot;
+                    H2Tag next_h2 = *des_h2;
+                    des_slot->entry = carry.entry;
+                    des_slot->H1 = carry.H1;
+                    *des_h2 = carry_h2;
+                    if (!occupied) {
+                        break;
+                    }
+                    pending[des_ci] &= ~(1LU << des_si);
+                    i = number (des_ci, des_si);
+                    carry = next;
+                    carry_h2 = next_h2;
+                }
+            }
+        }
+
+        // Step 4. rebuild the bitmaps, the slots of a cell are packed from StartSlotPos.
+        // The remaining slots keep their stale contents, lookups still running may
+        // follow their entries until they retry.
+        for (uint32_t ci = 0; ci < new_cell_count; ci++) {
+            char* cell_addr = locateCell (bucket_addr, {bi, ci});
+            auto version = CellMeta::LoadVersion (cell_addr);
+            version.bitmap_ = 0;
+            version.bitmap_deleted_ = 0;
+            for (uint8_t si = CellMeta::StartSlotPos (); si < slot_vec[ci]; si++) {
+                version.bitmap_ |= CellMeta::SlotBit (si);
+            }
+            version.seq_no_++;
+            CellMeta::StoreVersion (cell_addr, version);
+        }
+
+        // Step 5. publish the new cell count, which ends the rehash for the lookups
+        bucket_meta->Reset (bucket_addr, new_cell_count);
+        dir->Publish (bi);
+        count = dest.size ();
+        return true;
     }
 
-    template <typename K>
-    struct IdenticalReturn {
-        constexpr K operator() (K const& key) const noexcept { return key; }
-    };
+    /** startMigration
+     *  @note: begin the incremental rehash of bucket bi to twice its cells. The caller
+     *         holds the bucket lock.
+     */
+    void startMigration (Directory* dir, uint32_t bi) {
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        uint32_t old_cell_count = bucket_meta->CellCount ();
+        uint32_t new_cell_count = old_cell_count << 1;
+        char* new_bucket_addr = allocateCells (new_cell_count, bi);
+        if (new_bucket_addr == nullptr) {
+            perror ("rehash alloc memory fail\n");
+            exit (1);
+        }
+        memset (new_bucket_addr, 0, new_cell_count * kCellSize);
 
-    // For CellMeta, H1 may be used to store real key,
-    // we need to calculate the real hash of h1 accordingly.
-    // If key is flat (store the real key), we need to hash h1.
-    inline size_t H1ToHash (H1Tag h1) {
-        using ToHash = typename std::conditional<is_key_flat, ::turbo::hash<size_t>,
-                                                 IdenticalReturn<H1Tag>>::type;
-        return ToHash{}(h1);
+        BucketMigration* migration =
+            new BucketMigration{bucket_meta->Address (), old_cell_count, new_bucket_addr, 0};
+        capacity_.fetch_add (old_cell_count * (CellMeta::SlotCount () - 1));
+        // readers find the migration as soon as they see the migrating bit
+        dir->migrations[bi].store (migration, std::memory_order_release);
+        bucket_meta->ResetMigrating (new_bucket_addr, new_cell_count);
+        dir->Publish (bi);
     }
 
-    inline ThreadInfo getThreadInfo () { return ThreadInfo (this->epoche_); }
-
-    /** Put
-     *  @note: insert or update a key-value record, return false if fails.
+    /** migrateForKey
+     *  @note: move the old cells a key probes, then the next kMigrateCellChunk old cells
+     *         of bucket bi. The caller holds the bucket lock.
      */
-    bool Put (const Key& key, const T& value, ThreadInfo& thread_info) {
-        EpocheGuard epoche_guard (thread_info);
-        // calculate hash value of the key
-        size_t hash_value = KeyToHash (key);
-        // update index, thread safe
-        return insertSlot (key, value, hash_value, thread_info);
+    void migrateForKey (Directory* dir, uint32_t bi, PartialHash& partial_hash,
+                        ThreadInfo& thread_info) {
+        BucketMigration* migration = dir->migrations[bi].load (std::memory_order_relaxed);
+        ProbeWithinBucket probe (H1ToHash (partial_hash.H1_), migration->old_cell_count - 1, bi);
+        int probe_count = 0;  // limit probe times
+        while (probe && (probe_count++ < ProbeWithinBucket::MAX_PROBE_LEN)) {
+            char* cell_addr = locateCell (migration->old_addr, probe.offset ());
+            if (!migrateCell (dir, bi, migration, cell_addr, thread_info)) {
+                return;
+            }
+            if (!CellMeta (cell_addr).Full ()) {
+                break;
+            }
+            probe.next ();
+        }
+
+        int moved = 0;
+        while (moved < kMigrateCellChunk && migration->cursor < migration->old_cell_count) {
+            char* cell_addr = locateCell (migration->old_addr, {bi, migration->cursor++});
+            if (CellMeta::IsMigrated (cell_addr)) {
+                continue;
+            }
+            if (!migrateCell (dir, bi, migration, cell_addr, thread_info)) {
+                return;
+            }
+            moved++;
+        }
+        if (migration->cursor == migration->old_cell_count) {
+            completeMigration (dir, bi, thread_info);
+        }
     }
 
-    template <typename Fn>
-    bool Find (const Key& key, ThreadInfo& thread_info, Fn&& callback) {
-        EpocheGuardReadonly epoche_guard (thread_info);
-        // calculate hash value of the key
-        size_t hash_value = KeyToHash (key);
-        FindSlotResult res = findSlot (key, hash_value);
-        if (res.find) {
-            callback (res.record);
+    // move all the remaining old cells of bucket bi. The caller holds the bucket lock.
+    void finishMigration (Directory* dir, uint32_t bi, ThreadInfo& thread_info) {
+        BucketMigration* migration = dir->migrations[bi].load (std::memory_order_relaxed);
+        for (; migration->cursor < migration->old_cell_count; migration->cursor++) {
+            char* cell_addr = locateCell (migration->old_addr, {bi, migration->cursor});
+            if (!migrateCell (dir, bi, migration, cell_addr, thread_info)) {
+                return;
+            }
+        }
+        completeMigration (dir, bi, thread_info);
+    }
+
+    /** migrateCell
+     *  @note: move the live slots of an old cell to the new cells with normal versioned
+     *         insertions, then mark the old cell migrated. If a slot finds no room, the
+     *         migration is finished by rebuilding the bucket and false is returned.
+     */
+    bool migrateCell (Directory* dir, uint32_t bi, BucketMigration* migration,
+                      char* old_cell_addr, ThreadInfo& thread_info) {
+        if (CellMeta::IsMigrated (old_cell_addr)) {
             return true;
         }
-        return false;
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        char* new_bucket_addr = bucket_meta->Address ();
+        uint32_t new_cell_count_mask = bucket_meta->CellCountMask ();
+
+        // the new positions written for this cell so far
+        std::pair<uint32_t, uint8_t> placed[CellMeta::SlotCount ()];
+        int placed_count = 0;
+        CellMeta meta (old_cell_addr);
+        for (int i : meta.ValidBitSet ()) {
+            HashSlot* slot = CellMeta::LocateSlot (old_cell_addr, i);
+            H2Tag h2 = *CellMeta::LocateH2Tag (old_cell_addr, i);
+            std::pair<uint32_t, uint8_t> target;
+            if (!findSlotForMigrate (new_bucket_addr, new_cell_count_mask, bi, slot->H1, target)) {
+                rebuildMigration (dir, bi, migration, placed, placed_count, thread_info);
+                return false;
+            }
+            char* des_cell_addr = locateCell (new_bucket_addr, {bi, target.first});
+            HashSlot* des_slot = CellMeta::LocateSlot (des_cell_addr, target.second);
+            des_slot->entry = slot->entry;
+            des_slot->H1 = slot->H1;
+            *CellMeta::LocateH2Tag (des_cell_addr, target.second) = h2;
+
+            auto version = CellMeta::LoadVersion (des_cell_addr);
+            version.bitmap_ |= CellMeta::SlotBit (target.second);
+            version.bitmap_deleted_ &= ~CellMeta::SlotBit (target.second);
+            version.seq_no_++;
+            std::atomic_thread_fence (std::memory_order_release);
+            CellMeta::StoreVersion (des_cell_addr, version);
+            placed[placed_count++] = target;
+        }
+        // the slots are visible in the new cells before the old cell is marked
+        CellMeta::SetMigrated (old_cell_addr);
+        return true;
     }
 
-    bool Delete (const Key& key, ThreadInfo& thread_info) {
-        EpocheGuard epoche_guard (thread_info);
-        // calculate hash value of the key
-        size_t hash_value = KeyToHash (key);
-        return deleteSlot (key, hash_value, thread_info);
+    // find a free or deleted slot for a migrated slot, the same way findSlotForInsert
+    // does for a new key. target is (cell index, slot index).
+    bool findSlotForMigrate (char* bucket_addr, uint32_t cell_count_mask, uint32_t bi, H1Tag h1,
+                             std::pair<uint32_t, uint8_t>& target) {
+        ProbeWithinBucket probe (H1ToHash (h1), cell_count_mask, bi);
+        int probe_count = 0;  // limit probe times
+        while (probe && (probe_count++ < ProbeWithinBucket::MAX_PROBE_LEN)) {
+            auto offset = probe.offset ();
+            CellMeta meta (locateCell (bucket_addr, offset));
+            auto erase_bitset = meta.EraseBitSet ();
+            if (erase_bitset.validCount () != 0) {
+                target = {offset.second, *erase_bitset};
+                return true;
+            }
+            if (!meta.Full ()) {
+                target = {offset.second, *meta.BackupBitSet ()};
+                return true;
+            }
+            probe.next ();
+        }
+        return false;
     }
 
-    double LoadFactor () {
-        return (double)size_.load (std::memory_order_relaxed) /
-               capacity_.load (std::memory_order_relaxed);
+    // end the incremental rehash of bucket bi once all old cells are migrated
+    void completeMigration (Directory* dir, uint32_t bi, ThreadInfo& thread_info) {
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        BucketMigration* migration = dir->migrations[bi].load (std::memory_order_relaxed);
+        bucket_meta->Reset (bucket_meta->Address (), bucket_meta->CellCount ());
+        dir->Publish (bi);
+        dir->migrations[bi].store (nullptr, std::memory_order_release);
+        char* old_bucket_addr = migration->old_addr;
+        epoche_.markNodeForDeletion (
+            [=] () {
+                cell_allocator_.Release (old_bucket_addr);
+                delete migration;
+            },
+            thread_info);
     }
 
-    size_t Capacity () { return capacity_.load (); }
+    /** rebuildMigration
+     *  @note: the new cells of bucket bi have no room for an old slot. Rehash the slots of
+     *         the new cells, except the 'placed' ones of the cell being migrated, and of all
+     *         the old cells not migrated yet into fresh cells, the way MinorRehash does.
+     */
+    void rebuildMigration (Directory* dir, uint32_t bi, BucketMigration* migration,
+                           const std::pair<uint32_t, uint8_t>* placed, int placed_count,
+                           ThreadInfo& thread_info) {
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        char* new_bucket_addr = bucket_meta->Address ();
+        uint32_t new_cell_count = bucket_meta->CellCount ();
+
+        std::vector<typename BucketIterator::InfoPair> slots;
+        BucketIterator iter (bi, new_bucket_addr, new_cell_count);
+        while (iter.valid ()) {
+            typename BucketIterator::InfoPair res = *iter;
+            std::pair<uint32_t, uint8_t> pos = {res.slot_info.cell, res.slot_info.slot};
+            if (std::find (placed, placed + placed_count, pos) == placed + placed_count) {
+                slots.push_back (res);
+            }
+            ++iter;
+        }
+        for (uint32_t ci = 0; ci < migration->old_cell_count; ci++) {
+            char* cell_addr = locateCell (migration->old_addr, {bi, ci});
+            if (CellMeta::IsMigrated (cell_addr)) {
+                continue;
+            }
+            BucketIterator old_iter (bi, cell_addr, 1);
+            while (old_iter.valid ()) {
+                slots.push_back (*old_iter);
+                ++old_iter;
+            }
+        }
 
-    size_t Size () { return size_.load (std::memory_order_relaxed); }
+        uint32_t cell_count = new_cell_count;
+        char* bucket_addr = rebuildCells (bi, slots, cell_count);
+        capacity_.fetch_add ((cell_count - new_cell_count) * (CellMeta::SlotCount () - 1));
+        bucket_meta->Reset (bucket_addr, cell_count);
+        dir->Publish (bi);
+        dir->migrations[bi].store (nullptr, std::memory_order_release);
+        char* old_bucket_addr = migration->old_addr;
+        epoche_.markNodeForDeletion (
+            [=] () {
+                cell_allocator_.Release (old_bucket_addr);
+                cell_allocator_.Release (new_bucket_addr);
+                delete migration;
+            },
+            thread_info);
+    }
 
-    void IterateValidBucket () {
-        printf ("Iterate Valid Bucket\n");
-        for (size_t i = 0; i < bucket_count_; ++i) {
-            auto& bucket_meta = locateBucket (i);
-            BucketIterator iter (i, bucket_meta.Address (), bucket_meta.info.cell_count);
-            if (iter.valid ()) {
-                printf ("%s\n", PrintBucketMeta (i).c_str ());
-            }
+    /** rebuildCells
+     *  @note: allocate at least cell_count cells for bucket bi and move the slots into them,
+     *         in the layout MinorRehash produces. cell_count is updated to the allocated count.
+     */
+    char* rebuildCells (uint32_t bi, const std::vector<typename BucketIterator::InfoPair>& slots,
+                        uint32_t& cell_count) {
+        std::vector<H1Tag> h1s;
+        for (auto& res : slots) {
+            h1s.push_back (res.slot_info.H1);
+        }
+        std::vector<FindNextSlotInRehashResult> positions;
+        cell_count = planRehashSlots (h1s.data (), h1s.size (), cell_count, positions);
+        char* bucket_addr = allocateCells (cell_count, bi);
+        if (bucket_addr == nullptr) {
+            perror ("rehash alloc memory fail\n");
+            exit (1);
         }
+        memset (bucket_addr, 0, cell_count * kCellSize);
+        for (size_t i = 0; i < slots.size (); i++) {
+            char* des_cell_addr = bucket_addr + (positions[i].cell_index << kCellSizeLeftShift);
+            moveSlot (des_cell_addr, positions[i].slot_index, slots[i].slot_info,
+                      slots[i].hash_slot);
+        }
+        return bucket_addr;
     }
 
-    void IterateBucket (uint32_t i) {
-        auto& bucket_meta = locateBucket (i);
-        BucketIterator iter (i, bucket_meta.Address (), bucket_meta.CellCount ());
+    /** shrinkBucket
+     *  @note: halve the cells of bucket bi while its live slots stay below
+     *         shrink_load_factor of the halved capacity, dropping the deleted slots. The
+     *         caller holds the bucket lock. Return the number of cells released.
+     */
+    uint32_t shrinkBucket (Directory* dir, uint32_t bi, double shrink_load_factor,
+                           ThreadInfo& thread_info) {
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        if (bucket_meta->IsMigrating ()) {
+            finishMigration (dir, bi, thread_info);
+        }
+        uint32_t old_cell_count = bucket_meta->CellCount ();
+        char* old_bucket_addr = bucket_meta->Address ();
+
+        std::vector<typename BucketIterator::InfoPair> slots;
+        BucketIterator iter (bi, old_bucket_addr, old_cell_count);
         while (iter.valid ()) {
-            auto res = (*iter);
-            SlotInfo& info = res.first;
-            info.bucket = i;
-            HashSlot& slot = res.second;
-            SlotType* record = &slot;
-            std::cout << info.ToString () << ", addr: " << slot.entry
-                      << ". key: " << record->first () << ", value: " << record->second ()
-                      << std::endl;
+            slots.push_back (*iter);
             ++iter;
         }
+        uint32_t target = old_cell_count;
+        while (target > 1 &&
+               slots.size () < (target >> 1) * (CellMeta::SlotCount () - 1) * shrink_load_factor) {
+            target >>= 1;
+        }
+        if (target == old_cell_count) {
+            return 0;
+        }
+        if (isZeroCells (old_bucket_addr)) {
+            // no cells to release
+            bucket_meta->Reset (zero_cells_, target);
+            dir->Publish (bi);
+            capacity_.fetch_sub ((old_cell_count - target) * (CellMeta::SlotCount () - 1));
+            return 0;
+        }
+        // the slots may need more cells than the target to fit within the probe limit
+        uint32_t cell_count = target;
+        char* bucket_addr = rebuildCells (bi, slots, cell_count);
+        if (cell_count >= old_cell_count) {
+            // the slots do not fit within the probe limit of fewer cells
+            cell_allocator_.Release (bucket_addr);
+            return 0;
+        }
+
+        bucket_meta->Reset (bucket_addr, cell_count);
+        dir->Publish (bi);
+        capacity_.fetch_sub ((old_cell_count - cell_count) * (CellMeta::SlotCount () - 1));
+        epoche_.retire (old_bucket_addr, retire_cells_kind_, thread_info,
+                        old_cell_count * kCellSize);
+        return old_cell_count - cell_count;
     }
 
-    void IterateAll () {
-        size_t count = 0;
-        for (size_t i = 0; i < bucket_count_; ++i) {
-            BucketMeta* bucket_meta = locateBucket (i);
-            BucketIterator iter (i, bucket_meta->Address (), bucket_meta->CellCount ());
+    /** presizeBucket
+     *  @note: grow bucket bi at once to the cells its slots and count more keys need to
+     *         stay below kBulkLoadFactor, instead of doubling it once per full cell while
+     *         they are written. The cache mode cap and kCellCountLimit are kept. Nothing
+     *         is done under incremental rehash. The caller holds the bucket lock.
+     */
+    void presizeBucket (Directory* dir, uint32_t bi, size_t count, ThreadInfo& thread_info) {
+        if (incremental_rehash_.load (std::memory_order_relaxed)) {
+            return;
+        }
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        if (bucket_meta->IsMigrating ()) {
+            finishMigration (dir, bi, thread_info);
+        }
+        uint32_t old_cell_count = bucket_meta->CellCount ();
+        char* old_bucket_addr = bucket_meta->Address ();
+
+        std::vector<typename BucketIterator::InfoPair> slots;
+        if (!isZeroCells (old_bucket_addr)) {
+            BucketIterator iter (bi, old_bucket_addr, old_cell_count);
             while (iter.valid ()) {
-                auto res = (*iter);
-                SlotInfo& info = res.slot_info;
-                HashSlot& slot = res.hash_slot;
-                SlotType* record = reinterpret_cast<SlotType*> (&slot);
-                std::cout << info.ToString () << ", addr: " << slot.entry
-                          << ". key: " << record->first () << ", value: " << record->second ()
-                          << std::endl;
+                slots.push_back (*iter);
                 ++iter;
-                count++;
             }
         }
-        printf ("iterato %lu entries. total size: %lu\n", count, Size ());
+        size_t total = slots.size () + count;
+        constexpr uint32_t kSlotPerCell = CellMeta::SlotMaxRange () - CellMeta::StartSlotPos ();
+        uint32_t cell_count = old_cell_count;
+        while (cell_count < kCellCountLimit && !cacheFull (cell_count) &&
+               total > cell_count * kSlotPerCell * kBulkLoadFactor) {
+            cell_count <<= 1;
+        }
+        if (cell_count == old_cell_count) {
+            return;
+        }
+        if (isZeroCells (old_bucket_addr)) {
+            // a bucket not written yet only changes its cell count
+            bucket_meta->Reset (zero_cells_, cell_count);
+        } else {
+            char* bucket_addr = rebuildCells (bi, slots, cell_count);
+            bucket_meta->Reset (bucket_addr, cell_count);
+            epoche_.retire (old_bucket_addr, retire_cells_kind_, thread_info,
+                            old_cell_count * kCellSize);
+        }
+        dir->Publish (bi);
+        capacity_.fetch_add ((cell_count - old_cell_count) * (CellMeta::SlotCount () - 1));
+        if constexpr (kTurboHashStats) {
+            ThreadStats& stats = threadStats (thread_info);
+            countStat (stats.rehashes);
+            countStat (stats.rehash_bytes, slots.size () * sizeof (HashSlot));
+        }
     }
 
-    template <typename Fn>
-    void IterateAllCallback (Fn&& callback) {
-        size_t threads = std::min (8LU, bucket_count_);
-        std::vector<std::thread> workers (threads);
-        for (size_t t = 0; t < threads; t++) {
-            workers[t] = std::thread ([&, t] {
-                size_t start_b = bucket_count_ / threads * t;
-                size_t end_b = start_b + bucket_count_ / threads;
-                size_t count = 0;
-                for (size_t i = start_b; i < end_b; ++i) {
-                    BucketMeta* bucket_meta = locateBucket (i);
-                    BucketIterator iter (i, bucket_meta->Address (), bucket_meta->CellCount ());
-                    while (iter.valid ()) {
-                        auto res = (*iter);
-                        auto& slot = res.hash_slot;
-                        callback (slot.entry);
-                        ++iter;
-                        count++;
-                    }
+    // rehash (or compact when isgc) all the buckets with 'threads' threads
+    size_t rehashAll (int threads, bool isgc) {
+        size_t bucket_count = BucketCount ();
+        threads = std::max (1, std::min (threads, (int)bucket_count));
+        printf ("Rehash threads: %d\n", threads);
+        std::atomic<size_t> rehash_count (0);
+        auto rehash_start = util::NowMicros ();
+        runInParallel (threads, [&] (int t) {
+            auto thread_info = getThreadInfo ();
+            size_t start_b = bucket_count / threads * t;
+            size_t end_b = (t == threads - 1) ? bucket_count : start_b + bucket_count / threads;
+            size_t counts = 0;
+            for (size_t i = start_b; i < end_b; ++i) {
+                counts += MinorRehash (i, thread_info, isgc);
+            }
+            rehash_count.fetch_add (counts, std::memory_order_relaxed);
+        });
+        double rehash_duration = util::NowMicros () - rehash_start;
+        printf ("Real rehash speed: %f Mops/s. entries: %lu, duration: %.2f s.\n",
+                (double)rehash_count / rehash_duration, rehash_count.load (),
+                rehash_duration / 1000000.0);
+        return rehash_count.load ();
+    }
+
+    // scan the buckets b with b % threads == t until StopMaintenance
+    void maintenanceWorker (int t) {
+        auto thread_info = getThreadInfo ();
+        const MaintenanceOptions& options = maintenance_options_;
+        while (true) {
+            size_t expire_budget = options.expire_per_scan;
+            for (size_t b = t; b < BucketCount (); b += options.threads) {
+                if (maintenance_stop_.load (std::memory_order_relaxed)) {
+                    return;
                 }
-            });
-        }
-        std::for_each (workers.begin (), workers.end (), [] (std::thread& t) { t.join (); });
+                maintainBucket (b, expire_budget, thread_info);
+            }
+            maintenance_scans_.fetch_add (1, std::memory_order_relaxed);
 
-        // printf ("iterato %lu entries. total size: %lu\n", count, Size ());
+            std::unique_lock<std::mutex> lock (maintenance_mutex_);
+            if (maintenance_cv_.wait_for (lock, std::chrono::milliseconds (options.interval_ms),
+                                          [this] { return maintenance_stop_.load (); })) {
+                return;
+            }
+        }
     }
 
-    std::string ProbeStrategyName () { return ProbeWithinBucket::name (); }
+    struct BucketOccupancy {
+        size_t used;     // live and deleted slots
+        size_t deleted;  // deleted slots
+        size_t capacity;
+    };
 
-    std::string PrintBucketMeta (uint32_t bucket_i) {
-        std::string res;
-        char buffer[1024];
-        BucketMeta* bucket_meta = locateBucket (bucket_i);
-        char* search_bucket_addr = bucket_meta->Address ();
-        sprintf (buffer, "----- bucket %10u -----\n", bucket_i);
-        res += buffer;
-        ProbeWithinBucket probe (0, bucket_meta->CellCountMask (), bucket_i);
-        uint32_t i = 0;
-        int count_sum = 0;
-        while (probe) {
-            char* cell_addr = locateCell (search_bucket_addr, probe.offset ());
-            CellMeta meta (cell_addr);
-            int count = meta.OccupyCount ();
-            sprintf (buffer, "\t%4u - 0x%12lx: %s. Cell valid slot count: %d. ", i++,
-                     (uint64_t)cell_addr, meta.BitMapToString ().c_str (), count);
-            res += buffer;
-            auto valid_bitset = meta.ValidBitSet ();
-            for (int i : valid_bitset) {
-                std::ostringstream ss;
-                HashSlot* slot = CellMeta::LocateSlot (cell_addr, i);
-                ss << "s" << i << "H1: " << slot->H1 << ", ";
-                res += ss.str ();
-            }
-            res += "\n";
-            probe.next ();
-            count_sum += count;
+    BucketOccupancy bucketOccupancy (char* bucket_addr, uint32_t cell_count) {
+        BucketOccupancy occupancy{0, 0, cell_count * (CellMeta::SlotCount () - 1)};
+        for (uint32_t ci = 0; ci < cell_count; ci++) {
+            CellMeta meta (bucket_addr + (ci << kCellSizeLeftShift));
+            occupancy.used += meta.OccupyCount ();
+            occupancy.deleted += meta.EraseBitSet ().validCount ();
         }
-        sprintf (buffer, "\tBucket %u: valid slot count: %d. Load factor: %f\n", bucket_i,
-                 count_sum,
-                 (double)count_sum / ((CellMeta::SlotCount () - 1) * bucket_meta->CellCount ()));
-        res += buffer;
-        return res;
+        return occupancy;
     }
 
-    std::string PrintLoadAndProbeLen (uint32_t bucket_i) {
-        std::string res;
-        char buffer[1024];
-        BucketMeta* bucket_meta = locateBucket (bucket_i);
-        char* search_bucket_addr = bucket_meta->Address ();
-        ProbeWithinBucket probe (0, bucket_meta->CellCountMask (), bucket_i);
-        uint32_t i = 0;
-        int count_sum = 0;
-        size_t probe_sum = 0;
-        size_t cur_probe = 0;
-        while (probe) {
-            char* cell_addr = locateCell (search_bucket_addr, probe.offset ());
+    /** sweepBucket
+     *  @note: drop at most budget expired records of bucket bi, each under the lock of
+     *         its cell. A bucket being rehashed is left to the next scan. Return the number
+     *         of records dropped.
+     */
+    size_t sweepBucket (Directory* dir, uint32_t bi, size_t budget, ThreadInfo& thread_info) {
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        BucketMeta snapshot = bucket_meta->Load ();
+        if (snapshot.IsMoved () || snapshot.IsMigrating () || snapshot.IsLocked () ||
+            isZeroCells (snapshot.Address ())) {
+            return 0;
+        }
+        size_t dropped = 0;
+        for (uint32_t ci = 0; ci < snapshot.CellCount () && dropped < budget; ci++) {
+            char* cell_addr = snapshot.Address () + ((size_t)ci << kCellSizeLeftShift);
             CellMeta meta (cell_addr);
-            int count = meta.OccupyCount ();
-            if (count < meta.SlotCount () - 1) {
-                // not full
-                cur_probe = 0;
-            } else {
-                cur_probe++;
+            // the records are read without the lock first, the check is only a hint
+            if (expiredSlot (cell_addr, meta) < 0) {
+                continue;
+            }
+            if (!lockBucketCell (bucket_meta, snapshot, cell_addr, thread_info)) {
+                break;
+            }
+            CellUnlockScope cell_lock (cell_addr);
+            while (dropped < budget) {
+                CellMeta locked_meta (cell_addr);
+                int slot_i = expiredSlot (cell_addr, locked_meta);
+                if (slot_i < 0) {
+                    break;
+                }
+                dropSlot (cell_addr, slot_i, thread_info);
+                dropped++;
             }
-            probe.next ();
-            count_sum += count;
-            probe_sum += cur_probe + 1;
         }
-        sprintf (buffer,
-                 "Bucket %u. Cell count: %d, valid slot count: %d. Load factor: %f "
-                 "Probe sum: %lu, "
-                 "Avg probe dis: %.2f",
-                 bucket_i, bucket_meta->CellCount (), count_sum,
-                 (double)count_sum / ((CellMeta::SlotCount () - 1) * bucket_meta->CellCount ()),
-                 probe_sum, (double)probe_sum / bucket_meta->CellCount ());
-        res += buffer;
-        return res;
+        return dropped;
     }
 
-    void PrintAlProbeLen () {
-        for (size_t b = 0; b < bucket_count_; ++b) {
-            printf ("%s\n", PrintLoadAndProbeLen (b).c_str ());
+    /** maintainBucket
+     *  @note: check bucket bi of the current directory without the lock first, then grow
+     *         or compact it under the lock if it still needs it. Expired records are
+     *         dropped first, while expire_budget lasts.
+     */
+    void maintainBucket (uint32_t bi, size_t& expire_budget, ThreadInfo& thread_info) {
+        const MaintenanceOptions& options = maintenance_options_;
+        EpocheGuard epoche_guard (thread_info);
+        Directory* dir = currentDirectory ();
+        if (bi >= dir->bucket_count) {
+            return;
+        }
+        BucketMeta* bucket_meta = dir->Bucket (bi);
+        BucketMeta bucket_snapshot = bucket_meta->Load ();
+        if (bucket_snapshot.IsMoved ()) {
+            return;
+        }
+        if (expire_budget > 0 && expiring_records_.load (std::memory_order_relaxed)) {
+            size_t dropped = sweepBucket (dir, bi, expire_budget, thread_info);
+            expire_budget -= dropped;
+            maintenance_expired_.fetch_add (dropped, std::memory_order_relaxed);
+        }
+        auto needs_shrink = [&] (const BucketOccupancy& occupancy) {
+            return occupancy.capacity > CellMeta::SlotCount () - 1 &&
+                   occupancy.used - occupancy.deleted <
+                       occupancy.capacity / 2 * options.shrink_load_factor;
+        };
+        auto needs_work = [&] (const BucketOccupancy& occupancy) {
+            return (occupancy.used > occupancy.capacity * options.grow_load_factor &&
+                    !cacheFull (bucket_snapshot.CellCount ())) ||
+                   occupancy.deleted > occupancy.capacity * options.gc_deleted_ratio ||
+                   needs_shrink (occupancy);
+        };
+        // the cells are read without the lock, the check is only a hint
+        if (!bucket_snapshot.IsMigrating () &&
+            !needs_work (
+                bucketOccupancy (bucket_snapshot.Address (), bucket_snapshot.CellCount ()))) {
+            return;
         }
-    }
 
-    void PrintAllMeta () {
-        for (size_t b = 0; b < bucket_count_; ++b) {
-            printf ("%s\n", PrintBucketMeta (b).c_str ());
+        bool double_directory = false;
+        {
+            BucketLockScope meta_lock (*this, dir, bi, thread_info);
+            if (bucket_meta->IsMoved ()) {
+                return;
+            }
+            if (bucket_meta->IsMigrating ()) {
+                finishMigration (dir, bi, thread_info);
+                maintenance_migrated_.fetch_add (1, std::memory_order_relaxed);
+            }
+            BucketOccupancy occupancy =
+                bucketOccupancy (bucket_meta->Address (), bucket_meta->CellCount ());
+            if (needs_shrink (occupancy)) {
+                shrinkBucket (dir, bi, options.shrink_load_factor, thread_info);
+                maintenance_shrunk_.fetch_add (1, std::memory_order_relaxed);
+                return;
+            }
+            if (occupancy.deleted > occupancy.capacity * options.gc_deleted_ratio) {
+                minorRehash (dir, bi, thread_info, true);
+                maintenance_compacted_.fetch_add (1, std::memory_order_relaxed);
+                occupancy.used -= occupancy.deleted;
+            }
+            if (occupancy.used > occupancy.capacity * options.grow_load_factor &&
+                !cacheFull (bucket_meta->CellCount ())) {
+                if (bucket_meta->CellCount () < kCellCountLimit) {
+                    minorRehash (dir, bi, thread_info);
+                    maintenance_grown_.fetch_add (1, std::memory_order_relaxed);
+                } else {
+                    double_directory = true;
+                }
+            }
+        }
+        if (double_directory) {
+            growDirectory (dir, thread_info);
+            maintenance_doubled_.fetch_add (1, std::memory_order_relaxed);
         }
     }
 
-    void PrintHashTable () {
-        for (int b = 0; b < bucket_count_; ++b) {
-            printf ("%s\n", PrintBucketMeta (b).c_str ());
+    // batch deleters of the epoche retire lists
+    static void releaseCellsBatch (void* table, void* const* ptrs, size_t count) {
+        static_cast<TurboHashTable*> (table)->cell_allocator_.ReleaseBatch (ptrs, count);
+    }
+
+    static void releaseRecordsBatch (void* table, void* const* ptrs, size_t count) {
+        static_cast<TurboHashTable*> (table)->record_allocator_.ReleaseBatch (ptrs, count);
+    }
+
+    // run fn (t) in 'threads' threads and wait for all of them
+    template <typename Fn>
+    void runInParallel (int threads, Fn&& fn) {
+        std::vector<std::thread> workers (threads);
+        for (int t = 0; t < threads; t++) {
+            workers[t] = std::thread ([&, t] { fn (t); });
         }
+        std::for_each (workers.begin (), workers.end (), [] (std::thread& t) { t.join (); });
     }
 
-private:
-    inline uint32_t bucketIndex (uint64_t hash) { return hash & bucket_mask_; }
+    /** bulkLoadBucket
+     *  @note: rebuild bucket bi with its current slots plus the records first[items[i]].
+     *         The cell count is chosen so the bucket stays below kBulkLoadFactor.
+     */
+    template <typename RandomIt>
+    void bulkLoadBucket (uint32_t bi, RandomIt first, const size_t* items, size_t item_count,
+                         const std::vector<size_t>& hash_values, ThreadInfo& thread_info) {
+        if (item_count == 0) return;
+        BucketMeta* bucket_meta = locateBucket (bi);
+        if (bucket_meta->IsMigrating ()) {
+            finishMigration (currentDirectory (), bi, thread_info);
+        }
+        char* old_bucket_addr = bucket_meta->Address ();
+        uint32_t old_cell_count = bucket_meta->CellCount ();
 
-    inline BucketMeta* locateBucket (uint32_t bi) const { return &buckets_[bi]; }
+        // the slots already in this bucket are moved to the new cells as well
+        std::vector<typename BucketIterator::InfoPair> old_slots;
+        BucketIterator iter (bi, old_bucket_addr, old_cell_count);
+        while (iter.valid ()) {
+            old_slots.push_back (*iter);
+            ++iter;
+        }
 
-    // offset.first: bucket index
-    // offset.second: cell index
-    inline char* locateCell (char* bucket_addr, const std::pair<size_t, size_t>& offset) {
-        return bucket_addr +                           // locate the bucket
-               (offset.second << kCellSizeLeftShift);  // locate the cell cell
-    }
+        size_t total = old_slots.size () + item_count;
+        constexpr uint32_t kSlotPerCell = CellMeta::SlotMaxRange () - CellMeta::StartSlotPos ();
+        uint32_t new_cell_count = old_cell_count;
+        while (new_cell_count < kCellCountLimit &&
+               total > new_cell_count * kSlotPerCell * kBulkLoadFactor) {
+            new_cell_count <<= 1;
+        }
 
-    // used in rehash function, move slot to new cell_addr
-    inline void moveSlot (char* des_cell_addr, uint8_t des_slot_i, const SlotInfo& old_info,
-                          const HashSlot& old_slot) {
-        // move slot content, including H1 and pointer
-        HashSlot* des_slot = CellMeta::LocateSlot (des_cell_addr, des_slot_i);
-        des_slot->entry = old_slot.entry;
-        des_slot->H1 = old_info.H1;
+        // plan the position of every slot first, so nothing is written until all fit
+        std::vector<H1Tag> h1s (total);
+        for (size_t i = 0; i < total; i++) {
+            h1s[i] = i < old_slots.size ()
+                         ? old_slots[i].slot_info.H1
+                         : PartialHash (first[items[i - old_slots.size ()]].first,
+                                        hash_values[items[i - old_slots.size ()]])
+                               .H1_;
+        }
+        std::vector<FindNextSlotInRehashResult> positions;
+        new_cell_count = planRehashSlots (h1s.data (), total, new_cell_count, positions);
 
-        // locate H2 and set H2
-        H2Tag* h2_tag_ptr = CellMeta::LocateH2Tag (des_cell_addr, des_slot_i);
-        *h2_tag_ptr = old_info.H2;
+        char* new_bucket_addr = allocateCells (new_cell_count, bi);
+        if (new_bucket_addr == nullptr) {
+            perror ("bulk load alloc memory fail\n");
+            exit (1);
+        }
+        memset (new_bucket_addr, 0, new_cell_count * kCellSize);
+
+        for (size_t i = 0; i < total; i++) {
+            char* des_cell_addr = new_bucket_addr + (positions[i].cell_index << kCellSizeLeftShift);
+            uint8_t des_slot_i = positions[i].slot_index;
+            if (i < old_slots.size ()) {
+                moveSlot (des_cell_addr, des_slot_i, old_slots[i].slot_info,
+                          old_slots[i].hash_slot);
+                continue;
+            }
+            size_t item = items[i - old_slots.size ()];
+            PartialHash partial_hash (first[item].first, hash_values[item]);
+            SlotType* slot = CellMeta::LocateSlot (des_cell_addr, des_slot_i);
+            slot->Store (hash_values[item], first[item].first, first[item].second,
+                         record_allocator_);
+            *CellMeta::LocateH2Tag (des_cell_addr, des_slot_i) = partial_hash.H2_;
+            decltype (CellMeta::Version::bitmap_)* bitmap =
+                (decltype (CellMeta::Version::bitmap_)*)des_cell_addr;
+            *bitmap = (*bitmap) | CellMeta::SlotBit (des_slot_i);
+        }
 
-        // obtain and set bitmap
-        decltype (CellMeta::Version::bitmap_)* bitmap =
-            (decltype (CellMeta::Version::bitmap_)*)des_cell_addr;
-        *bitmap = (*bitmap) | (1 << des_slot_i);
+        bucket_meta->Reset (new_bucket_addr, new_cell_count);
+        currentDirectory ()->Publish (bi);
+        capacity_.fetch_add ((new_cell_count - old_cell_count) * (CellMeta::SlotCount () - 1));
+        size_.Add (item_count);
+        // no reader can hold the old cells during a bulk load
+        releaseCells (old_bucket_addr);
     }
 
     /** insertToSlotAndGC
      *  @note: Reuse or recycle the space of target slot's old entry.
-     *         Set bitmap, H2, H1, pointer.
+     *         Set bitmap, H2, H1, pointer. A non-zero deadline makes the record expire
+     *         then, see PutWithTTL.
      */
     inline void insertToSlotAndGC (size_t hash_value, const Key& key, const T& value,
-                                   char* cell_addr, const SlotInfo& info, ThreadInfo& thread_info) {
+                                   char* cell_addr, const SlotInfo& info, ThreadInfo& thread_info,
+                                   uint64_t deadline = 0) {
+        if constexpr (!is_key_flat || !is_value_flat) {
+            auto live = CellMeta::LoadVersion (cell_addr);
+            if (!info.equal_key && (live.bitmap_ & ~live.bitmap_deleted_ &
+                                    CellMeta::SlotBit (info.slot))) {
+                // an expired slot of another key, it is deleted first, so that lookups
+                // reading it see two writes and retry
+                dropSlot (cell_addr, info.slot, thread_info);
+            }
+        }
+
         // locate the target slot
         SlotType* slot = CellMeta::LocateSlot (cell_addr, info.slot);
 
         // store the key value to slot
-        slot->Store (hash_value, key, value, record_allocator_);
+        slot->Store (hash_value, key, value, record_allocator_, deadline);
 
         // set H2
         H2Tag* h2_tag_ptr = CellMeta::LocateH2Tag (cell_addr, info.slot);
@@ -2101,21 +5281,23 @@ private:
 
         if (true == info.equal_key) {
             // set the new slot, toggle the old slot (to 0)
-            version.bitmap_ = (version.bitmap_ | (1 << info.slot)) ^ (1 << info.old_slot);
+            version.bitmap_ = (version.bitmap_ | CellMeta::SlotBit (info.slot)) ^
+                              CellMeta::SlotBit (info.old_slot);
             // clean the delete_bitmap,
-            version.bitmap_deleted_ &= ~(1 << info.slot);
+            version.bitmap_deleted_ &= ~CellMeta::SlotBit (info.slot);
 
             // Garbage collection for outdated slot
             SlotType* old_slot = CellMeta::LocateSlot (cell_addr, info.old_slot);
             char* old_addr = old_slot->ReleaseAddress ();
             if (old_addr != nullptr) {
-                epoche_.markNodeForDeletion ([=] () { free (old_addr); }, thread_info);
+                epoche_.retire (old_addr, retire_records_kind_, thread_info);
             }
         } else {
             // Insertion: set the new slot
-            version.bitmap_ |= (1 << info.slot);
+            version.bitmap_ |= CellMeta::SlotBit (info.slot);
             // clean the delete_bitmap
-            version.bitmap_deleted_ &= ~(1 << info.slot);
+            version.bitmap_deleted_ &= ~CellMeta::SlotBit (info.slot);
+            size_.Add (1);
         }
 
         version.seq_no_++;
@@ -2123,43 +5305,409 @@ private:
         std::atomic_thread_fence (std::memory_order_release);
 
         CellMeta::StoreVersion (cell_addr, version);
+        if (cache_cell_count_.load (std::memory_order_relaxed) != 0) {
+            // a new record survives the first eviction passing over it
+            referenceSlot (cell_addr, info.slot);
+        }
+    }
+
+    /** slotExpired
+     *  @note: whether the record in slot has passed its PutWithTTL deadline.
+     */
+    inline bool slotExpired (SlotType* slot) {
+        if constexpr (is_key_flat && is_value_flat) {
+            return false;
+        } else {
+            char* entry = slot->entry;
+            return ExpiringEntry::Has (entry) &&
+                   ExpiringEntry::Deadline (entry) <= util::NowNanos ();
+        }
+    }
+
+    // the slot holding the key findSlotForInsert found, nullptr if it is missing or expired
+    inline SlotType* liveOldSlot (char* cell_addr, const SlotInfo& info) {
+        if (!info.equal_key) {
+            return nullptr;
+        }
+        SlotType* old_slot = CellMeta::LocateSlot (cell_addr, info.old_slot);
+        return slotExpired (old_slot) ? nullptr : old_slot;
+    }
+
+    /** dropSlot
+     *  @note: delete the live slot slot_i of a cell the caller has locked, and retire its
+     *         record.
+     */
+    inline void dropSlot (char* cell_addr, uint8_t slot_i, ThreadInfo& thread_info) {
+        char* old_addr = CellMeta::LocateSlot (cell_addr, slot_i)->ReleaseAddress ();
+        if (old_addr != nullptr) {
+            epoche_.retire (old_addr, retire_records_kind_, thread_info);
+        }
+        auto version = CellMeta::LoadVersion (cell_addr);
+        version.bitmap_deleted_ |= CellMeta::SlotBit (slot_i);
+        version.seq_no_++;
+        CellMeta::StoreVersion (cell_addr, version);
+        std::atomic_thread_fence (std::memory_order_release);
+        size_.Add (-1);
+    }
+
+    // whether a bucket of cell_count cells has reached the cap of the cache mode
+    inline bool cacheFull (uint32_t cell_count) {
+        uint32_t max_cell_count = cache_cell_count_.load (std::memory_order_relaxed);
+        return max_cell_count != 0 && cell_count >= max_cell_count;
+    }
+
+    static inline typename CellMeta::ReferenceWord* referenceWord (char* cell_addr) {
+        return reinterpret_cast<typename CellMeta::ReferenceWord*> (cell_addr +
+                                                                    CellMeta::kReferenceOffset);
+    }
+
+    // mark slot_i of a cell as recently used, lookups do it without the cell lock
+    static inline void referenceSlot (char* cell_addr, int slot_i) {
+        auto* word = referenceWord (cell_addr);
+        typename CellMeta::ReferenceWord bit = CellMeta::SlotBit (slot_i);
+        if ((__atomic_load_n (word, __ATOMIC_RELAXED) & bit) == 0) {
+            __atomic_fetch_or (word, bit, __ATOMIC_RELAXED);
+        }
+    }
+
+    /** evictSlot
+     *  @note: drop a live slot of a full cell the caller has locked, to make room in a
+     *         bucket at the cap of the cache mode. The hand starts at a slot picked by the
+     *         sequence number of the cell and passes the referenced slots, clearing their
+     *         bits, up to the first slot not referenced. If all are, the first one goes.
+     */
+    inline void evictSlot (char* cell_addr, ThreadInfo& thread_info) {
+        CellMeta meta (cell_addr);
+        uint8_t live[CellMeta::SlotMaxRange () + 1];
+        int live_count = 0;
+        for (int i : meta.ValidBitSet ()) {
+            live[live_count++] = i;
+        }
+        if (live_count == 0) {
+            return;
+        }
+        auto* word = referenceWord (cell_addr);
+        int hand = meta.GetVersion ().seq_no_ % live_count;
+        int victim = live[hand];
+        for (int n = 0; n < live_count; n++) {
+            int slot_i = live[(hand + n) % live_count];
+            typename CellMeta::ReferenceWord bit = CellMeta::SlotBit (slot_i);
+            if ((__atomic_fetch_and (word, ~bit, __ATOMIC_RELAXED) & bit) == 0) {
+                victim = slot_i;
+                break;
+            }
+        }
+        dropSlot (cell_addr, victim, thread_info);
+        evictions_.fetch_add (1, std::memory_order_relaxed);
+    }
+
+    /** expiredSlot
+     *  @note: a live slot of the cell whose record has expired, or -1. Only searched once
+     *         PutWithTTL has been called, as it reads the records.
+     */
+    inline int expiredSlot (char* cell_addr, CellMeta& meta) {
+        if constexpr (!is_key_flat || !is_value_flat) {
+            if (expiring_records_.load (std::memory_order_relaxed)) {
+                uint64_t now = util::NowNanos ();
+                for (int i : meta.ValidBitSet ()) {
+                    if (ExpiringEntry::Expired (CellMeta::LocateSlot (cell_addr, i)->entry, now)) {
+                        return i;
+                    }
+                }
+            }
+        }
+        return -1;
+    }
+
+    /** PutValue
+     *  @note: the value functor of Put. A value functor is called under the lock of the
+     *         key's cells, or of its bucket, as value_fn (cell_addr, old_slot), with the
+     *         slot holding the key and its cell, or two nullptrs if the key is missing. It
+     *         returns the value to store, or nullptr to leave the key as it is.
+     */
+    struct PutValue {
+        const T& value;
+        inline const T* operator() (char* cell_addr, SlotType* old_slot) { return &value; }
+    };
+
+    // the result of insertSlotInCells
+    enum class CellWrite {
+        kDone,    // the key is written
+        kMoved,   // the bucket has been split into the next directory
+        kBucket,  // the write has to take the bucket lock
+    };
+
+    /** lockBucketCell
+     *  @note: lock a cell of a bucket whose meta was snapshot unlocked. Return false, and do
+     *         not hold the cell, if the bucket meta has changed meanwhile.
+     */
+    inline bool lockBucketCell (BucketMeta* bucket_meta, BucketMeta snapshot, char* cell_addr,
+                                ThreadInfo& thread_info) {
+        if (snapshot.IsLocked ()) {
+            return false;
+        }
+        if TURBO_UNLIKELY (!tryLockCell (cell_addr)) {
+            if constexpr (kTurboHashStats) {
+                countStat (threadStats (thread_info).cell_contended);
+            }
+            do {
+                TURBO_CPU_RELAX ();
+                if (bucket_meta->Load ().data_ != snapshot.data_) {
+                    return false;
+                }
+            } while (!tryLockCell (cell_addr));
+        }
+        // a bucket lock taken before the cell lock waits for it, one taken after fails here
+        if (bucket_meta->Load ().data_ != snapshot.data_) {
+            unlockCell (cell_addr);
+            return false;
+        }
+        return true;
+    }
+
+    /** insertSlotInCells
+     *  @note: write the value value_fn picks for a key holding the lock of the first cell
+     *         the key probes, which all writers of the key take first, and of the cell the
+     *         slot is written in. Writers of other keys in the bucket are not blocked.
+     *         value_fn is called as by insertSlotLocked. Return kBucket if the bucket is
+     *         under incremental rehash, still reads the zero cells or has no room for the
+     *         key, then the write has to be done under the bucket lock.
+     */
+    template <typename ValueFn>
+    inline CellWrite insertSlotInCells (Directory* dir, const Key& key, size_t hash_value,
+                                        PartialHash& partial_hash, ValueFn& value_fn,
+                                        ThreadInfo& thread_info, uint64_t deadline) {
+        uint32_t bucket_i = dir->BucketIndex (partial_hash.bucket_hash_);
+        BucketMeta* bucket_meta = dir->Bucket (bucket_i);
+        while (true) {
+            BucketMeta snapshot = bucket_meta->Load ();
+            if TURBO_UNLIKELY (snapshot.IsMoved ()) {
+                return CellWrite::kMoved;
+            }
+            if TURBO_UNLIKELY (snapshot.IsMigrating ()) {
+                return CellWrite::kBucket;
+            }
+            if TURBO_UNLIKELY (snapshot.IsLocked ()) {
+                // a rehash of the bucket is running
+                TURBO_CPU_RELAX ();
+                continue;
+            }
+            if TURBO_UNLIKELY (isZeroCells (snapshot.Address ())) {
+                return CellWrite::kBucket;
+            }
+            char* home_addr =
+                locateCell (snapshot.Address (),
+                            {bucket_i, H1ToHash (partial_hash.H1_) & snapshot.CellCountMask ()});
+            if (!lockBucketCell (bucket_meta, snapshot, home_addr, thread_info)) {
+                continue;
+            }
+            // no other thread can insert the key now
+            auto store = [&] (char* cell_addr, const SlotInfo& target_slot) {
+                SlotType* old_slot = liveOldSlot (cell_addr, target_slot);
+                const T* value = value_fn (old_slot ? cell_addr : nullptr, old_slot);
+                if (value != nullptr) {
+                    insertToSlotAndGC (hash_value, key, *value, cell_addr, target_slot,
+                                       thread_info, deadline);
+                }
+            };
+            FindSlotForInsertResult res = findSlotForInsert (dir, key, partial_hash);
+            if (!res.find && cacheFull (snapshot.CellCount ())) {
+                // the bucket may not grow, make room in the cell the key probes first
+                evictSlot (home_addr, thread_info);
+                res = findSlotForInsert (dir, key, partial_hash);
+            }
+            if (!res.find) {
+                unlockCell (home_addr);
+                return CellWrite::kBucket;
+            }
+            char* cell_addr =
+                locateCell (res.search_bucket_addr, {res.target_slot.bucket, res.target_slot.cell});
+            if (cell_addr == home_addr) {
+                store (cell_addr, res.target_slot);
+                unlockCell (home_addr);
+                if constexpr (kTurboHashStats) {
+                    countInsert (thread_info, res.target_slot, snapshot.CellCountMask ());
+                }
+                return CellWrite::kDone;
+            }
+            // a slot chosen in another cell has to be found again under the lock of that cell,
+            // and a cell is never waited for while holding one
+            if (!tryLockCell (cell_addr)) {
+                if constexpr (kTurboHashStats) {
+                    countStat (threadStats (thread_info).cell_contended);
+                }
+            } else {
+                FindSlotForInsertResult again = findSlotForInsert (dir, key, partial_hash);
+                bool same_cell = again.find && again.target_slot.cell == res.target_slot.cell;
+                if (same_cell) {
+                    store (cell_addr, again.target_slot);
+                }
+                unlockCell (cell_addr);
+                if (same_cell) {
+                    unlockCell (home_addr);
+                    if constexpr (kTurboHashStats) {
+                        countInsert (thread_info, again.target_slot, snapshot.CellCountMask ());
+                    }
+                    return CellWrite::kDone;
+                }
+            }
+            unlockCell (home_addr);
+            TURBO_CPU_RELAX ();
+        }
+    }
+
+    /** insertSlotLocked
+     *  @note: write the value value_fn picks for a key while the caller holds the lock of
+     *         its bucket in dir. value_fn is called once. If the bucket is full, it is
+     *         rehashed under the same lock hold and the insertion retried. Return false if
+     *         the bucket already has kCellCountLimit cells, then the directory has to be
+     *         doubled.
+     */
+    template <typename ValueFn>
+    inline bool insertSlotLocked (Directory* dir, const Key& key, size_t hash_value,
+                                  PartialHash& partial_hash, ValueFn& value_fn,
+                                  ThreadInfo& thread_info, uint64_t deadline) {
+        uint32_t bucket_i = dir->BucketIndex (partial_hash.bucket_hash_);
+        BucketMeta* bucket_meta = dir->Bucket (bucket_i);
+        const T* value = nullptr;
+        bool picked = false;
+        while (true) {
+            if TURBO_UNLIKELY (bucket_meta->IsMigrating ()) {
+                // the key must not stay in an old cell once it is written to the new ones
+                migrateForKey (dir, bucket_i, partial_hash, thread_info);
+            }
+            FindSlotForInsertResult res = findSlotForInsert (dir, key, partial_hash);
+            char* cell_addr = nullptr;
+            if (res.find) {
+                cell_addr = locateCell (res.search_bucket_addr,
+                                        {res.target_slot.bucket, res.target_slot.cell});
+            }
+            if (!picked) {
+                // the key cannot appear while the lock is held, a rehash only moves it
+                SlotType* old_slot = res.find ? liveOldSlot (cell_addr, res.target_slot) : nullptr;
+                if (old_slot != nullptr) {
+                    value = value_fn (cell_addr, old_slot);
+                } else {
+                    value = value_fn (nullptr, nullptr);
+                }
+                picked = true;
+                if (value == nullptr) {
+                    return true;
+                }
+            }
+            if TURBO_UNLIKELY (isZeroCells (bucket_meta->Address ())) {
+                // the first write of the bucket
+                materializeBucket (dir, bucket_i);
+                continue;
+            }
+            // find a valid slot in target cell
+            if (res.find) {
+                insertToSlotAndGC (hash_value, key, *value, cell_addr, res.target_slot,
+                                   thread_info, deadline);
+                if constexpr (kTurboHashStats) {
+                    countInsert (thread_info, res.target_slot, bucket_meta->CellCountMask ());
+                }
+                return true;
+            }
+            if (bucket_meta->IsMigrating ()) {
+                // no room in the new cells, move the remaining old cells before rehashing
+                finishMigration (dir, bucket_i, thread_info);
+                continue;
+            }
+            if (cacheFull (bucket_meta->CellCount ())) {
+                evictSlot (locateCell (bucket_meta->Address (),
+                                       {bucket_i, H1ToHash (partial_hash.H1_) &
+                                                      bucket_meta->CellCountMask ()}),
+                           thread_info);
+                continue;
+            }
+            if (bucket_meta->CellCount () >= kCellCountLimit) {
+                return false;
+            }
+            // cannot find a valid slot for insertion, rehash current bucket
+            // then retry
+            if (incremental_rehash_.load (std::memory_order_relaxed)) {
+                startMigration (dir, bucket_i);
+            } else {
+                minorRehash (dir, bucket_i, thread_info);
+            }
+        }
     }
 
-    inline bool insertSlot (const Key& key, const T& value, size_t hash_value,
-                            ThreadInfo& thread_info) {
+    template <typename ValueFn>
+    inline bool insertSlot (const Key& key, size_t hash_value, ValueFn&& value_fn,
+                            ThreadInfo& thread_info, uint64_t deadline = 0) {
         // Obtain the partial hash
         PartialHash partial_hash (key, hash_value);
-    after_rehash:
-        BucketMeta* bucket_meta = locateBucket (bucketIndex (partial_hash.bucket_hash_));
-
 #ifndef PIN_KEY_TO_THREAD
-        // Obtain the bucket lock
-        BucketLockScope meta_lock (bucket_meta);
+        Directory* dir = currentDirectory ();
+        while (true) {
+            CellWrite cell_write = insertSlotInCells (dir, key, hash_value, partial_hash, value_fn,
+                                                      thread_info, deadline);
+            if (cell_write == CellWrite::kDone) {
+                return true;
+            }
+            if (cell_write == CellWrite::kMoved) {
+                dir = dir->next.load (std::memory_order_acquire);
+                continue;
+            }
+            uint32_t bucket_i = dir->BucketIndex (partial_hash.bucket_hash_);
+            BucketMeta* bucket_meta = dir->Bucket (bucket_i);
+            bool moved = false;
+            {
+                // Obtain the bucket lock to rehash the bucket or move its old cells
+                BucketLockScope meta_lock (*this, dir, bucket_i, thread_info);
+                moved = bucket_meta->IsMoved ();
+                if (!moved && insertSlotLocked (dir, key, hash_value, partial_hash, value_fn,
+                                                thread_info, deadline)) {
+                    return true;
+                }
+            }
+            if (moved) {
+                // the bucket has been split into the next directory
+                dir = dir->next.load (std::memory_order_acquire);
+            } else {
+                // the bucket cannot grow any more, double the directory without holding
+                // the bucket lock
+                growDirectory (dir, thread_info);
+                dir = currentDirectory ();
+            }
+        }
 #else
+        auto store = [&] (char* cell_addr, const SlotInfo& info) {
+            SlotType* old_slot = liveOldSlot (cell_addr, info);
+            const T* value = value_fn (old_slot ? cell_addr : nullptr, old_slot);
+            if (value != nullptr) {
+                insertToSlotAndGC (hash_value, key, *value, cell_addr, info, thread_info,
+                                   deadline);
+            }
+        };
+    after_rehash:
+        uint32_t bucket_i = bucketIndex (partial_hash.bucket_hash_);
+        BucketMeta* bucket_meta = locateBucket (bucket_i);
+
         // Check if the bucket is locked for rehashing. Wait entil is unlocked.
         while (bucket_meta->IsRehashLocked ()) {
             TURBO_CPU_RELAX ();
         }
-#endif
 
-        FindSlotForInsertResult res = findSlotForInsert (key, partial_hash);
+        BucketMeta bucket_snapshot = bucket_meta->Load ();
+        FindSlotForInsertResult res = findSlotForInsert (currentDirectory (), key, partial_hash);
 
         // find a valid slot in target cell
         if (res.find) {
-#ifndef PIN_KEY_TO_THREAD
-            char* bucket_addr = bucket_meta->Address ();
-            char* cell_addr =
-                locateCell (bucket_addr, {res.target_slot.bucket, res.target_slot.cell});
-            insertToSlotAndGC (hash_value, key, value, cell_addr, res.target_slot, thread_info);
-            return true;
-#else
             // Obtain the bucket lock
-            BucketLockScope meta_lock (bucket_meta);
+            BucketLockScope meta_lock (*this, currentDirectory (), bucket_i, thread_info);
             // it is possible after obtain the bucket lock,
-            // the bucket already be rehashed. we need to compare the old address in
-            // res with current one
+            // the bucket already be rehashed. we need to compare the cells in res
+            // with current ones, a rehash in place keeps their address
             char* bucket_addr = bucket_meta->Address ();
-            if (bucket_addr != res.search_bucket_addr) {
+            if (bucket_addr != res.search_bucket_addr ||
+                !bucket_meta->Load ().SameCells (bucket_snapshot)) {
+                goto after_rehash;
+            }
+            if TURBO_UNLIKELY (isZeroCells (bucket_addr)) {
+                materializeBucket (currentDirectory (), bucket_i);
                 goto after_rehash;
             }
 
@@ -2169,10 +5717,13 @@ private:
             CellMeta meta (cell_addr);  // obtain the meta part after lock
 
             if TURBO_LIKELY (!meta.Occupy (res.target_slot.slot) ||
-                             meta.IsDeleted (res.target_slot.slot)) {
+                             meta.IsDeleted (res.target_slot.slot) ||
+                             (!res.target_slot.equal_key &&
+                              slotExpired (CellMeta::LocateSlot (cell_addr,
+                                                                 res.target_slot.slot)))) {
                 // If the new slot from 'findSlotForInsert' is not occupied, insert
                 // directly
-                insertToSlotAndGC (hash_value, key, value, cell_addr, res.target_slot, thread_info);
+                store (cell_addr, res.target_slot);
                 return true;
             } else if (res.target_slot.equal_key) {
                 // If this is an update request and the backup slot is occupied,
@@ -2185,7 +5736,7 @@ private:
                 }
 
                 res.target_slot.slot = *backup_bitset;
-                insertToSlotAndGC (hash_value, key, value, cell_addr, res.target_slot, thread_info);
+                store (cell_addr, res.target_slot);
                 return true;
             } else {
                 // current new slot has been occupied by another concurrent thread.
@@ -2194,41 +5745,38 @@ private:
 
                 if (erased_bitset.validCount () != 0) {
                     res.target_slot.slot = *erased_bitset;
-                    insertToSlotAndGC (hash_value, key, value, cell_addr, res.target_slot,
-                                       thread_info);
+                    store (cell_addr, res.target_slot);
                     return true;
                 } else if (backup_bitset.validCount () >= 2) {
                     res.target_slot.slot = *backup_bitset;
-                    insertToSlotAndGC (hash_value, key, value, cell_addr, res.target_slot,
-                                       thread_info);
+                    store (cell_addr, res.target_slot);
                     return true;
                 }
 
                 goto after_rehash;
             }
-#endif
         } else {
             // cannot find a valid slot for insertion, rehash current bucket
             // then retry
-#ifndef PIN_KEY_TO_THREAD
-            MinorRehash (res.target_slot.bucket, thread_info);
-#else
+
             // Obtain the Bucket rehash lock. Otherwise, other thread is already
             // rehashing.
             if (bucket_meta->TryRehashLock ()) {
                 // Obtain the bucket lock, so other thread will not insert during
                 // rehashing
-                BucketLockScope meta_lock (bucket_meta);
+                BucketLockScope meta_lock (*this, currentDirectory (), bucket_i, thread_info);
 
                 // minor rehash will change the address part of bucket_meta
-                MinorRehash (res.target_slot.bucket, thread_info);
+                if (!bucket_meta->IsMoved ()) {
+                    MinorRehash (res.target_slot.bucket, thread_info);
+                }
                 bucket_meta->RehashUnlock ();
             }
-#endif
             goto after_rehash;
         }
 
         return false;
+#endif
     }
 
     template <typename T1, bool key_flat>
@@ -2259,15 +5807,16 @@ private:
      *          second:  whether we can find a valid (empty or belong to the same
      * key) slot for insertion ! We cannot insert if the second is false.
      */
-    inline FindSlotForInsertResult findSlotForInsert (const Key& key, PartialHash& partial_hash) {
-        uint32_t bucket_i = bucketIndex (partial_hash.bucket_hash_);
+    inline FindSlotForInsertResult findSlotForInsert (Directory* dir, const Key& key,
+                                                      PartialHash& partial_hash) {
+        uint32_t bucket_i = dir->BucketIndex (partial_hash.bucket_hash_);
         auto h2_hash_vec = CellMeta::SetHashVec (partial_hash.H2_);
         int64_t cell_to_insert = -1;
         uint8_t slot_to_insert = 0;
-        BucketMeta* bucket_meta = locateBucket (bucket_i);
-        char* search_bucket_addr = bucket_meta->Address ();
+        BucketMeta bucket_meta = dir->Bucket (bucket_i)->Load ();
+        char* search_bucket_addr = bucket_meta.Address ();
 
-        ProbeWithinBucket probe (H1ToHash (partial_hash.H1_), bucket_meta->CellCountMask (),
+        ProbeWithinBucket probe (H1ToHash (partial_hash.H1_), bucket_meta.CellCountMask (),
                                  bucket_i);
         int probe_count = 0;  // limit probe times
         while (probe && (probe_count++ < ProbeWithinBucket::MAX_PROBE_LEN)) {
@@ -2310,6 +5859,13 @@ private:
             if (erase_bitset.validCount () != 0) {
                 cell_to_insert = offset.second;
                 slot_to_insert = *erase_bitset;
+            } else if (cell_to_insert == -1 && meta.Full ()) {
+                // an expired slot is reused like a deleted one
+                int expired_slot = expiredSlot (cell_addr, meta);
+                if (expired_slot >= 0) {
+                    cell_to_insert = offset.second;
+                    slot_to_insert = expired_slot;
+                }
             }
 
             // Reach to the search path end
@@ -2357,19 +5913,100 @@ private:
     struct FindSlotResult {
         RecordType record;
         bool find;
+        // only set with TURBO_HASH_STATS
+        uint16_t probes;   // cells probed
+        uint16_t retries;  // reads repeated, see findSlot
     };
 
-    // Based on version retry lock-free read.
+    // the result of a lookup, see FindSlotResult
+    static inline FindSlotResult findResult (const RecordType& record, bool find, int probes,
+                                             int retries) {
+        FindSlotResult res{record, find, 0, 0};
+        if constexpr (kTurboHashStats) {
+            res.probes = probes;
+            res.retries = retries;
+        }
+        return res;
+    }
+
+    inline void countFind (ThreadInfo& thread_info, const FindSlotResult& res) {
+        ThreadStats& stats = threadStats (thread_info);
+        countProbes (stats.find_probes, res.probes);
+        countStat (stats.find_retries, res.retries);
+    }
+
+    using H2HashVec = decltype (CellMeta::SetHashVec (0));
+
+    // Based on version retry lock-free read. With kReference the slot found is marked
+    // recently used for the cache mode
+    template <bool kReference = false>
     inline FindSlotResult findSlot (const Key& key, size_t hash_value) {
         PartialHash partial_hash (key, hash_value);
-        uint32_t bucket_i = bucketIndex (partial_hash.bucket_hash_);
         auto h2_hash_vec = CellMeta::SetHashVec (partial_hash.H2_);
-        BucketMeta* bucket_meta = locateBucket (bucket_i);
-        char* search_bucket_addr = bucket_meta->Address ();
-        ProbeWithinBucket probe (H1ToHash (partial_hash.H1_), bucket_meta->CellCountMask (),
-                                 bucket_i);
+        Directory* dir = currentDirectory ();
+        int retries = 0;
+        while (true) {
+            uint32_t bucket_i = dir->BucketIndex (partial_hash.bucket_hash_);
+            BucketMeta bucket_meta = dir->ReadBucket (bucket_i)->Load ();
+            if TURBO_UNLIKELY (bucket_meta.IsMoved ()) {
+                // the bucket has been split into the next directory
+                dir = dir->next.load (std::memory_order_acquire);
+                continue;
+            }
+            FindSlotResult res;
+            if TURBO_UNLIKELY (bucket_meta.IsMigrating ()) {
+                BucketMigration* migration =
+                    dir->migrations[bucket_i].load (std::memory_order_acquire);
+                if (migration == nullptr || migration->new_addr != bucket_meta.Address ()) {
+                    // the incremental rehash has just finished, read the bucket again
+                    continue;
+                }
+                res = findSlotMigrating (key, partial_hash, h2_hash_vec, bucket_i, bucket_meta,
+                                         migration);
+            } else {
+                res = findInCells<kReference> (key, partial_hash, h2_hash_vec, bucket_i,
+                                               bucket_meta.Address (),
+                                               bucket_meta.CellCountMask ());
+            }
+            if TURBO_UNLIKELY (cellsChanged (dir->ReadBucket (bucket_i), bucket_meta)) {
+                if constexpr (kTurboHashStats) {
+                    retries++;
+                }
+                continue;
+            }
+            if constexpr (kTurboHashStats) {
+                res.retries += retries;
+            }
+            return res;
+        }
+    }
+
+    /** cellsChanged
+     *  @note: whether a lookup in the cells of snapshot has to be retried, because their
+     *         slots were moved under it by rehashInPlace. Lookups read the bucket meta
+     *         like a sequence lock then. Only cell allocators that expand in place need it.
+     */
+    inline bool cellsChanged (BucketMeta* bucket_meta, BucketMeta snapshot) {
+        if constexpr (kRehashInPlace) {
+            if (snapshot.IsRehashingInPlace ()) {
+                TURBO_CPU_RELAX ();
+                return true;
+            }
+            std::atomic_thread_fence (std::memory_order_acquire);
+            return !bucket_meta->Load ().SameCells (snapshot);
+        }
+        return false;
+    }
+
+    // probe the cells at search_bucket_addr for the key, see findSlot for kReference
+    template <bool kReference = false>
+    inline FindSlotResult findInCells (const Key& key, PartialHash& partial_hash,
+                                       const H2HashVec& h2_hash_vec, uint32_t bucket_i,
+                                       char* search_bucket_addr, uint32_t cell_count_mask) {
+        ProbeWithinBucket probe (H1ToHash (partial_hash.H1_), cell_count_mask, bucket_i);
 
         int probe_count = 0;  // limit probe times
+        int retries = 0;
         while (probe && (probe_count++ < ProbeWithinBucket::MAX_PROBE_LEN)) {
             auto offset = probe.offset ();
             char* cell_addr = locateCell (search_bucket_addr, offset);
@@ -2381,14 +6018,22 @@ private:
                 if TURBO_LIKELY (slot->H1 == partial_hash.H1_) {
                     if (SlotKeyEqual<Key, is_key_flat>{}(key, slot)) {
                         RecordType record = slot->Record ();
+                        bool expired = slotExpired (slot);
                         auto version = CellMeta::LoadVersion (cell_addr);
                         auto old_version = meta.GetVersion ();
                         if (old_version.seq_no_ + 1 < version.seq_no_) {
                             // if version changed since last read, and the seq_no advances more
                             // than 1 (which means >= 2 writes), we retry.
+                            if constexpr (kTurboHashStats) {
+                                retries++;
+                            }
                             goto find_retry;
                         }
-                        return {record, true};
+                        if constexpr (kReference) {
+                            referenceSlot (cell_addr, i);
+                        }
+                        // an expired record is a miss, the key is in no other slot
+                        return findResult (record, !expired, probe_count, retries);
                     }
                 }
             }
@@ -2397,7 +6042,7 @@ private:
             // does't exist.
             if (!meta.Full ()) {
                 // printf ("%d\n", probe_count);
-                return {{}, false};
+                return findResult ({}, false, probe_count, retries);
             }
 
             probe.next ();
@@ -2405,25 +6050,102 @@ private:
 
         // printf ("%d\n", probe_count);
         // after all the probe, no key exist
-        return {{}, false};
+        return findResult ({}, false, probe_count, retries);
+    }
+
+    /** findSlotMigrating
+     *  @note: lookup in a bucket under incremental rehash, whose slots are either in the
+     *         new cells or in old cells not migrated yet. The new cells are searched first.
+     *         If the key is not in the old cells either, but one of the old cells it probes
+     *         has been migrated meanwhile, the key may have just moved, so the new cells are
+     *         searched again.
+     */
+    FindSlotResult findSlotMigrating (const Key& key, PartialHash& partial_hash,
+                                      const H2HashVec& h2_hash_vec, uint32_t bucket_i,
+                                      BucketMeta& bucket_meta, BucketMigration* migration) {
+        FindSlotResult res = findInCells (key, partial_hash, h2_hash_vec, bucket_i,
+                                          bucket_meta.Address (), bucket_meta.CellCountMask ());
+        if (res.find) {
+            return res;
+        }
+
+        bool migrated = false;
+        ProbeWithinBucket probe (H1ToHash (partial_hash.H1_), migration->old_cell_count - 1,
+                                 bucket_i);
+        int probe_count = 0;  // limit probe times
+        while (probe && (probe_count++ < ProbeWithinBucket::MAX_PROBE_LEN)) {
+            char* cell_addr = locateCell (migration->old_addr, probe.offset ());
+        find_old_retry:
+            CellMeta meta (cell_addr);
+            if (CellMeta::IsMigrated (cell_addr)) {
+                migrated = true;
+            } else {
+                for (int i : meta.MatchBitSet (h2_hash_vec)) {
+                    SlotType* slot = CellMeta::LocateSlot (cell_addr, i);
+                    if (slot->H1 == partial_hash.H1_ &&
+                        SlotKeyEqual<Key, is_key_flat>{}(key, slot)) {
+                        RecordType record = slot->Record ();
+                        bool expired = slotExpired (slot);
+                        auto version = CellMeta::LoadVersion (cell_addr);
+                        auto old_version = meta.GetVersion ();
+                        if (old_version.seq_no_ + 1 < version.seq_no_) {
+                            goto find_old_retry;
+                        }
+                        return findResult (record, !expired, res.probes + probe_count,
+                                           res.retries);
+                    }
+                }
+            }
+            if (!meta.Full ()) {
+                break;
+            }
+            probe.next ();
+        }
+
+        if (migrated) {
+            return findInCells (key, partial_hash, h2_hash_vec, bucket_i, bucket_meta.Address (),
+                                bucket_meta.CellCountMask ());
+        }
+        return findResult ({}, false, res.probes + probe_count, res.retries);
     }
 
     inline bool deleteSlot (const Key& key, size_t hash_value, ThreadInfo& thread_info) {
         PartialHash partial_hash (key, hash_value);
-        uint32_t bucket_i = bucketIndex (partial_hash.bucket_hash_);
         auto h2_hash_vec = CellMeta::SetHashVec (partial_hash.H2_);
+        Directory* dir = currentDirectory ();
+        // the new cells of the incremental rehash this key has been migrated for
+        char* migrated_addr = nullptr;
 
     after_rehash:
-        BucketMeta* bucket_meta = locateBucket (bucket_i);
+        uint32_t bucket_i = dir->BucketIndex (partial_hash.bucket_hash_);
+        BucketMeta* bucket_meta = dir->Bucket (bucket_i);
 
 #ifdef PIN_KEY_TO_THREAD
         while (bucket_meta->IsRehashLocked ()) {
             TURBO_CPU_RELAX ();
         }
 #endif
-        char* search_bucket_addr = bucket_meta->Address ();
+        BucketMeta bucket_snapshot = bucket_meta->Load ();
+        if TURBO_UNLIKELY (bucket_snapshot.IsMoved ()) {
+            // the bucket has been split into the next directory
+            dir = dir->next.load (std::memory_order_acquire);
+            goto after_rehash;
+        }
+        if TURBO_UNLIKELY (bucket_snapshot.IsMigrating () &&
+                           bucket_snapshot.Address () != migrated_addr) {
+            // move the old cells the key probes, then it can only be in the new cells
+            {
+                BucketLockScope meta_lock (*this, dir, bucket_i, thread_info);
+                if (bucket_meta->IsMigrating () && !bucket_meta->IsMoved ()) {
+                    migrateForKey (dir, bucket_i, partial_hash, thread_info);
+                    migrated_addr = bucket_meta->Address ();
+                }
+            }
+            goto after_rehash;
+        }
+        char* search_bucket_addr = bucket_snapshot.Address ();
 
-        ProbeWithinBucket probe (H1ToHash (partial_hash.H1_), bucket_meta->CellCountMask (),
+        ProbeWithinBucket probe (H1ToHash (partial_hash.H1_), bucket_snapshot.CellCountMask (),
                                  bucket_i);
 
         int probe_count = 0;  // limit probe times
@@ -2436,36 +6158,58 @@ private:
             for (int i : meta.MatchBitSet (h2_hash_vec)) {
                 SlotType* slot = CellMeta::LocateSlot (cell_addr, i);  // locate the slot reference
                 if TURBO_LIKELY (slot->H1 == partial_hash.H1_) {
-                    // Obtain the bucket lock
-                    BucketLockScope meta_lock (bucket_meta);
+                    // Lock the cell. A bucket under incremental rehash is only written under
+                    // its bucket lock.
+                    std::optional<BucketLockScope> meta_lock;
+                    std::optional<CellUnlockScope> cell_lock;
+                    if (bucket_snapshot.IsMigrating ()) {
+                        meta_lock.emplace (*this, dir, bucket_i, thread_info);
+                    } else if (lockBucketCell (bucket_meta, bucket_snapshot, cell_addr,
+                                               thread_info)) {
+                        cell_lock.emplace (cell_addr);
+                    } else {
+                        // the bucket is being rehashed
+                        TURBO_CPU_RELAX ();
+                        goto after_rehash;
+                    }
 
                     auto version = CellMeta::LoadVersion (cell_addr);
                     auto old_version = meta.GetVersion ();
                     if (old_version.seq_no_ + 1 < version.seq_no_) {
                         goto delete_retry;
                     }
+                    // another thread may have deleted this slot before we got the lock
+                    if ((version.bitmap_deleted_ & CellMeta::SlotBit (i)) ||
+                        !(version.bitmap_ & CellMeta::SlotBit (i))) {
+                        goto delete_retry;
+                    }
 
                     if (SlotKeyEqual<Key, is_key_flat>{}(key, slot)) {
                         // If this key exsit, set the deleted bitmap
 
-                        // it is possible after obtain the bucket lock,
+                        // it is possible after obtain the lock,
                         // the bucket has already been rehashed. we need to compare the old
-                        // address
-                        char* bucket_addr = bucket_meta->Address ();
-                        if (bucket_addr != search_bucket_addr) {
+                        // cells, which a rehash in place keeps
+                        if (!bucket_meta->Load ().SameCells (bucket_snapshot)) {
                             goto after_rehash;
                         }
 
                         // Garbage collection for deleted record
+                        bool expired = slotExpired (slot);
                         char* old_addr = slot->ReleaseAddress ();
                         if (old_addr != nullptr) {
-                            epoche_.markNodeForDeletion ([=] () { free (old_addr); }, thread_info);
+                            epoche_.retire (old_addr, retire_records_kind_, thread_info);
                         }
 
-                        version.bitmap_deleted_ |= (1 << i);
+                        version.bitmap_deleted_ |= CellMeta::SlotBit (i);
                         version.seq_no_++;
                         CellMeta::StoreVersion (cell_addr, version);
-                        return true;
+                        size_.Add (-1);
+                        if constexpr (kTurboHashStats) {
+                            countProbes (threadStats (thread_info).delete_probes, probe_count);
+                        }
+                        // an expired record is dropped, but was already missing
+                        return !expired;
                     }
                 }
             }
@@ -2473,40 +6217,85 @@ private:
             // If this cell still has more than one empty slot, then it means the key
             // does't exist.
             if (!meta.Full ()) {
-                return false;
+                break;
             }
 
             probe.next ();
         }
 
+        if TURBO_UNLIKELY (cellsChanged (bucket_meta, bucket_snapshot)) {
+            goto after_rehash;
+        }
+        if constexpr (kTurboHashStats) {
+            countProbes (threadStats (thread_info).delete_probes, probe_count);
+        }
         return false;
     }
 
 private:
     CellAllocator cell_allocator_;
     RecordAllocator record_allocator_;
-    BucketMeta* buckets_;
-    const size_t bucket_count_ = 0;
-    const size_t bucket_mask_ = 0;
+    std::atomic<Directory*> directory_;
+    std::mutex directory_mutex_;  // serialize directory doublings
+    std::atomic<bool> incremental_rehash_{false};
+    std::atomic<uint32_t> cache_cell_count_{0};  // see SetCacheMode, 0: not a cache
+    std::atomic<size_t> evictions_{0};
+
+    NumaOptions numa_options_;  // node_count resolved by the constructor
+
+    // background maintenance threads, see StartMaintenance
+    MaintenanceOptions maintenance_options_;
+    std::vector<std::thread> maintenance_threads_;
+    std::mutex maintenance_mutex_;
+    std::condition_variable maintenance_cv_;
+    std::atomic<bool> maintenance_stop_{true};
+    std::atomic<size_t> maintenance_scans_{0};
+    std::atomic<size_t> maintenance_grown_{0};
+    std::atomic<size_t> maintenance_compacted_{0};
+    std::atomic<size_t> maintenance_shrunk_{0};
+    std::atomic<size_t> maintenance_migrated_{0};
+    std::atomic<size_t> maintenance_doubled_{0};
+    std::atomic<size_t> maintenance_expired_{0};
+    std::atomic<bool> expiring_records_{false};  // set by the first PutWithTTL
+    // one per registry slot of epoche_ with TURBO_HASH_STATS, see TableStats
+    std::unique_ptr<ThreadStats[]> thread_stats_;
     std::atomic<size_t> capacity_;
-    std::atomic<size_t> size_;
+    SizeCounter size_;
 
     Epoche epoche_{256};
+    // kCellCountLimit read-only zero cells mapped once, shared by the buckets not written
+    // yet. Reading them faults in the zero page only.
+    char* zero_cells_;
+    int retire_cells_kind_;
+    int retire_records_kind_;
 
     static constexpr int kCellSize = CellMeta::CellSize ();
     static constexpr int kCellSizeLeftShift = CellMeta::CellSizeLeftShift;
+    static constexpr int kCacheLineSize = 64;
+    // number of keys whose memory accesses are overlapped in FindBatch
+    static constexpr size_t kFindBatchGroup = 16;
+    // BulkLoad sizes the buckets to keep their load factor below this
+    static constexpr double kBulkLoadFactor = 0.75;
+    // old cells moved by each write to a bucket under incremental rehash
+    static constexpr int kMigrateCellChunk = 4;
+    static constexpr size_t kZeroCellsSize = (size_t)kCellCountLimit * kCellSize;
+    // MinorRehash moves the slots within their cells, see rehashInPlace
+    static constexpr bool kRehashInPlace = util::CanExpandInPlace<CellAllocator>::value;
 };
 
 };  // namespace detail
 
 // When using std::string for Key, the KeyEqual uses std::equal_to<util::Slice>
 template <typename Key, typename T, typename Hash = hash<Key>,
-          typename KeyEqual = std::equal_to<Key>>
+          typename KeyEqual = std::equal_to<Key>, typename CellLayout = Cell128,
+          typename CellAllocator = util::AlignedCellAllocator,
+          typename BucketLock = util::SpinBitLock>
 using unordered_map = detail::TurboHashTable<
     Key, T, Hash,
     typename std::conditional<std::is_same<Key, std::string>::value == false /* is numeric */,
                               KeyEqual, std::equal_to<util::Slice>>::type,
-    kTurboCellCountLimit>;
+    kTurboCellCountLimit, util::StripedCounter<64>, util::MallocRecordAllocator, CellLayout,
+    CellAllocator, BucketLock>;
 };  // namespace turbo
 
 #endif
@@ -1,6 +1,9 @@
 #pragma once
+#include <linux/perf_event.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -35,4 +38,57 @@ void debug_perf_stop (void) {
     if (__perf_pid > 0) kill (__perf_pid, SIGINT);
 }
 
+// Count one hardware event of the calling thread and of every thread it creates after the
+// counter is constructed. Valid () is false when perf_event_open is not permitted.
+class PerfCounter {
+public:
+    PerfCounter (uint32_t type, uint64_t config) {
+        struct perf_event_attr attr;
+        memset (&attr, 0, sizeof (attr));
+        attr.size = sizeof (attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    // dTLB load misses
+    static PerfCounter DTLBLoadMisses () {
+        return PerfCounter (PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                                                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    }
+
+    PerfCounter (PerfCounter&& other) : fd_ (other.fd_) { other.fd_ = -1; }
+    PerfCounter (const PerfCounter&) = delete;
+    PerfCounter& operator= (const PerfCounter&) = delete;
+
+    ~PerfCounter () {
+        if (fd_ >= 0) close (fd_);
+    }
+
+    bool Valid () const { return fd_ >= 0; }
+
+    void Start () {
+        if (fd_ < 0) return;
+        ioctl (fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl (fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    // stop counting and return the events counted since Start
+    uint64_t Stop () {
+        if (fd_ < 0) return 0;
+        ioctl (fd_, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t count = 0;
+        if (read (fd_, &count, sizeof (count)) != sizeof (count)) return 0;
+        return count;
+    }
+
+private:
+    int fd_;
+};
+
 }  // namespace util
\ No newline at end of file
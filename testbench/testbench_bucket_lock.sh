@@ -0,0 +1,13 @@
+#!/usr/bin/env bash
+SOCKET_NO=0
+NUM=120960000
+# Insert 120 million and run YCSB-A on zipfian keys with every bucket lock policy.
+# Few cells per bucket, so the load rehashes often under contention.
+
+for t in 64 32 16 8 4 2 1
+do
+    for lock in spin backoff ticket
+    do
+        numactl -N $SOCKET_NO sudo ../release/hash_bench --thread=$t --benchmarks=load,ycsba,lockstats --stats_interval=200000000 --num=${NUM} --bucket_count=65536 --cell_count=2 --ycsb_zipf=true --zipf_theta=0.99 --bucket_lock=$lock | tee bucket_lock.${lock}_$t
+    done
+done
@@ -0,0 +1,14 @@
+#!/usr/bin/env bash
+SOCKET_NO=0
+NUM=120960000
+# Load 120 million keys, then look up zipfian keys and insert the misses, with buckets
+# capped at a few cells so the table evicts instead of growing. Compare the hit ratio and
+# the throughput of each cap against an uncapped table (cache_cells=0).
+
+for cells in 0 16 8 4
+do
+    for t in 16 8 4 2 1
+    do
+        numactl -N $SOCKET_NO sudo ../release/hash_bench --thread=$t --benchmarks=load,cache --stats_interval=200000000 --num=${NUM} --read=${NUM} --bucket_count=65536 --cell_count=1 --cache_cells=$cells --zipf_theta=0.99 2>&1 | tee cache.${cells}_$t
+    done
+done
@@ -0,0 +1,14 @@
+#!/usr/bin/env bash
+SOCKET_NO=0
+NUM=120960000
+# Insert 120 million starting from one cell per bucket, so every bucket doubles many times,
+# with cell arrays from aligned_alloc and with reserved address ranges that grow in place.
+# Compare the load throughput and the peak resident memory of the two.
+
+for t in 16 8 4 2 1
+do
+    for reserved in false true
+    do
+        numactl -N $SOCKET_NO sudo /usr/bin/time -v ../release/hash_bench --thread=$t --benchmarks=load,readall --stats_interval=200000000 --num=${NUM} --bucket_count=65536 --cell_count=1 --reserved_cells=$reserved 2>&1 | tee reserved_cells.${reserved}_$t
+    done
+done
@@ -0,0 +1,12 @@
+#!/usr/bin/env bash
+SOCKET_NO=0
+NUM=120960000
+# Insert 120 million, each thread overwrites 10 million Zipf-skewed keys.
+# ../release_bucketlock is hash_bench built before the per-cell write locks.
+
+for t in 128 96 64 32 16 8 4 2 1
+do
+    sudo ../release/hash_bench --thread=$t --benchmarks=load,skewwrite --stats_interval=200000000 --write=10000000 --num=${NUM} --bucket_count=65536 --cell_count=16 --zipf_theta=0.99 | tee thread_skew.turbo_$t
+
+    sudo ../release_bucketlock/hash_bench --thread=$t --benchmarks=load,skewwrite --stats_interval=200000000 --write=10000000 --num=${NUM} --bucket_count=65536 --cell_count=16 --zipf_theta=0.99 | tee thread_skew.turbo_bucketlock_$t
+done